@@ -1,14 +1,19 @@
 // Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
-// Description: Interactive command client for manual testing (I, R c s, W c s l).
-//              Prints hex dump for reads; prompts for exactly l data bytes on writes.
+// Description: Interactive command client for manual testing (I, R c s, W c s l, RR c s n, WR c s n, T c s n, S,
+//              N, X, SR c s n, P w). Prints hex dump for reads; prompts for exactly l data bytes on writes.
+//              SAVE <file> streams the server's current snapshot into a local image file.
 // Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic disk_client_cli.c -o disk_client_cli
-// Run:           ./command_client <host> <port>
+// Run:           ./command_client <host> <port> [--qd=K]
 // Example: ./command_client 127.0.0.1 9090
+//          --qd=K sends up to K commands before waiting for replies; replies are printed in order
+//          as they arrive (handy for piping a script of commands in).
 
 // Libraries used
+#define _POSIX_C_SOURCE 200809L
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,8 +24,9 @@
 #include <unistd.h>
 
 // Constants defined
-#define _POSIX_C_SOURCE 200809L
 #define BLOCK_SIZE 128
+#define RANGE_MAX_SECTORS 256
+#define QD_MAX 1024
 
 static ssize_t read_full(int fd, void *buf, size_t n) {
     uint8_t *p = buf; size_t left = n;
@@ -63,14 +69,137 @@ static void hexdump(const uint8_t *p, size_t n) {
     }
 }
 
+// ---- Pipelining ----
+// Commands already sent whose replies have not been read yet. The server
+// answers a connection's commands in order, so this is a plain FIFO.
+typedef struct { char op; int c, s, n; } pend_t;   // op: I S R W T N X P r(RR) w(WR) q(SR) v(SR for SAVE)
+
+static pend_t g_pend[QD_MAX];
+static int g_head, g_npend, g_qd = 1;
+static FILE *g_save;                 // SAVE target while a snapshot is being streamed
+static bool g_save_failed;
+
+static void pend_push(char op, int c, int s, int n) {
+    g_pend[(g_head + g_npend++) % QD_MAX] = (pend_t){ op, c, s, n };
+}
+
+// Reads and prints the reply for the oldest pending command. Returns -1 if the connection is gone.
+static int recv_reply(int fd) {
+    pend_t p = g_pend[g_head]; g_head = (g_head + 1) % QD_MAX; g_npend--;
+    char status;
+    switch (p.op) {
+    case 'I': {
+        // One line "<cyl> <sec>\n"; read byte-wise so a pipelined reply behind it is left alone
+        char buf[128]; size_t h = 0;
+        while (h < sizeof(buf) - 1 && read_full(fd, &buf[h], 1) == 1 && buf[h++] != '\n') {}
+        if (h == 0) { perror("read"); return -1; }
+        buf[h] = '\0'; printf("Server geometry: %s", buf);
+        return 0;
+    }
+    case 'S': {
+        // Header line "STATS <len>\n", then len bytes of report text
+        char hdr[64]; size_t h = 0;
+        while (h < sizeof(hdr) - 1 && read_full(fd, &hdr[h], 1) == 1 && hdr[h] != '\n') h++;
+        hdr[h] = '\0';
+        size_t len; if (sscanf(hdr, "STATS %zu", &len) != 1) { puts("bad STATS header"); return -1; }
+        char *rep = malloc(len + 1); if (!rep) { puts("oom"); return -1; }
+        if (read_full(fd, rep, len) != (ssize_t)len) { perror("read stats"); free(rep); return -1; }
+        rep[len] = '\0'; fputs(rep, stdout); free(rep);
+        return 0;
+    }
+    case 'r':
+    case 'q':
+    case 'v': {
+        if (read_full(fd, &status, 1) != 1) { perror("read status"); return -1; }
+        if (status == '0') {
+            if (p.op == 'v') g_save_failed = true;
+            else puts(p.op == 'q' ? "SNAPSHOT READ: no snapshot or invalid c/s/n" : "RANGE READ: invalid c/s/n");
+            return 0;
+        }
+        size_t bytes = (size_t)p.n * BLOCK_SIZE;
+        uint8_t *blk = malloc(bytes); if (!blk) { puts("oom"); return -1; }
+        if (read_full(fd, blk, bytes) != (ssize_t)bytes) { perror("read range"); free(blk); return -1; }
+        if (p.op == 'v') {
+            if (fwrite(blk, 1, bytes, g_save) != bytes) g_save_failed = true;
+        } else {
+            printf("%s OK (c=%d s=%d n=%d)\n", p.op == 'q' ? "SNAPSHOT READ" : "RANGE READ", p.c, p.s, p.n);
+            hexdump(blk, bytes);
+        }
+        free(blk);
+        return 0;
+    }
+    case 'R': {
+        if (read_full(fd, &status, 1) != 1) { perror("read status"); return -1; }
+        if (status == '0') { puts("READ: invalid c/s"); return 0; }
+        uint8_t blk[BLOCK_SIZE]; if (read_full(fd, blk, BLOCK_SIZE) != BLOCK_SIZE) { perror("read blk"); return -1; }
+        printf("READ OK (c=%d s=%d)\n", p.c, p.s); hexdump(blk, BLOCK_SIZE);
+        return 0;
+    }
+    default:    // 'W' / 'w' / 'T' / 'N' / 'X' / 'P'
+        if (read_full(fd, &status, 1) != 1) { perror("read status"); return -1; }
+        if (p.op == 'P') printf(status=='1' ? "WEIGHT %d OK\n" : "WEIGHT %d REJECTED\n", p.n);
+        else if (p.op == 'N') puts(status=='1' ? "SNAPSHOT TAKEN" : "SNAPSHOT FAILED");
+        else if (p.op == 'X') puts(status=='1' ? "SNAPSHOT DROPPED" : "NO SNAPSHOT");
+        else if (p.op == 'T') puts(status=='1' ? "DISCARD OK" : "DISCARD FAILED");
+        else if (p.op == 'w') puts(status=='1' ? "RANGE WRITE OK" : "RANGE WRITE FAILED");
+        else puts(status=='1' ? "WRITE OK" : "WRITE FAILED");
+        return 0;
+    }
+}
+
+// Called after each send: only block once the queue is full
+static int pend_settle(int fd) {
+    while (g_npend >= g_qd) if (recv_reply(fd) < 0) return -1;
+    return 0;
+}
+
+// Prints replies that have already arrived without blocking
+static int pend_poll(int fd) {
+    struct pollfd pf = { .fd = fd, .events = POLLIN };
+    while (g_npend > 0 && poll(&pf, 1, 0) == 1) if (recv_reply(fd) < 0) return -1;
+    return 0;
+}
+
+// SAVE: asks for the geometry, then reads the whole snapshot with pipelined
+// SR commands (in order, so the file is written front to back)
+static int save_snapshot(int fd, const char *path) {
+    while (g_npend > 0) if (recv_reply(fd) < 0) return -1;
+    char buf[128]; size_t h = 0; int cyl, sec;
+    if (write_full(fd, "I ", 2) < 0) { perror("write"); return -1; }
+    while (h < sizeof(buf) - 1 && read_full(fd, &buf[h], 1) == 1 && buf[h++] != '\n') {}
+    buf[h] = '\0';
+    if (sscanf(buf, "%d %d", &cyl, &sec) != 2) { puts("bad geometry reply"); return -1; }
+    if (!(g_save = fopen(path, "wb"))) { perror(path); return 0; }
+    g_save_failed = false;
+    long long total = (long long)cyl * sec;
+    int depth = g_qd > 8 ? g_qd : 8;                  // a full-disk copy wants a few in flight
+    for (long long lba = 0; lba < total && !g_save_failed; lba += RANGE_MAX_SECTORS) {
+        int n = total - lba < RANGE_MAX_SECTORS ? (int)(total - lba) : RANGE_MAX_SECTORS;
+        int c = (int)(lba / sec), s = (int)(lba % sec);
+        char out[64]; int k = snprintf(out, sizeof(out), "SR %d %d %d ", c, s, n);
+        if (write_full(fd, out, (size_t)k) < 0) { perror("write"); fclose(g_save); g_save = NULL; return -1; }
+        pend_push('v', c, s, n);
+        while (g_npend >= depth) if (recv_reply(fd) < 0) { fclose(g_save); g_save = NULL; return -1; }
+    }
+    while (g_npend > 0) if (recv_reply(fd) < 0) { fclose(g_save); g_save = NULL; return -1; }
+    if (fclose(g_save) != 0) g_save_failed = true;
+    g_save = NULL;
+    if (g_save_failed) printf("SAVE FAILED (no snapshot, or %s not writable)\n", path);
+    else printf("SAVED %lld sectors to %s\n", total, path);
+    return 0;
+}
+
 // Main function
 int main(int argc, char **argv) {
-    if (argc != 3) { fprintf(stderr, "Usage: %s <host> <port>\n", argv[0]); return 1; }
+    if (argc == 4 && !strncmp(argv[3], "--qd=", 5)) g_qd = atoi(argv[3] + 5);
+    if ((argc != 3 && argc != 4) || (argc == 4 && strncmp(argv[3], "--qd=", 5)) || g_qd < 1 || g_qd > QD_MAX) {
+        fprintf(stderr, "Usage: %s <host> <port> [--qd=1..%d]\n", argv[0], QD_MAX); return 1;
+    }
     int fd = connect_to(argv[1], argv[2]); if (fd < 0) { perror("connect"); return 1; }
-    printf("Connected. Type commands: I | R c s | W c s l\n");
+    printf("Connected. Type commands: I | R c s | W c s l | RR c s n | WR c s n | T c s n | S | N | X | SR c s n | SAVE file | P w\n");
 
     char *line = NULL; size_t cap = 0;
-    while (printf("> "), fflush(stdout), getline(&line, &cap, stdin) != -1) {
+    while (pend_poll(fd) == 0 && (printf("> "), fflush(stdout), getline(&line, &cap, stdin) != -1)) {
         // Trim the trailing newline/space
         size_t len = strlen(line); if (len>0 && line[len-1]=='\n') line[len-1]='\0';
         if (line[0] == '\0') continue;
@@ -78,17 +207,57 @@ int main(int argc, char **argv) {
         if (line[0] == 'I') {
             const char *msg = "I ";
             if (write_full(fd, msg, strlen(msg)) < 0) { perror("write"); break; }
-            char buf[128] = {0}; ssize_t r = read(fd, buf, sizeof(buf)-1);
-            if (r <= 0) { perror("read"); break; }
-            printf("Server geometry: %s", buf);
+            pend_push('I', 0, 0, 0);
+        } else if (!strncmp(line, "SAVE ", 5)) {
+            if (save_snapshot(fd, line + 5) < 0) break;
+            continue;
+        } else if (line[0] == 'S' && line[1] == 'R') {
+            int c, s, n; if (sscanf(line, "SR %d %d %d", &c, &s, &n) != 3) { puts("Usage: SR c s n"); continue; }
+            if (n < 1 || n > RANGE_MAX_SECTORS) { printf("n must be 1..%d\n", RANGE_MAX_SECTORS); continue; }
+            char out[64]; int k = snprintf(out, sizeof(out), "SR %d %d %d ", c, s, n);
+            if (write_full(fd, out, (size_t)k) < 0) { perror("write"); break; }
+            pend_push('q', c, s, n);
+        } else if (line[0] == 'P') {
+            int w; if (sscanf(line, "P %d", &w) != 1) { puts("Usage: P weight"); continue; }
+            char out[32]; int k = snprintf(out, sizeof(out), "P %d ", w);
+            if (write_full(fd, out, (size_t)k) < 0) { perror("write"); break; }
+            pend_push('P', 0, 0, w);
+        } else if (line[0] == 'N' || line[0] == 'X') {
+            char out[3] = { line[0], ' ', '\0' };
+            if (write_full(fd, out, 2) < 0) { perror("write"); break; }
+            pend_push(line[0], 0, 0, 0);
+        } else if (line[0] == 'S') {
+            if (write_full(fd, "S ", 2) < 0) { perror("write"); break; }
+            pend_push('S', 0, 0, 0);
+        } else if (line[0] == 'T') {
+            int c, s, n; if (sscanf(line, "T %d %d %d", &c, &s, &n) != 3) { puts("Usage: T c s n"); continue; }
+            char out[64]; int k = snprintf(out, sizeof(out), "T %d %d %d ", c, s, n);
+            if (write_full(fd, out, (size_t)k) < 0) { perror("write"); break; }
+            pend_push('T', c, s, n);
+        } else if (line[0] == 'R' && line[1] == 'R') {
+            int c, s, n; if (sscanf(line, "RR %d %d %d", &c, &s, &n) != 3) { puts("Usage: RR c s n"); continue; }
+            if (n < 1 || n > RANGE_MAX_SECTORS) { printf("n must be 1..%d\n", RANGE_MAX_SECTORS); continue; }
+            char out[64]; int k = snprintf(out, sizeof(out), "RR %d %d %d ", c, s, n);
+            if (write_full(fd, out, (size_t)k) < 0) { perror("write"); break; }
+            pend_push('r', c, s, n);
+        } else if (line[0] == 'W' && line[1] == 'R') {
+            int c, s, n; if (sscanf(line, "WR %d %d %d", &c, &s, &n) != 3) { puts("Usage: WR c s n"); continue; }
+            if (n < 1 || n > RANGE_MAX_SECTORS) { printf("n must be 1..%d\n", RANGE_MAX_SECTORS); continue; }
+            printf("DATA: enter up to %d bytes; the rest of the %d sectors is zero-filled\n", n * BLOCK_SIZE, n);
+            char *dline = NULL; size_t dcap = 0; ssize_t r = getline(&dline, &dcap, stdin);
+            if (r < 0) { perror("getline data"); free(dline); break; }
+            size_t bytes = (size_t)n * BLOCK_SIZE;
+            uint8_t *buf = calloc(1, bytes); if (!buf) { free(dline); puts("oom"); break; }
+            memcpy(buf, dline, ((size_t)r < bytes) ? (size_t)r : bytes); free(dline);
+            char out[64]; int k = snprintf(out, sizeof(out), "WR %d %d %d ", c, s, n);
+            if (write_full(fd, out, (size_t)k) < 0 || write_full(fd, buf, bytes) < 0) { perror("write"); free(buf); break; }
+            free(buf);
+            pend_push('w', c, s, n);
         } else if (line[0] == 'R') {
             int c, s; if (sscanf(line, "R %d %d", &c, &s) != 2) { puts("Usage: R c s"); continue; }
             char out[64]; int n = snprintf(out, sizeof(out), "R %d %d ", c, s);
             if (write_full(fd, out, (size_t)n) < 0) { perror("write"); break; }
-            char status; if (read_full(fd, &status, 1) != 1) { perror("read status"); break; }
-            if (status == '0') { puts("READ: invalid c/s"); continue; }
-            uint8_t blk[BLOCK_SIZE]; if (read_full(fd, blk, BLOCK_SIZE) != BLOCK_SIZE) { perror("read blk"); break; }
-            printf("READ OK (c=%d s=%d)\n", c, s); hexdump(blk, BLOCK_SIZE);
+            pend_push('R', c, s, 0);
         } else if (line[0] == 'W') {
             int c, s, l; if (sscanf(line, "W %d %d %d", &c, &s, &l) != 3) { puts("Usage: W c s l"); continue; }
             if (l < 0 || l > BLOCK_SIZE) { puts("l must be 0..128"); continue; }
@@ -106,13 +275,16 @@ int main(int argc, char **argv) {
                 if (write_full(fd, buf, (size_t)l) < 0) { perror("write data"); free(dline); break; }
             }
             free(dline);
-            char status; if (read_full(fd, &status, 1) != 1) { perror("read status"); break; }
-            puts(status=='1' ? "WRITE OK" : "WRITE FAILED");
+            pend_push('W', c, s, l);
         } else if (!strcmp(line, "quit") || !strcmp(line, "exit")) {
             break;
         } else {
-            puts("Unknown. Use: I | R c s | W c s l");
+            puts("Unknown. Use: I | R c s | W c s l | RR c s n | WR c s n | T c s n | S | N | X | SR c s n | SAVE file | P w");
+            continue;
         }
+        if (pend_settle(fd) < 0) break;
     }
+    // Drain whatever is still in flight before hanging up
+    while (g_npend > 0 && recv_reply(fd) == 0) {}
     free(line); close(fd); return 0;
 }
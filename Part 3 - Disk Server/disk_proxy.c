@@ -0,0 +1,788 @@
+// Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
+// Description: Sharding proxy for disk_server. Speaks the same text and binary protocols
+//              (I / R / W / RR / WR / T / S) and spreads the logical cylinder space over several
+//              disk_server backends, as contiguous ranges or by hashed placement. Client requests
+//              travel over a small pool of pipelined binary connections per backend, so many
+//              clients share a few backend sockets and different backends work in parallel.
+// Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread disk_proxy.c -o disk_proxy
+// Run:           ./disk_proxy <port> <host:port>[,<host:port>...] [--place=range|hash] [--pool=N] [--depth=N]
+// Run (example): ./disk_server 9091 100 32 500 a.img &  ./disk_server 9092 100 32 500 b.img &
+//                ./disk_proxy 9090 127.0.0.1:9091,127.0.0.1:9092 --place=hash
+//                ./random_client 127.0.0.1 9090 0 1 --conns=16 --duration=5
+//          The proxy reports cylinders = sum of the backends' cylinders; all backends must use
+//          the same sectors per cylinder. --pool is connections per backend (default 16),
+//          --depth the requests a client may have in flight (default 32).
+
+// Libraries used
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BACKLOG 64
+#define BLOCK_SIZE 128
+#define RANGE_MAX_SECTORS 256   // max sectors in one RR/WR (same cap as disk_server)
+#define DISK_BIN_MAGIC 0xB1     // first byte of a binary-protocol connection
+#define MAX_BACKENDS 16
+#define CONN_BUFSZ 4096
+
+static volatile sig_atomic_t g_stop = 0;
+static void on_sigint(int signo) {
+    (void)signo;
+    g_stop = 1;
+}
+
+// ---- Utility: robust I/O --------------------------------------------------
+static ssize_t read_full(int fd, void *buf, size_t n) {
+    uint8_t *p = buf;
+    size_t left = n;
+    while (left > 0) {
+        ssize_t r = read(fd, p, left);
+        if (r == 0) return (ssize_t)(n - left); // EOF
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += r; left -= (size_t)r;
+    }
+    return (ssize_t)n;
+}
+
+// writev() until every iovec is sent; iov is modified in place
+static ssize_t writev_full(int fd, struct iovec *iov, int cnt) {
+    size_t total = 0;
+    for (int i = 0; i < cnt; i++) total += iov[i].iov_len;
+    size_t left = total;
+    while (left > 0) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        left -= (size_t)w;
+        while (cnt > 0 && (size_t)w >= iov->iov_len) { w -= (ssize_t)iov->iov_len; iov++; cnt--; }
+        if (cnt > 0) { iov->iov_base = (uint8_t *)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+    return (ssize_t)total;
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = {0}, *res = NULL, *it;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (it = res; it; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, it->ai_addr, it->ai_addrlen) == 0) break;
+        close(fd); fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) { int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+    return fd;
+}
+
+static int mk_listen_socket(const char *port) {
+    int sfd = -1; struct addrinfo hints = {0}, *res = NULL, *it;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int rc = getaddrinfo(NULL, port, &hints, &res);
+    if (rc != 0) { fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc)); return -1; }
+    for (it = res; it; it = it->ai_next) {
+        sfd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (sfd < 0) continue;
+        int yes = 1; setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(sfd, it->ai_addr, it->ai_addrlen) == 0) {
+            if (listen(sfd, BACKLOG) == 0) break;
+        }
+        close(sfd); sfd = -1;
+    }
+    freeaddrinfo(res);
+    return sfd;
+}
+
+// ---- Wire protocol (binary frames, as in disk_server.c) --------------------
+
+typedef struct {
+    uint8_t  op;              // 'I', 'R', 'W', 'r' (range read), 'w' (range write), 'T' (discard), 'S' (stats)
+    uint8_t  flags;
+    uint16_t reserved;
+    uint32_t id;              // echoed back in the response
+    uint32_t cyl;
+    uint32_t sec;
+    uint32_t len;             // W: payload 0..128; r/w: n*128 bytes to move; T: n sectors
+} __attribute__((packed)) bin_req_t;
+
+typedef struct {
+    uint8_t  op;              // echo of request op
+    uint8_t  status;          // 1 ok, 0 invalid
+    uint16_t reserved;
+    uint32_t id;              // echo of request id
+    uint32_t len;             // bytes of data following the header
+} __attribute__((packed)) bin_resp_t;
+
+// ---- Placement -------------------------------------------------------------
+// g_map[c] says which backend holds logical cylinder c and as which of its
+// own cylinders. Range placement stacks the backends end to end; hash
+// placement scatters cylinders by a hash of c (probing on to the next
+// backend with room), so hot neighbouring cylinders land on different
+// backends. Both are a pure function of the backend list.
+
+typedef enum { PLACE_RANGE = 0, PLACE_HASH } place_mode_t;
+
+typedef struct { int b, c; } place_t;
+
+typedef struct bconn bconn_t;
+
+typedef struct {
+    char     *host, *port;
+    int       cyl;                  // cylinders the backend reports
+    bconn_t  *pool;
+    atomic_ullong st_pieces, st_errors, st_reconnects;
+} backend_t;
+
+static backend_t    g_be[MAX_BACKENDS];
+static int          g_nbe, g_cyl, g_sec, g_npool, g_depth;
+static place_mode_t g_place;
+static place_t     *g_map;
+static atomic_ullong g_st_calls, g_st_split, g_st_clients;
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33; x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33; x *= 0xC4CEB9FE1A85EC53ULL;
+    return x ^ (x >> 33);
+}
+
+static int place_init(void) {
+    int used[MAX_BACKENDS] = {0};
+    if (!(g_map = malloc((size_t)g_cyl * sizeof(*g_map)))) return -1;
+    for (int c = 0, b = 0; c < g_cyl; c++) {
+        if (g_place == PLACE_HASH) b = (int)(mix64((uint64_t)c) % (uint64_t)g_nbe);
+        while (used[b] == g_be[b].cyl) b = (b + 1) % g_nbe;
+        g_map[c] = (place_t){ b, used[b]++ };
+    }
+    return 0;
+}
+
+// ---- Requests, pieces and backend connections ------------------------------
+// A client request becomes a call with one piece per run of sectors that is
+// contiguous on one backend (a ranged op may span several). Pieces are
+// queued on a pooled backend connection in send order; disk_server answers
+// a connection in order, so the connection's receiver thread completes the
+// oldest queued piece with each reply. A client always uses the same pool
+// slot, so its requests reach each backend in the order it sent them.
+
+struct client;
+
+typedef struct piece {
+    struct piece *next;       // backend connection queue
+    struct call  *call;
+    int       b;
+    uint64_t  lba;            // backend-local first sector
+    uint64_t  n;              // sectors (W: 1)
+    uint64_t  off;            // sector offset within the request
+    uint32_t  wire_id;
+    uint8_t  *sdata;          // S: malloc'd stats text from the backend
+    uint32_t  slen;
+} piece_t;
+
+typedef struct call {
+    struct call   *next;      // client reply queue
+    struct client *cl;
+    uint8_t   op;             // 'I', 'R', 'W', 'r', 'w', 'T', 'S' (others are answered 0)
+    uint32_t  id;
+    int       c, s, l, n;
+    uint8_t  *data;           // R/r: reply data, W/w: payload
+    int       left;           // pieces not answered yet (under cl->lock)
+    bool      ok;             // starts false for invalid requests
+    int       npieces;
+    piece_t   pieces[];
+} call_t;
+
+struct bconn {
+    backend_t      *be;
+    pthread_mutex_t send_lock; // send order == queue order; guards fd changes. Held across writes
+    pthread_mutex_t lock;     // head/tail only, never held across a socket call
+    int             fd;       // -1 while disconnected
+    uint32_t        next_id;
+    piece_t        *head, *tail;
+};
+
+typedef struct client {
+    int       fd, idx;
+    bool      bin, sniffed, dead, eof;
+    size_t    rpos, rend;
+    uint8_t   in[CONN_BUFSZ];
+    pthread_mutex_t lock;
+    pthread_cond_t  cv;       // a call completed, or room in the queue
+    call_t   *head, *tail;
+    int       ncalls;
+} client_t;
+
+static void piece_done(piece_t *p, bool ok) {
+    client_t *cl = p->call->cl;
+    if (!ok) atomic_fetch_add(&g_be[p->b].st_errors, 1);
+    pthread_mutex_lock(&cl->lock);
+    p->call->ok = p->call->ok && ok;
+    if (--p->call->left == 0) pthread_cond_broadcast(&cl->cv);
+    pthread_mutex_unlock(&cl->lock);
+}
+
+// Reply data a piece expects: where it goes and how long it must be
+static uint8_t *piece_out(piece_t *p, uint32_t *len) {
+    call_t *k = p->call;
+    if (k->op == 'R' || k->op == 'r') { *len = (uint32_t)(p->n * BLOCK_SIZE); return k->data + p->off * BLOCK_SIZE; }
+    *len = 0;
+    return NULL;
+}
+
+// Fails everything still queued on a dead connection. Both locks held.
+static void bconn_fail_locked(bconn_t *bc) {
+    piece_t *p = bc->head;
+    bc->head = bc->tail = NULL;
+    if (bc->fd >= 0) { close(bc->fd); bc->fd = -1; }
+    while (p) { piece_t *nx = p->next; piece_done(p, false); p = nx; }
+}
+
+static void *bconn_receiver(void *arg) {
+    bconn_t *bc = arg;
+    pthread_mutex_lock(&bc->lock);
+    int fd = bc->fd;
+    pthread_mutex_unlock(&bc->lock);
+    bin_resp_t h;
+    while (read_full(fd, &h, sizeof(h)) == sizeof(h)) {
+        // Senders only append, so the head is stable without the lock
+        pthread_mutex_lock(&bc->lock);
+        piece_t *p = bc->head;
+        pthread_mutex_unlock(&bc->lock);
+        uint32_t len = ntohl(h.len), want;
+        if (!p || ntohl(h.id) != p->wire_id) break;
+        uint8_t *out = piece_out(p, &want);
+        bool ok = h.status == 1;
+        if (p->call->op == 'S') {
+            if (!(p->sdata = malloc(len + 1u)) || read_full(fd, p->sdata, len) != (ssize_t)len) break;
+            p->slen = len;
+        } else if (ok && len == want) {
+            if (len && read_full(fd, out, len) != (ssize_t)len) break;
+        } else {
+            uint8_t sink[BLOCK_SIZE];
+            for (uint32_t left = len; left > 0; ) {
+                uint32_t k = left > BLOCK_SIZE ? BLOCK_SIZE : left;
+                if (read_full(fd, sink, k) != (ssize_t)k) goto dead;
+                left -= k;
+            }
+            ok = false;
+        }
+        pthread_mutex_lock(&bc->lock);
+        bc->head = p->next;
+        if (!bc->head) bc->tail = NULL;
+        pthread_mutex_unlock(&bc->lock);
+        piece_done(p, ok);
+    }
+dead:
+    // A sender may be stuck writing to fd: shut it down so send_lock comes free
+    shutdown(fd, SHUT_RDWR);
+    pthread_mutex_lock(&bc->send_lock);
+    pthread_mutex_lock(&bc->lock);
+    if (bc->fd == fd) bconn_fail_locked(bc);
+    pthread_mutex_unlock(&bc->lock);
+    pthread_mutex_unlock(&bc->send_lock);
+    return NULL;
+}
+
+// (Re)connects a pooled connection and starts its receiver. send_lock held.
+static int bconn_open_locked(bconn_t *bc) {
+    int fd = connect_to(bc->be->host, bc->be->port);
+    if (fd < 0) return -1;
+    uint8_t magic = DISK_BIN_MAGIC;
+    struct iovec iov = { &magic, 1 };
+    if (writev_full(fd, &iov, 1) < 0) { close(fd); return -1; }
+    pthread_mutex_lock(&bc->lock);
+    bc->fd = fd;
+    pthread_mutex_unlock(&bc->lock);
+    pthread_t th;
+    if (pthread_create(&th, NULL, bconn_receiver, bc) != 0) {
+        pthread_mutex_lock(&bc->lock);
+        bc->fd = -1;
+        pthread_mutex_unlock(&bc->lock);
+        close(fd); return -1;
+    }
+    pthread_detach(th);
+    return 0;
+}
+
+// Queues p on the client's pool slot of its backend and sends its frame
+static void piece_send(piece_t *p) {
+    call_t *k = p->call;
+    backend_t *be = &g_be[p->b];
+    bconn_t *bc = &be->pool[k->cl->idx % g_npool];
+    bin_req_t h = { .op = k->op, .cyl = htonl((uint32_t)(p->lba / (uint64_t)g_sec)),
+                    .sec = htonl((uint32_t)(p->lba % (uint64_t)g_sec)) };
+    struct iovec iov[2] = { { &h, sizeof(h) }, { NULL, 0 } };
+    if (k->op == 'W') { h.len = htonl((uint32_t)k->l); iov[1] = (struct iovec){ k->data, (size_t)k->l }; }
+    else if (k->op == 'r') h.len = htonl((uint32_t)(p->n * BLOCK_SIZE));
+    else if (k->op == 'w') {
+        h.len = htonl((uint32_t)(p->n * BLOCK_SIZE));
+        iov[1] = (struct iovec){ k->data + p->off * BLOCK_SIZE, (size_t)p->n * BLOCK_SIZE };
+    } else if (k->op == 'T') h.len = htonl((uint32_t)p->n);
+
+    // The queue lock is only held to append: the receiver needs it to drain
+    // replies, and the backend stops reading while its replies back up
+    pthread_mutex_lock(&bc->send_lock);
+    if (bc->fd < 0) {
+        if (bconn_open_locked(bc) < 0) { pthread_mutex_unlock(&bc->send_lock); piece_done(p, false); return; }
+        atomic_fetch_add(&be->st_reconnects, 1);
+    }
+    p->wire_id = ++bc->next_id;
+    h.id = htonl(p->wire_id);
+    p->next = NULL;
+    pthread_mutex_lock(&bc->lock);
+    if (bc->tail) bc->tail->next = p; else bc->head = p;
+    bc->tail = p;
+    pthread_mutex_unlock(&bc->lock);
+    atomic_fetch_add(&be->st_pieces, 1);
+    // On a failed send the receiver sees the shutdown and fails the queue
+    if (writev_full(bc->fd, iov, iov[1].iov_len ? 2 : 1) < 0) shutdown(bc->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&bc->send_lock);
+}
+
+// Splits logical sectors [lba, lba+n) into runs that are contiguous on one
+// backend. out has room for one piece per logical cylinder touched.
+static int split_range(uint64_t lba, uint64_t n, piece_t *out) {
+    int k = 0;
+    for (uint64_t done = 0; done < n; ) {
+        uint64_t cur = lba + done, s = cur % (uint64_t)g_sec;
+        uint64_t run = (uint64_t)g_sec - s;
+        if (run > n - done) run = n - done;
+        place_t pl = g_map[cur / (uint64_t)g_sec];
+        uint64_t local = (uint64_t)pl.c * (uint64_t)g_sec + s;
+        if (k > 0 && out[k - 1].b == pl.b && out[k - 1].lba + out[k - 1].n == local) {
+            out[k - 1].n += run;
+        } else {
+            out[k] = (piece_t){ .b = pl.b, .lba = local, .n = run, .off = done };
+            k++;
+        }
+        done += run;
+    }
+    return k;
+}
+
+static bool valid_cs(int c, int s) {
+    return c >= 0 && c < g_cyl && s >= 0 && s < g_sec;
+}
+
+static bool valid_span(int c, int s, int n) {
+    return n >= 1 && valid_cs(c, s) && (long long)c * g_sec + s + n <= (long long)g_cyl * g_sec;
+}
+
+// Builds the call for a parsed request: pieces for backend ops, none for
+// I and invalid requests (answered by the proxy). Takes ownership of data.
+static call_t *call_new(client_t *cl, uint8_t op, uint32_t id, int c, int s, int l, int n, uint8_t *data) {
+    bool valid = (op == 'R') ? valid_cs(c, s)
+               : (op == 'W') ? valid_cs(c, s) && l >= 0 && l <= BLOCK_SIZE
+               : (op == 'r' || op == 'w') ? n <= RANGE_MAX_SECTORS && valid_span(c, s, n)
+               : (op == 'T') ? valid_span(c, s, n)
+               : (op == 'I' || op == 'S');
+    uint64_t lba = valid && op != 'I' && op != 'S' ? (uint64_t)c * (uint64_t)g_sec + (uint64_t)s : 0;
+    uint64_t cnt = (op == 'R' || op == 'W') ? 1 : (uint64_t)(n > 0 ? n : 0);
+    int maxp = !valid || op == 'I' ? 0 : op == 'S' ? g_nbe
+             : (int)(((lba % (uint64_t)g_sec) + cnt + (uint64_t)g_sec - 1) / (uint64_t)g_sec);
+    call_t *k = calloc(1, sizeof(*k) + (size_t)maxp * sizeof(piece_t));
+    if (!k) { free(data); return NULL; }
+    k->cl = cl; k->op = op; k->id = id; k->c = c; k->s = s; k->l = l; k->n = n; k->ok = valid;
+    k->data = data;
+    if (valid && (op == 'R' || op == 'r') && !(k->data = malloc((size_t)cnt * BLOCK_SIZE))) { free(k); return NULL; }
+    if (valid && op == 'S') {
+        for (int b = 0; b < g_nbe; b++) k->pieces[b] = (piece_t){ .b = b };
+        k->npieces = g_nbe;
+    } else if (maxp > 0) {
+        k->npieces = split_range(lba, cnt, k->pieces);
+    }
+    for (int i = 0; i < k->npieces; i++) k->pieces[i].call = k;
+    k->left = k->npieces;
+    if (k->npieces > 1 && op != 'S') atomic_fetch_add(&g_st_split, 1);
+    atomic_fetch_add(&g_st_calls, 1);
+    return k;
+}
+
+static void call_free(call_t *k) {
+    for (int i = 0; i < k->npieces; i++) free(k->pieces[i].sdata);
+    free(k->data);
+    free(k);
+}
+
+// ---- Client input (same framing rules as disk_server) ----------------------
+
+static ssize_t cl_fill(client_t *cl) {
+    if (cl->rpos == cl->rend) cl->rpos = cl->rend = 0;
+    if (cl->rend == sizeof(cl->in)) {
+        memmove(cl->in, cl->in + cl->rpos, cl->rend - cl->rpos);
+        cl->rend -= cl->rpos; cl->rpos = 0;
+    }
+    for (;;) {
+        ssize_t r = recv(cl->fd, cl->in + cl->rend, sizeof(cl->in) - cl->rend, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r > 0) cl->rend += (size_t)r;
+        return r;
+    }
+}
+
+static inline bool is_ws(uint8_t ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+// Next whitespace-separated token; the single delimiter after it is
+// consumed so a W payload starts right after. 1 ok, 0 EOF, -1 error.
+static int cl_token(client_t *cl, char *out, size_t outsz) {
+    for (;;) {
+        while (cl->rpos < cl->rend && is_ws(cl->in[cl->rpos])) cl->rpos++;
+        if (cl->rpos < cl->rend) break;
+        ssize_t r = cl_fill(cl);
+        if (r <= 0) return (int)r;
+    }
+    size_t i = 0;
+    for (;;) {
+        while (cl->rpos < cl->rend && !is_ws(cl->in[cl->rpos])) {
+            if (i + 1 < outsz) out[i++] = (char)cl->in[cl->rpos];
+            cl->rpos++;
+        }
+        if (cl->rpos < cl->rend) { cl->rpos++; break; }
+        ssize_t r = cl_fill(cl);
+        if (r == 0) break;
+        if (r < 0) return -1;
+    }
+    out[i] = '\0';
+    return 1;
+}
+
+// Exactly n bytes (buffered first). 1 ok, -1 short/error. buf may be NULL to skip.
+static int cl_read(client_t *cl, void *buf, size_t n) {
+    uint8_t *p = buf;
+    while (n > 0) {
+        if (cl->rpos == cl->rend && cl_fill(cl) <= 0) return -1;
+        size_t k = cl->rend - cl->rpos;
+        if (k > n) k = n;
+        if (p) { memcpy(p, cl->in + cl->rpos, k); p += k; }
+        cl->rpos += k; n -= k;
+    }
+    return 1;
+}
+
+// Reads a payload of `bytes` into a new buffer (*out), or skips it when
+// it is larger than `cap` (*out stays NULL). 1 ok, -1 error.
+static int cl_payload(client_t *cl, size_t bytes, size_t cap, uint8_t **out) {
+    *out = NULL;
+    if (bytes == 0) return 1;
+    if (bytes > cap) return cl_read(cl, NULL, bytes);
+    if (!(*out = malloc(bytes))) return -1;
+    return cl_read(cl, *out, bytes);
+}
+
+// Parses one request into a call. 1 ok (*out may be NULL: ignored text
+// token), 0 EOF, -1 error.
+static int parse_text(client_t *cl, call_t **out) {
+    char tok[64], t[3][32];
+    *out = NULL;
+    int r = cl_token(cl, tok, sizeof(tok));
+    if (r <= 0) return r;
+    bool range = !strcmp(tok, "RR") || !strcmp(tok, "WR");
+    if (!range && tok[1] != '\0') return 1;       // unknown token, ignore
+    int nargs = range || tok[0] == 'T' || tok[0] == 'W' ? 3 : tok[0] == 'R' ? 2 : 0;
+    if (!range && !strchr("ISRTW", tok[0])) return 1;
+    for (int i = 0; i < nargs; i++)
+        if (cl_token(cl, t[i], sizeof(t[i])) != 1) return -1;
+    int c = nargs ? atoi(t[0]) : 0, s = nargs ? atoi(t[1]) : 0, x = nargs == 3 ? atoi(t[2]) : 0;
+    uint8_t *data = NULL;
+    uint8_t op = range ? (tok[0] == 'R' ? 'r' : 'w') : (uint8_t)tok[0];
+    if (op == 'w' && x > 0) {
+        // Like disk_server, drain at most the capped payload size
+        size_t want = (size_t)(x > RANGE_MAX_SECTORS ? RANGE_MAX_SECTORS : x) * BLOCK_SIZE;
+        if (cl_payload(cl, want, want, &data) != 1) return -1;
+    }
+    if (op == 'W') {
+        if (!(data = calloc(1, BLOCK_SIZE))) return -1;
+        if (x > 0 && cl_read(cl, data, (size_t)(x > BLOCK_SIZE ? BLOCK_SIZE : x)) != 1) { free(data); return -1; }
+    }
+    *out = call_new(cl, op, 0, c, s, op == 'W' ? x : 0, (op == 'W' || op == 'R') ? 0 : x, data);
+    return *out ? 1 : -1;
+}
+
+static int parse_bin(client_t *cl, call_t **out) {
+    bin_req_t h;
+    *out = NULL;
+    if (cl->rpos == cl->rend) {
+        ssize_t r = cl_fill(cl);
+        if (r <= 0) return (int)r;
+    }
+    if (cl_read(cl, &h, sizeof(h)) != 1) return -1;
+    uint32_t c = ntohl(h.cyl), s = ntohl(h.sec), l = ntohl(h.len);
+    int ci = c > INT32_MAX ? -1 : (int)c, si = s > INT32_MAX ? -1 : (int)s, n = 0, li = 0;
+    uint8_t *data = NULL;
+    if (h.op == 'T') {
+        n = l > INT32_MAX ? -1 : (int)l;
+    } else if (h.op == 'r' || h.op == 'w') {
+        n = (l % BLOCK_SIZE != 0 || l / BLOCK_SIZE > RANGE_MAX_SECTORS) ? -1 : (int)(l / BLOCK_SIZE);
+        if (h.op == 'w' && cl_payload(cl, l, (size_t)RANGE_MAX_SECTORS * BLOCK_SIZE, &data) != 1) return -1;
+    } else if (h.op == 'W') {
+        // Always consume the full payload to stay framed
+        li = l > BLOCK_SIZE ? -1 : (int)l;
+        if (li < 0) { if (cl_read(cl, NULL, l) != 1) return -1; }
+        else {
+            if (!(data = calloc(1, BLOCK_SIZE))) return -1;
+            if (cl_read(cl, data, l) != 1) { free(data); return -1; }
+        }
+    }
+    *out = call_new(cl, h.op, ntohl(h.id), ci, si, li, n, data);
+    return *out ? 1 : -1;
+}
+
+// ---- Client replies --------------------------------------------------------
+
+static void stats_text(FILE *f, const call_t *k) {
+    fprintf(f, "proxy backends=%d place=%s cylinders=%d sectors=%d pool=%d depth=%d clients=%llu calls=%llu split=%llu\n",
+            g_nbe, g_place == PLACE_HASH ? "hash" : "range", g_cyl, g_sec, g_npool, g_depth,
+            (unsigned long long)atomic_load(&g_st_clients), (unsigned long long)atomic_load(&g_st_calls),
+            (unsigned long long)atomic_load(&g_st_split));
+    for (int b = 0; b < g_nbe; b++) {
+        const backend_t *be = &g_be[b];
+        fprintf(f, "backend %d %s:%s cyl=%d pieces=%llu errors=%llu reconnects=%llu\n", b, be->host, be->port,
+                be->cyl, (unsigned long long)atomic_load(&be->st_pieces),
+                (unsigned long long)atomic_load(&be->st_errors), (unsigned long long)atomic_load(&be->st_reconnects));
+        // Each backend's own S report follows its line
+        if (k && k->pieces[b].sdata) fwrite(k->pieces[b].sdata, 1, k->pieces[b].slen, f);
+    }
+}
+
+// Text: status byte (+ data), "<cyl> <sec>\n" for I, "STATS <len>\n" + text
+// for S. Binary: bin_resp_t + data. Same formats as disk_server.
+static int send_reply(client_t *cl, const call_t *k) {
+    char hdr[64]; size_t hlen = 0;
+    const void *data = NULL; size_t len = 0;
+    char *stats = NULL;
+    uint32_t geo[2] = { htonl((uint32_t)g_cyl), htonl((uint32_t)g_sec) };
+    if (k->ok && k->op == 'I') {
+        if (cl->bin) { data = geo; len = sizeof(geo); }
+        else hlen = (size_t)snprintf(hdr, sizeof(hdr), "%d %d\n", g_cyl, g_sec);
+    } else if (k->ok && k->op == 'S') {
+        FILE *f = open_memstream(&stats, &len);
+        if (!f) return -1;
+        stats_text(f, k);
+        fclose(f);
+        data = stats;
+        if (!cl->bin) hlen = (size_t)snprintf(hdr, sizeof(hdr), "STATS %zu\n", len);
+    } else {
+        if (k->ok && (k->op == 'R' || k->op == 'r')) { data = k->data; len = (size_t)(k->op == 'R' ? 1 : k->n) * BLOCK_SIZE; }
+        if (!cl->bin) { hdr[0] = k->ok ? '1' : '0'; hlen = 1; }
+    }
+    bin_resp_t h = { .op = k->op, .status = (uint8_t)(k->ok ? 1 : 0), .reserved = 0,
+                     .id = htonl(k->id), .len = htonl((uint32_t)len) };
+    struct iovec iov[3]; int cnt = 0;
+    if (cl->bin) iov[cnt++] = (struct iovec){ &h, sizeof(h) };
+    if (hlen) iov[cnt++] = (struct iovec){ hdr, hlen };
+    if (len) iov[cnt++] = (struct iovec){ (void *)data, len };
+    int rc = writev_full(cl->fd, iov, cnt) < 0 ? -1 : 0;
+    free(stats);
+    return rc;
+}
+
+// Sends replies in request order as their calls complete
+static void *client_writer(void *arg) {
+    client_t *cl = arg;
+    for (;;) {
+        pthread_mutex_lock(&cl->lock);
+        while (!(cl->head && cl->head->left == 0) && !(cl->eof && !cl->head))
+            pthread_cond_wait(&cl->cv, &cl->lock);
+        call_t *k = cl->head;
+        if (k) { cl->head = k->next; if (!cl->head) cl->tail = NULL; cl->ncalls--; }
+        bool dead = cl->dead;
+        pthread_cond_broadcast(&cl->cv);
+        pthread_mutex_unlock(&cl->lock);
+        if (!k) break;
+        if (!dead && send_reply(cl, k) < 0) {
+            pthread_mutex_lock(&cl->lock);
+            cl->dead = true;
+            pthread_mutex_unlock(&cl->lock);
+            shutdown(cl->fd, SHUT_RD);              // stop the reader too
+        }
+        call_free(k);
+    }
+    return NULL;
+}
+
+static void *client_thread(void *arg) {
+    client_t *cl = arg;
+    pthread_t wr;
+    if (pthread_create(&wr, NULL, client_writer, cl) != 0) { close(cl->fd); free(cl); return NULL; }
+    for (;;) {
+        if (!cl->sniffed) {
+            if (cl->rpos == cl->rend && cl_fill(cl) <= 0) break;
+            if (cl->in[cl->rpos] == DISK_BIN_MAGIC) { cl->rpos++; cl->bin = true; }
+            cl->sniffed = true;
+        }
+        call_t *k = NULL;
+        int r = cl->bin ? parse_bin(cl, &k) : parse_text(cl, &k);
+        if (r <= 0) break;
+        if (!k) continue;                               // ignored text token
+        int np = k->npieces;                            // k may be freed once queued
+        pthread_mutex_lock(&cl->lock);
+        while (cl->ncalls >= g_depth && !cl->dead) pthread_cond_wait(&cl->cv, &cl->lock);
+        bool dead = cl->dead;
+        if (!dead) {
+            k->next = NULL;
+            if (cl->tail) cl->tail->next = k; else cl->head = k;
+            cl->tail = k; cl->ncalls++;
+            if (k->left == 0) pthread_cond_broadcast(&cl->cv);
+        }
+        pthread_mutex_unlock(&cl->lock);
+        if (dead) { call_free(k); break; }
+        // Pieces go out after the call is queued: the writer frees it once done
+        for (int i = 0; i < np; i++) piece_send(&k->pieces[i]);
+    }
+    pthread_mutex_lock(&cl->lock);
+    cl->eof = true;
+    pthread_cond_broadcast(&cl->cv);
+    pthread_mutex_unlock(&cl->lock);
+    pthread_join(wr, NULL);
+    close(cl->fd);
+    pthread_mutex_destroy(&cl->lock);
+    pthread_cond_destroy(&cl->cv);
+    free(cl);
+    return NULL;
+}
+
+// ---- Startup ---------------------------------------------------------------
+
+// Asks a backend for its geometry over a throwaway binary connection
+static int backend_geometry(backend_t *be, int *cyl, int *sec) {
+    int fd = connect_to(be->host, be->port);
+    if (fd < 0) return -1;
+    uint8_t frame[1 + sizeof(bin_req_t)] = { DISK_BIN_MAGIC, 'I' };
+    struct iovec iov = { frame, sizeof(frame) };
+    bin_resp_t h; uint32_t g[2];
+    int rc = (writev_full(fd, &iov, 1) < 0 || read_full(fd, &h, sizeof(h)) != sizeof(h) || h.status != 1 ||
+              ntohl(h.len) != sizeof(g) || read_full(fd, g, sizeof(g)) != sizeof(g)) ? -1 : 0;
+    close(fd);
+    *cyl = (int)ntohl(g[0]); *sec = (int)ntohl(g[1]);
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s <port> <host:port>[,<host:port>...] [--place=range|hash] [--pool=N] [--depth=N]\n", prog);
+}
+
+// Main function
+int main(int argc, char **argv) {
+    if (argc < 3) { usage(argv[0]); return 1; }
+    const char *port = argv[1];
+    g_place = PLACE_RANGE; g_npool = 16; g_depth = 32;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--place=range") == 0) g_place = PLACE_RANGE;
+        else if (strcmp(argv[i], "--place=hash") == 0) g_place = PLACE_HASH;
+        else if (strncmp(argv[i], "--pool=", 7) == 0) g_npool = atoi(argv[i] + 7);
+        else if (strncmp(argv[i], "--depth=", 8) == 0) g_depth = atoi(argv[i] + 8);
+        else { usage(argv[0]); return 1; }
+    }
+    if (g_npool <= 0 || g_depth <= 0) { usage(argv[0]); return 1; }
+
+    char *list = strdup(argv[2]), *save = NULL;
+    if (!list) { perror("strdup"); return 1; }
+    for (char *t = strtok_r(list, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(t, ':');
+        if (!colon || colon == t || g_nbe == MAX_BACKENDS) { usage(argv[0]); return 1; }
+        *colon = '\0';
+        g_be[g_nbe].host = t; g_be[g_nbe].port = colon + 1;
+        g_nbe++;
+    }
+    if (g_nbe == 0) { usage(argv[0]); return 1; }
+
+    // Logical disk = the backends' cylinders side by side, same track size
+    long long total = 0;
+    for (int b = 0; b < g_nbe; b++) {
+        int sec;
+        if (backend_geometry(&g_be[b], &g_be[b].cyl, &sec) < 0) {
+            fprintf(stderr, "backend %s:%s: no geometry (is disk_server running?)\n", g_be[b].host, g_be[b].port);
+            return 1;
+        }
+        if (b > 0 && sec != g_sec) {
+            fprintf(stderr, "backend %s:%s has %d sectors/cylinder, expected %d\n", g_be[b].host, g_be[b].port, sec, g_sec);
+            return 1;
+        }
+        g_sec = sec; total += g_be[b].cyl;
+    }
+    if (total > INT32_MAX) { fprintf(stderr, "too many cylinders in total\n"); return 1; }
+    g_cyl = (int)total;
+    if (place_init() < 0) { perror("malloc"); return 1; }
+    for (int b = 0; b < g_nbe; b++) {
+        if (!(g_be[b].pool = calloc((size_t)g_npool, sizeof(bconn_t)))) { perror("calloc"); return 1; }
+        for (int i = 0; i < g_npool; i++) {
+            bconn_t *bc = &g_be[b].pool[i];
+            bc->be = &g_be[b];
+            pthread_mutex_init(&bc->send_lock, NULL);
+            pthread_mutex_init(&bc->lock, NULL);
+            pthread_mutex_lock(&bc->send_lock);
+            int rc = bconn_open_locked(bc);
+            pthread_mutex_unlock(&bc->send_lock);
+            if (rc < 0) { fprintf(stderr, "backend %s:%s: connect failed\n", g_be[b].host, g_be[b].port); return 1; }
+        }
+    }
+
+    // No SA_RESTART: accept() must return EINTR so the loop sees g_stop
+    struct sigaction sa; memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint; sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = mk_listen_socket(port);
+    if (lfd < 0) { fprintf(stderr, "Failed to listen on %s\n", port); return 1; }
+    fprintf(stderr, "disk_proxy listening on %s (backends=%d cyl=%d sec=%d place=%s pool=%d depth=%d)\n",
+            port, g_nbe, g_cyl, g_sec, g_place == PLACE_HASH ? "hash" : "range", g_npool, g_depth);
+
+    // Accept loop
+    for (int idx = 0; !g_stop; ) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: back off instead of killing the proxy
+                struct timespec ts = { 0, 10 * 1000 * 1000 };
+                perror("accept"); nanosleep(&ts, NULL); continue;
+            }
+            perror("accept"); break;
+        }
+        // Replies are small and pipelined: do not let Nagle hold them back
+        int one = 1; setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        client_t *cl = calloc(1, sizeof(*cl));
+        if (!cl) { close(cfd); continue; }
+        cl->fd = cfd; cl->idx = idx++;
+        pthread_mutex_init(&cl->lock, NULL);
+        pthread_cond_init(&cl->cv, NULL);
+        atomic_fetch_add(&g_st_clients, 1);
+        pthread_t th;
+        if (pthread_create(&th, NULL, client_thread, cl) != 0) { close(cfd); free(cl); continue; }
+        pthread_detach(th);
+    }
+
+    close(lfd);
+    stats_text(stderr, NULL);
+    free(list);
+    return 0;
+}
@@ -1,46 +1,179 @@
 // Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
-// Description: TCP disk server with mmap-backed 128-byte sectors.
-//              Thread-per-connection; supports I / R c s / W c s l [data], as instructed.
+// Description: TCP disk server with file-backed 128-byte sectors (mmap, pread/pwrite or io_uring).
+//              Thread-per-connection (or epoll loops + worker pool with --io=epoll);
+//              supports I / R c s / W c s l [data], as instructed (plus RR/WR ranges, T discard, S stats).
+//              Images are sparse: only written sectors take space, and T punches them out again.
+//              Connections that open with DISK_BIN_MAGIC speak the binary framed protocol instead.
+//              With --replica=... it is a primary that streams every write to replica servers.
+//              N takes a copy-on-write snapshot in O(1); SR reads it back while writers carry on.
 // Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread disk_server.c -o disk_server
-// Run:           ./disk_server <port> <cylinders> <sectors_per_cyl> <track_us_us> <backing_file> [--sync=immediate|after]
-// Run (example): ./disk_server 9090 200 32 500 disk.img --sync=after
+// Run:           ./disk_server <port> <cylinders> <sectors_per_cyl> <track_us_us> <backing_file>[,<backing_file>...]
+//                               [--sync=immediate|after|periodic] [--stripe-unit=N]
+//                               [--sched=fifo|sstf|scan|clook] [--io=thread|epoll] [--loops=N] [--workers=N]
+//                               [--backend=mmap|pread|uring] [--gc-window=US] [--gc-batch=N]
+//                               [--flush-ms=N] [--wb-high=N] [--stripes=N] [--track-cache=N]
+//                               [--advise=random|sequential|normal]
+//                               [--replica=host:port[,...]] [--repl=async|semisync] [--repl-log=N]
+//                               [--repl-timeout-ms=N] [--read-only] [--primary=host[,...]]
+//                               [--snap-file=PATH] [--cow-chunk=N]
+//                               [--qos] [--qos-read-ms=N] [--qos-write-ms=N] [--qos-window=PCT]
+// Run (example): ./disk_server 9090 200 32 500 disk.img --sync=after --sched=clook
+//                ./disk_server 9090 200 32 500 d0.img,d1.img,d2.img,d3.img --stripe-unit=2
+//                ./disk_server 9091 200 32 500 r1.img --read-only --primary=localhost
+//                ./disk_server 9090 200 32 500 disk.img --replica=localhost:9091 --repl=semisync
 
 // Libraries used
+#define _GNU_SOURCE             // epoll, io_uring syscalls
 #include <arpa/inet.h>
 #include <errno.h>
+#include <linux/io_uring.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 // Constants defined
-#define _POSIX_C_SOURCE 200809L
+#undef  BLOCK_SIZE              // linux/fs.h (via io_uring.h) has its own
 #define BLOCK_SIZE 128
 #define BACKLOG 64
+#define RANGE_MAX_SECTORS 256   // cap for RR/WR (32 KiB per request)
+#define DISK_BIN_MAGIC 0xB1     // first byte of a binary-protocol connection
+#define MAX_SPINDLES 16         // backing files in one striped (RAID-0) disk
 
-typedef enum { SYNC_IMMEDIATE = 0, SYNC_AFTER = 1 } sync_mode_t;
+typedef enum { SYNC_IMMEDIATE = 0, SYNC_AFTER = 1, SYNC_PERIODIC = 2 } sync_mode_t;
+typedef enum { IOSCHED_FIFO = 0, IOSCHED_SSTF, IOSCHED_SCAN, IOSCHED_CLOOK } sched_policy_t;
 
-typedef struct {
-    uint8_t *base;            // mmap base
-    size_t   bytes;           // total mapped size
+// One pending media access. Lives on the requesting thread's stack while it
+// waits for the scheduler to hand it the head.
+typedef struct io_req {
+    int             cyl;      // target cylinder
+    uint64_t        seq;      // arrival order (FIFO + tie-break)
+    bool            granted;  // set by the scheduler when it is our turn
+    pthread_cond_t  cv;
+    struct io_req  *next;
+    struct conn    *cl;       // --qos: requesting connection
+    uint64_t        tag;      // --qos: virtual start time
+    uint64_t        deadline; // --qos: promote once now_ns() passes this
+} io_req_t;
+
+typedef struct backend backend_t;
+
+// One dirty sector in the write-back cache (--sync=periodic)
+typedef struct wb_ent {
+    uint64_t lba;             // c * sectors + s
+    uint64_t ver;             // bumped on every overwrite
+    struct wb_ent *next;      // hash chain
+    uint8_t  data[BLOCK_SIZE];
+} wb_ent_t;
+
+// A disk_t is either the logical disk (geometry, caches, commit state) or one
+// of its spindles (backing file, head, scheduler, stripe locks).
+typedef struct disk {
+    const backend_t *be;      // storage backend (mmap / pread / uring)
+    void    *be_state;        // backend private data
+    uint8_t *base;            // mmap base (mmap backend only)
+    size_t   bytes;           // total image size
     int      fd;              // backing file descriptor
     int      cylinders;       // geometry
     int      sectors;
     int      track_us;        // per-track latency (microseconds)
     int      current_cyl;     // simulated head position
     sync_mode_t sync_mode;    // reply timing mode
-    pthread_mutex_t lock;     // serialize head movement + media access
+    pthread_mutex_t lock;     // protects the request queue + busy flag below
+
+    // RAID-0: the logical disk stripes cylinders over its spindles
+    struct disk *mem;         // spindles, one per backing file
+    int       nmem;
+    int       su;             // stripe unit in cylinders
+    const char *path;         // spindle: backing file name
+    int       index;          // spindle: position in the logical disk's mem[]
+
+    // Elevator state: only the thread holding `busy` touches the head/media
+    sched_policy_t policy;
+    bool      busy;           // head currently owned by a request
+    int       dir;            // sweep direction for SCAN (+1 up, -1 down)
+    int       carry_cyl;      // SCAN edge travel owed by the next seek
+    io_req_t *pending;        // unordered list of waiting requests
+    uint64_t  next_seq;
+
+    // --qos: fair queuing over connections, deadlines against starvation
+    bool      qos;
+    uint64_t  qos_read_ns, qos_write_ns;
+    uint64_t  qos_window;     // in virtual time
+    uint64_t  qos_vt;         // virtual time: start tag of the latest grant
+    uint64_t  qos_limit;      // tags above this wait for the next pick
+    uint64_t  st_qos_promoted;
+
+    // track_us == 0: no head to share, accesses lock only their cylinders
+    bool      striped;
+    int       nstripes;
+    pthread_rwlock_t *stripe; // cylinder c -> stripe[c % nstripes]
+
+    // Scheduler statistics (updated by the head owner)
+    _Atomic uint64_t st_ops;  // atomic: striped mode has many owners
+    uint64_t  st_seek_cyl;    // total cylinders crossed
+    uint64_t  st_seek_us;     // total simulated seek time
+    struct timespec st_start;
+
+    // Group commit for --sync=after: writers that pile up behind one flush
+    // share the next one (gc_lock is independent of the head)
+    pthread_mutex_t gc_lock;
+    pthread_cond_t  gc_cv;
+    int       gc_window_us;   // how long a batch leader waits for company
+    int       gc_batch;       // ... or until this many writers have joined
+    bool      gc_leader;      // someone is collecting the open batch
+    bool      gc_flushing;    // a batch is being flushed right now
+    int       gc_joined;      // writers in the open batch
+    off_t     gc_lo, gc_hi;   // byte span dirtied by the open batch
+    uint64_t  gc_open;        // generation of the open batch
+    uint64_t  gc_done;        // last generation on media
+    uint64_t  gc_failed;      // first generation whose flush failed (0 = none); sticky
+    uint64_t  st_gc_commits, st_gc_flushes;
+
+    // Write-back cache for --sync=periodic: acked sectors not yet on media
+    pthread_mutex_t wb_lock;
+    pthread_cond_t  wb_cv;    // flusher wakeups + writer backpressure
+    wb_ent_t **wb_tab;        // chained hash on lba
+    size_t    wb_nbuckets;    // power of two
+    size_t    wb_dirty;       // entries in wb_tab
+    size_t    wb_high;        // flush early at this many dirty sectors
+    int       wb_flush_ms;    // flush period
+    bool      wb_closed;      // shutting down: last drain, writes go through
+    uint64_t  wb_ver;
+    pthread_t wb_thread;
+    uint64_t  st_wb_writes, st_wb_coalesced, st_wb_flushes, st_wb_flushed, st_wb_peak;
+    uint64_t  st_wb_flush_us, st_wb_flush_max_us;
+
+    // Track buffer (--track-cache=N): whole cylinders as last read from media,
+    // kept in LRU order; writes go through to media and patch cached copies
+    pthread_mutex_t tc_lock;
+    int       tc_tracks;      // capacity in tracks (0 = off)
+    size_t    tc_track_bytes; // sectors * BLOCK_SIZE
+    int      *tc_slot;        // cylinder -> slot, -1 if not cached
+    int      *tc_cyl;         // slot -> cylinder
+    int      *tc_prev, *tc_next; // LRU list of slots, tc_mru ... tc_lru
+    int       tc_mru, tc_lru, tc_used;
+    uint8_t  *tc_data;        // tc_tracks * tc_track_bytes
+    uint64_t  st_tc_hits, st_tc_misses, st_tc_evictions;
 } disk_t;
 
 static volatile sig_atomic_t g_stop = 0;
@@ -80,32 +213,289 @@ static ssize_t write_full(int fd, const void *buf, size_t n) {
     return (ssize_t)n;
 }
 
+// writev() until every iovec is sent; iov is modified in place
+static ssize_t writev_full(int fd, struct iovec *iov, int cnt) {
+    size_t total = 0;
+    for (int i = 0; i < cnt; i++) total += iov[i].iov_len;
+    size_t left = total;
+    while (left > 0) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        left -= (size_t)w;
+        while (cnt > 0 && (size_t)w >= iov->iov_len) { w -= (ssize_t)iov->iov_len; iov++; cnt--; }
+        if (cnt > 0) { iov->iov_base = (uint8_t *)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+    return (ssize_t)total;
+}
+
+// ---- Buffered connection input ---------------------------------------------
+// Each connection owns an input buffer refilled by one large recv(); tokens
+// and payloads are carved out of it instead of costing a read() per byte.
+// In epoll mode the socket is non-blocking: a parse that runs out of input
+// gets CONN_AGAIN, and the caller rewinds to `mark` and retries once more
+// bytes arrive. The buffer grows so a whole request can sit in it.
+
+#define CONN_BUFSZ 4096
+#define CONN_BUFMAX (RANGE_MAX_SECTORS * BLOCK_SIZE + CONN_BUFSZ)
+#define CONN_AGAIN (-2)
+
+typedef enum { PROTO_TEXT = 0, PROTO_BIN = 1 } proto_t;
+
+typedef struct conn {
+    int      fd;
+    proto_t  proto;
+    bool     sniffed;         // protocol byte examined
+    bool     nonblock;        // never wait for input; report CONN_AGAIN
+    size_t   mark;            // start of the request being parsed
+    size_t   rpos, rend;      // unread input is in[rpos..rend)
+    size_t   cap;
+    uint8_t *in;
+
+    // epoll mode only: requests parsed by the event loop, awaiting a worker
+    struct req   *ready_head, *ready_tail;
+    bool          eof;        // no more input (peer EOF, read error, bad request)
+    bool          closing;    // send failed: drop whatever is still queued
+    uint8_t      *out;        // reply bytes the socket would not take yet
+    size_t        opos, olen, ocap;   // unsent: out[opos..olen)
+    struct conn  *next_work;
+
+    bool     primary;         // peer is a --primary: its BIN_F_REPL writes pass --read-only
+
+    // Per-client QoS: share of the head (P), fair-queuing tags and counters
+    int       weight;
+    uint64_t  q_finish[MAX_SPINDLES]; // virtual finish tag per spindle (spindle lock)
+    char      peer[64];
+    uint64_t  st_ops, st_wait_ns, st_wait_max_ns, st_promoted;
+    struct conn *cl_prev, *cl_next;   // g_clients
+} conn_t;
+
+// Weights are relative shares of head turns under --qos; P sets them
+#define QOS_WEIGHT_DEFAULT 100
+#define QOS_WEIGHT_MAX 1000
+
+// Live connections for S; closed ones are folded into g_clients_closed
+static pthread_mutex_t g_clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static conn_t *g_clients;
+static struct { uint64_t conns, ops, wait_ns, promoted; } g_clients_closed;
+static _Thread_local conn_t *tl_conn;   // connection being served by this thread
+static conn_t g_conn_internal = { .weight = QOS_WEIGHT_DEFAULT };  // flusher, replication, ...
+
+// --primary: numeric addresses allowed to send replication writes
+static char **g_primaries;
+static int    g_nprimaries;
+
+// A v4 client of a dual-stack socket shows up as ::ffff:a.b.c.d
+static const char *addr_plain(const char *host) {
+    return strncmp(host, "::ffff:", 7) == 0 && strchr(host + 7, '.') ? host + 7 : host;
+}
+
+static bool peer_is_primary(const char *host) {
+    for (int i = 0; i < g_nprimaries; i++)
+        if (strcmp(g_primaries[i], addr_plain(host)) == 0) return true;
+    return false;
+}
+
+// Resolves "host[,host...]" to every numeric address of each host.
+// Returns 0, or -1 if a host does not resolve.
+static int primary_init(const char *list) {
+    char *dup = strdup(list), *save = NULL;
+    if (!dup) return -1;
+    for (char *t = strtok_r(dup, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        struct addrinfo hints = {0}, *res = NULL;
+        hints.ai_family = AF_UNSPEC; hints.ai_socktype = SOCK_STREAM;
+        int rc = getaddrinfo(t, NULL, &hints, &res);
+        if (rc != 0) { fprintf(stderr, "--primary %s: %s\n", t, gai_strerror(rc)); free(dup); return -1; }
+        for (struct addrinfo *it = res; it; it = it->ai_next) {
+            char host[48];
+            if (getnameinfo(it->ai_addr, it->ai_addrlen, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) continue;
+            char **grown = realloc(g_primaries, (size_t)(g_nprimaries + 1) * sizeof(*grown));
+            if (!grown || !(grown[g_nprimaries] = strdup(addr_plain(host)))) {
+                if (grown) g_primaries = grown;
+                freeaddrinfo(res); free(dup); return -1;
+            }
+            g_primaries = grown; g_nprimaries++;
+        }
+        freeaddrinfo(res);
+    }
+    free(dup);
+    return 0;
+}
+
+static conn_t *conn_new(int fd, bool nonblock) {
+    conn_t *cn = calloc(1, sizeof(*cn));
+    if (!cn) return NULL;
+    cn->in = malloc(CONN_BUFSZ);
+    if (!cn->in) { free(cn); return NULL; }
+    cn->fd = fd; cn->proto = PROTO_TEXT; cn->nonblock = nonblock; cn->cap = CONN_BUFSZ;
+    cn->weight = QOS_WEIGHT_DEFAULT;
+    struct sockaddr_storage ss; socklen_t sl = sizeof(ss);
+    char host[48] = "?", port[8] = "?";
+    if (getpeername(fd, (struct sockaddr *)&ss, &sl) == 0)
+        getnameinfo((struct sockaddr *)&ss, sl, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV);
+    snprintf(cn->peer, sizeof(cn->peer), "%s:%s", host, port);
+    cn->primary = peer_is_primary(host);
+    pthread_mutex_lock(&g_clients_lock);
+    cn->cl_next = g_clients;
+    if (g_clients) g_clients->cl_prev = cn;
+    g_clients = cn;
+    pthread_mutex_unlock(&g_clients_lock);
+    return cn;
+}
+
+static void conn_free(conn_t *cn) {
+    pthread_mutex_lock(&g_clients_lock);
+    if (cn->cl_prev) cn->cl_prev->cl_next = cn->cl_next; else g_clients = cn->cl_next;
+    if (cn->cl_next) cn->cl_next->cl_prev = cn->cl_prev;
+    g_clients_closed.conns++;
+    g_clients_closed.ops += cn->st_ops;
+    g_clients_closed.wait_ns += cn->st_wait_ns;
+    g_clients_closed.promoted += cn->st_promoted;
+    pthread_mutex_unlock(&g_clients_lock);
+    free(cn->in);
+    free(cn->out);
+    free(cn);
+}
+
+// S: one line per live client that has been served (busiest first, capped),
+// then the totals of closed connections
+static int client_cmp_ops(const void *a, const void *b) {
+    const conn_t *x = *(conn_t *const *)a, *y = *(conn_t *const *)b;
+    return (x->st_ops < y->st_ops) - (x->st_ops > y->st_ops);
+}
+
+static void clients_dump(FILE *f) {
+    enum { SHOW = 32 };
+    pthread_mutex_lock(&g_clients_lock);
+    size_t n = 0, k = 0;
+    for (conn_t *c = g_clients; c; c = c->cl_next) n++;
+    conn_t **v = n ? malloc(n * sizeof(*v)) : NULL;
+    for (conn_t *c = g_clients; v && c; c = c->cl_next) if (c->st_ops) v[k++] = c;
+    if (v) qsort(v, k, sizeof(*v), client_cmp_ops);
+    for (size_t i = 0; i < k && i < SHOW; i++)
+        fprintf(f, "client %s weight=%d ops=%llu wait_mean=%.1fus wait_max=%.1fus promoted=%llu\n", v[i]->peer,
+                v[i]->weight, (unsigned long long)v[i]->st_ops,
+                (double)v[i]->st_wait_ns / (double)v[i]->st_ops / 1000.0, (double)v[i]->st_wait_max_ns / 1000.0,
+                (unsigned long long)v[i]->st_promoted);
+    if (k > SHOW) fprintf(f, "client ... %zu more\n", k - SHOW);
+    if (g_clients_closed.conns)
+        fprintf(f, "clients closed=%llu ops=%llu wait_mean=%.1fus promoted=%llu\n",
+                (unsigned long long)g_clients_closed.conns, (unsigned long long)g_clients_closed.ops,
+                g_clients_closed.ops ? (double)g_clients_closed.wait_ns / (double)g_clients_closed.ops / 1000.0 : 0.0,
+                (unsigned long long)g_clients_closed.promoted);
+    pthread_mutex_unlock(&g_clients_lock);
+    free(v);
+}
+
+// One recv() into the free tail of the buffer. Bytes before `mark` are
+// dropped when space is needed; bytes after it are kept for a re-parse.
+// Returns bytes added, 0 on EOF, -1 on error, CONN_AGAIN if nothing is ready.
+static ssize_t conn_fill(conn_t *cn) {
+    if (!cn->nonblock) cn->mark = cn->rpos;     // blocking parses never rewind
+    if (cn->mark == cn->rend) {
+        cn->mark = cn->rpos = cn->rend = 0;
+    } else if (cn->rend == cn->cap) {
+        if (cn->mark > 0) {
+            memmove(cn->in, cn->in + cn->mark, cn->rend - cn->mark);
+            cn->rpos -= cn->mark; cn->rend -= cn->mark; cn->mark = 0;
+        } else {
+            if (cn->cap >= CONN_BUFMAX) return -1;  // request can never fit
+            uint8_t *p = realloc(cn->in, cn->cap * 2);
+            if (!p) return -1;
+            cn->in = p; cn->cap *= 2;
+        }
+    }
+    for (;;) {
+        ssize_t r = recv(cn->fd, cn->in + cn->rend, cn->cap - cn->rend, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return CONN_AGAIN;
+        if (r > 0) cn->rend += (size_t)r;
+        return r;
+    }
+}
+
+static inline bool is_ws(uint8_t ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
 // Reads next ASCII token (non-empty, whitespace-separated). Returns:
-//  1 on success, 0 on clean EOF (before any token), -1 on error.
+//  1 on success, 0 on clean EOF (before any token), -1 on error, CONN_AGAIN.
 // On success, token is NUL-terminated in out (max outsz). If token exceeds
-// outsz-1, it is truncated. <--- MOST IMPORTANT PIECE
-static int read_token(int fd, char *out, size_t outsz) {
-    char ch;
+// outsz-1, it is truncated. The single delimiter after the token is consumed,
+// so a W payload starts right after it. <--- MOST IMPORTANT PIECE
+static int conn_read_token(conn_t *cn, char *out, size_t outsz) {
     // Skip leading whitespace (if any)
     for (;;) {
-        ssize_t r = read(fd, &ch, 1);
-        if (r == 0) return 0;         
-        if (r < 0) { if (errno == EINTR) continue; return -1; }
-        if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') break;
+        while (cn->rpos < cn->rend && is_ws(cn->in[cn->rpos])) cn->rpos++;
+        if (cn->rpos < cn->rend) break;
+        ssize_t r = conn_fill(cn);
+        if (r <= 0) return (int)r;
     }
     size_t i = 0;
     for (;;) {
-        if (i + 1 < outsz) out[i++] = ch; // store (with room for NUL)
-        // Peek next char
-        ssize_t r = read(fd, &ch, 1);
-        if (r == 0) { out[i] = '\0'; return 1; }
-        if (r < 0) { if (errno == EINTR) continue; out[i] = '\0'; return -1; }
-        if (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
-            out[i] = '\0';
-            return 1;
+        while (cn->rpos < cn->rend && !is_ws(cn->in[cn->rpos])) {
+            if (i + 1 < outsz) out[i++] = (char)cn->in[cn->rpos]; // store (with room for NUL)
+            cn->rpos++;
+        }
+        if (cn->rpos < cn->rend) { cn->rpos++; break; }  // eat delimiter
+        ssize_t r = conn_fill(cn);
+        if (r == 0) break;                               // EOF ends the token
+        if (r < 0) { out[i] = '\0'; return (int)r; }
+    }
+    out[i] = '\0';
+    return 1;
+}
+
+// read_full() equivalent that drains buffered input first. In blocking mode
+// large remainders bypass the buffer and land directly in buf.
+static ssize_t conn_read_full(conn_t *cn, void *buf, size_t n) {
+    uint8_t *p = buf;
+    size_t left = n;
+    while (left > 0) {
+        size_t have = cn->rend - cn->rpos;
+        if (have > 0) {
+            size_t k = (have < left) ? have : left;
+            memcpy(p, cn->in + cn->rpos, k);
+            cn->rpos += k; p += k; left -= k;
+            continue;
         }
-        // else loop; keeps on consuming
+        if (!cn->nonblock && left >= cn->cap) {
+            ssize_t r = read_full(cn->fd, p, left);
+            if (r < 0) return -1;
+            return (ssize_t)(n - left + (size_t)r);
+        }
+        ssize_t r = conn_fill(cn);
+        if (r == 0) return (ssize_t)(n - left); // EOF
+        if (r < 0) return r;
+    }
+    return (ssize_t)n;
+}
+
+// Maps a conn_read_* result to a parser result: 1 complete, CONN_AGAIN, -1
+static inline int got(ssize_t r, size_t want) {
+    if (r == CONN_AGAIN) return CONN_AGAIN;
+    return (r >= 0 && (size_t)r == want) ? 1 : -1;
+}
+static inline int got_tok(int r) {
+    return (r == 1 || r == CONN_AGAIN) ? r : -1;
+}
+
+// Protocol is chosen by the first byte of the connection.
+// Returns 1 once decided, 0 on EOF, -1 on error, CONN_AGAIN.
+static int conn_sniff(conn_t *cn) {
+    if (cn->sniffed) return 1;
+    if (cn->rpos == cn->rend) {
+        ssize_t r = conn_fill(cn);
+        if (r <= 0) return (int)r;
+    }
+    if (cn->in[cn->rpos] == DISK_BIN_MAGIC) {
+        cn->rpos++;
+        cn->proto = PROTO_BIN;
     }
+    cn->sniffed = true;
+    return 1;
 }
 
 static int mk_listen_socket(const char *port) {
@@ -141,156 +531,2688 @@ static bool valid_csl(const disk_t *d, int c, int s, int l) {
     return true;
 }
 
-static void simulate_seek_locked(disk_t *d, int target_c) {
+// msync() wants a page-aligned start; widen [off, off+len) to whole pages
+static int msync_range(disk_t *d, off_t off, size_t len) {
+    static long page = 0;
+    if (page == 0) page = sysconf(_SC_PAGESIZE);
+    off_t start = off - (off % page);
+    return msync(d->base + start, (size_t)(off - start) + len, MS_SYNC);
+}
+
+// ---- Storage backends ------------------------------------------------------
+// All media access goes through d->be. Offsets/lengths are whole sectors.
+// read/write/sync/discard return 0 on success, -1 on error. sync() makes
+// [off, len) durable (what --sync=after waits for); discard() deallocates
+// the range so it reads back as zeros; close() flushes everything.
+
+struct backend {
+    const char *name;
+    int  (*open)(disk_t *d);
+    int  (*read)(disk_t *d, off_t off, void *buf, size_t len);
+    int  (*write)(disk_t *d, off_t off, const void *buf, size_t len);
+    int  (*sync)(disk_t *d, off_t off, size_t len);
+    int  (*discard)(disk_t *d, off_t off, size_t len);
+    void (*close)(disk_t *d);
+};
+
+// Shared by all backends: punching a hole releases whole file blocks in the
+// range and zeroes the rest; a MAP_SHARED mapping sees the zeros at once
+static int fd_discard(disk_t *d, off_t off, size_t len) {
+    return fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, (off_t)len);
+}
+
+// Page-cache hint for the image. Sector traffic is small and scattered, so
+// kernel readahead mostly faults in (and keeps resident) pages nobody asked
+// for; on a sparse image each of those is a freshly zeroed page.
+typedef enum { ADV_RANDOM = 0, ADV_SEQUENTIAL, ADV_NORMAL } advise_t;
+
+static void disk_advise(disk_t *d, advise_t a) {
+    static const int madv[] = { MADV_RANDOM, MADV_SEQUENTIAL, MADV_NORMAL };
+    static const int fadv[] = { POSIX_FADV_RANDOM, POSIX_FADV_SEQUENTIAL, POSIX_FADV_NORMAL };
+    if (d->base && madvise(d->base, d->bytes, madv[a]) < 0) perror("madvise");
+    int e = posix_fadvise(d->fd, 0, 0, fadv[a]);
+    if (e != 0) { errno = e; perror("posix_fadvise"); }
+}
+
+// -- mmap: MAP_SHARED mapping of the whole image (original behaviour)
+
+static int mm_open(disk_t *d) {
+    void *base = mmap(NULL, d->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+    if (base == MAP_FAILED) { perror("mmap"); return -1; }
+    d->base = (uint8_t *)base;
+    return 0;
+}
+static int mm_read(disk_t *d, off_t off, void *buf, size_t len) {
+    memcpy(buf, d->base + off, len);
+    return 0;
+}
+static int mm_write(disk_t *d, off_t off, const void *buf, size_t len) {
+    memcpy(d->base + off, buf, len);
+    return 0;
+}
+static int mm_sync(disk_t *d, off_t off, size_t len) {
+    return msync_range(d, off, len);
+}
+static void mm_close(disk_t *d) {
+    msync(d->base, d->bytes, MS_SYNC);
+    munmap(d->base, d->bytes);
+}
+
+// -- pread/pwrite: no mapping, so no page-fault stalls inside the critical
+//    section; fdatasync() for durability
+
+static int pio_open(disk_t *d) { (void)d; return 0; }
+static int pio_read(disk_t *d, off_t off, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t r = pread(d->fd, p, len, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) { memset(p, 0, len); break; }   // past EOF reads as zeros
+        p += r; off += r; len -= (size_t)r;
+    }
+    return 0;
+}
+static int pio_write(disk_t *d, off_t off, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(d->fd, p, len, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        p += w; off += w; len -= (size_t)w;
+    }
+    return 0;
+}
+static int pio_sync(disk_t *d, off_t off, size_t len) {
+    (void)off; (void)len;
+    return fdatasync(d->fd);
+}
+static void pio_close(disk_t *d) { fdatasync(d->fd); }
+
+// -- io_uring: callers queue ops and sleep; one submitter thread moves every
+//    queued op into the SQ and submits the whole batch with a single
+//    io_uring_enter(), then wakes the owners as completions arrive.
+//    Raw syscalls, so no liburing dependency.
+
+#define URING_ENTRIES 256
+
+typedef struct uring_op {
+    uint8_t  opcode;          // IORING_OP_READ / WRITE / FSYNC
+    off_t    off;
+    void    *buf;
+    uint32_t len;
+    int      res;             // cqe->res
+    bool     done;
+    struct uring_op *next;
+} uring_op_t;
+
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void  *sq_map, *cq_map; size_t sq_map_sz, cq_map_sz, sqes_sz;
+    pthread_t thread;
+    pthread_mutex_t lock;     // pending list + done flags
+    pthread_cond_t  work_cv;  // submitter waits for ops
+    pthread_cond_t  done_cv;  // owners wait for completion
+    uring_op_t *pending, *pending_tail;
+    int  failed;              // errno of a failed io_uring_enter: the ring is not used again
+    bool stop;                // ur_close: submitter exits once pending is drained
+    uint64_t st_enters, st_ops;
+} uring_t;
+
+// Completes ops that will never get a cqe with -err. Caller holds u->lock.
+static void uring_fail_locked(uring_t *u, uring_op_t **ops, unsigned n, uring_op_t *rest, int err) {
+    for (unsigned i = 0; i < n; i++) if (!ops[i]->done) { ops[i]->res = -err; ops[i]->done = true; }
+    while (rest) { uring_op_t *op = rest; rest = op->next; op->res = -err; op->done = true; }
+    pthread_cond_broadcast(&u->done_cv);
+}
+
+static void *uring_submitter(void *arg) {
+    disk_t *d = arg;
+    uring_t *u = d->be_state;
+    for (;;) {
+        pthread_mutex_lock(&u->lock);
+        while (!u->pending && !u->stop) pthread_cond_wait(&u->work_cv, &u->lock);
+        if (!u->pending) { pthread_mutex_unlock(&u->lock); break; }
+        uring_op_t *batch = u->pending;
+        u->pending = u->pending_tail = NULL;
+        pthread_mutex_unlock(&u->lock);
+
+        if (u->failed) {
+            pthread_mutex_lock(&u->lock);
+            uring_fail_locked(u, NULL, 0, batch, u->failed);
+            pthread_mutex_unlock(&u->lock);
+            continue;
+        }
+        while (batch) {
+            // Fill as many SQEs as fit, then submit them in one go
+            uring_op_t *ops[URING_ENTRIES];
+            unsigned tail = *u->sq_tail, n = 0;
+            while (batch && n < URING_ENTRIES) {
+                uring_op_t *op = batch; batch = op->next;
+                ops[n] = op;
+                unsigned idx = tail & *u->sq_mask;
+                struct io_uring_sqe *sqe = &u->sqes[idx];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = op->opcode;
+                sqe->fd = d->fd;
+                sqe->off = (uint64_t)op->off;
+                sqe->addr = (uint64_t)(uintptr_t)op->buf;
+                sqe->len = op->len;
+                if (op->opcode == IORING_OP_FSYNC) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                sqe->user_data = (uint64_t)(uintptr_t)op;
+                u->sq_array[idx] = idx;
+                tail++; n++;
+            }
+            __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+            unsigned reaped = 0;
+            unsigned to_submit = n;
+            while (reaped < n) {
+                int r = (int)syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (r < 0 && errno != EINTR) {
+                    // Fail everything not reaped, and everything after it
+                    u->failed = errno; perror("io_uring_enter");
+                    pthread_mutex_lock(&u->lock);
+                    uring_fail_locked(u, ops, n, batch, u->failed);
+                    pthread_mutex_unlock(&u->lock);
+                    batch = NULL;
+                    break;
+                }
+                if (r > 0) to_submit -= (unsigned)r;
+                u->st_enters++;
+                unsigned head = *u->cq_head;
+                pthread_mutex_lock(&u->lock);
+                while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+                    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+                    uring_op_t *op = (uring_op_t *)(uintptr_t)cqe->user_data;
+                    op->res = cqe->res; op->done = true;
+                    head++; reaped++;
+                }
+                __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+                pthread_cond_broadcast(&u->done_cv);
+                pthread_mutex_unlock(&u->lock);
+            }
+            u->st_ops += n;
+        }
+    }
+    return NULL;
+}
+
+static int uring_do(disk_t *d, uint8_t opcode, off_t off, void *buf, size_t len) {
+    uring_t *u = d->be_state;
+    uring_op_t op = { .opcode = opcode, .off = off, .buf = buf, .len = (uint32_t)len };
+    pthread_mutex_lock(&u->lock);
+    if (u->pending_tail) u->pending_tail->next = &op; else u->pending = &op;
+    u->pending_tail = &op;
+    pthread_cond_signal(&u->work_cv);
+    while (!op.done) pthread_cond_wait(&u->done_cv, &u->lock);
+    pthread_mutex_unlock(&u->lock);
+    if (op.res < 0) { errno = -op.res; return -1; }
+    if (opcode != IORING_OP_FSYNC && (size_t)op.res != len) {
+        if (opcode == IORING_OP_READ) { memset((uint8_t *)buf + op.res, 0, len - (size_t)op.res); return 0; }
+        return -1;
+    }
+    return 0;
+}
+
+// Unmaps whatever of the rings ur_open got mapped and closes the ring
+static void ur_unmap(uring_t *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_sz);
+    if (u->cq_map && u->cq_map != MAP_FAILED && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_sz);
+    if (u->sq_map && u->sq_map != MAP_FAILED) munmap(u->sq_map, u->sq_map_sz);
+    close(u->ring_fd);
+    free(u);
+}
+
+static int ur_open(disk_t *d) {
+    uring_t *u = calloc(1, sizeof(*u));
+    if (!u) return -1;
+    struct io_uring_params p; memset(&p, 0, sizeof(p));
+    u->ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->ring_fd < 0) { perror("io_uring_setup"); free(u); return -1; }
+    u->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_sz > u->sq_map_sz) u->sq_map_sz = u->cq_map_sz;
+        u->cq_map_sz = u->sq_map_sz;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) { perror("mmap sq"); ur_unmap(u); return -1; }
+    u->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? u->sq_map
+              : mmap(NULL, u->cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+    if (u->cq_map == MAP_FAILED) { perror("mmap cq"); ur_unmap(u); return -1; }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) { perror("mmap sqes"); ur_unmap(u); return -1; }
+    uint8_t *sq = u->sq_map, *cq = u->cq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);   u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask); u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);   u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->work_cv, NULL);
+    pthread_cond_init(&u->done_cv, NULL);
+    d->be_state = u;
+    if (pthread_create(&u->thread, NULL, uring_submitter, d) != 0) {
+        perror("pthread_create"); d->be_state = NULL;
+        pthread_mutex_destroy(&u->lock); pthread_cond_destroy(&u->work_cv); pthread_cond_destroy(&u->done_cv);
+        ur_unmap(u); return -1;
+    }
+    return 0;
+}
+static int ur_read(disk_t *d, off_t off, void *buf, size_t len) {
+    return uring_do(d, IORING_OP_READ, off, buf, len);
+}
+static int ur_write(disk_t *d, off_t off, const void *buf, size_t len) {
+    return uring_do(d, IORING_OP_WRITE, off, (void *)buf, len);
+}
+static int ur_sync(disk_t *d, off_t off, size_t len) {
+    (void)off; (void)len;
+    return uring_do(d, IORING_OP_FSYNC, 0, NULL, 0);
+}
+static void ur_close(disk_t *d) {
+    uring_t *u = d->be_state;
+    ur_sync(d, 0, 0);
+    fprintf(stderr, "uring: ops=%llu enters=%llu (%.2f ops/enter)\n", (unsigned long long)u->st_ops,
+            (unsigned long long)u->st_enters, u->st_enters ? (double)u->st_ops / (double)u->st_enters : 0.0);
+    pthread_mutex_lock(&u->lock);
+    u->stop = true;
+    pthread_cond_signal(&u->work_cv);
+    pthread_mutex_unlock(&u->lock);
+    pthread_join(u->thread, NULL);
+    pthread_mutex_destroy(&u->lock); pthread_cond_destroy(&u->work_cv); pthread_cond_destroy(&u->done_cv);
+    ur_unmap(u);
+    d->be_state = NULL;
+}
+
+static const backend_t g_backends[] = {
+    { "mmap",  mm_open,  mm_read,  mm_write,  mm_sync,  fd_discard, mm_close  },
+    { "pread", pio_open, pio_read, pio_write, pio_sync, fd_discard, pio_close },
+    { "uring", ur_open,  ur_read,  ur_write,  ur_sync,  fd_discard, ur_close  },
+};
+
+static const backend_t *backend_find(const char *name) {
+    for (size_t i = 0; i < sizeof(g_backends) / sizeof(g_backends[0]); i++)
+        if (strcmp(g_backends[i].name, name) == 0) return &g_backends[i];
+    return NULL;
+}
+
+// n sectors from (c, s) all on the disk (no size cap: discard moves no data)
+static bool valid_span(const disk_t *d, int c, int s, int n) {
+    if (n < 1 || !valid_csl(d, c, s, BLOCK_SIZE)) return false;
+    long long first = (long long)c * d->sectors + s;
+    return first + n <= (long long)d->cylinders * d->sectors;
+}
+
+static bool valid_range(const disk_t *d, int c, int s, int n) {
+    return n <= RANGE_MAX_SECTORS && valid_span(d, c, s, n);
+}
+
+// Moves the head and returns the seek time in microseconds. The caller
+// sleeps it off, so the spindles of one request seek in parallel.
+static long simulate_seek_locked(disk_t *d, int target_c) {
     int delta = target_c - d->current_cyl;
     if (delta < 0) delta = -delta;
+    delta += d->carry_cyl; d->carry_cyl = 0;
+    long total_us = 0;
     if (d->track_us > 0 && delta > 0) {
-        struct timespec ts;
-        long total_us = (long)delta * d->track_us;
-        ts.tv_sec = total_us / 1000000L;
-        ts.tv_nsec = (total_us % 1000000L) * 1000L;
-        nanosleep(&ts, NULL);
+        total_us = (long)delta * d->track_us;
+        d->st_seek_us += (uint64_t)total_us;
     }
+    d->st_seek_cyl += (uint64_t)delta;
     d->current_cyl = target_c;
+    return total_us;
 }
 
-static void *client_thread(void *arg) {
-    int cfd = *(int *)arg; free(arg);
-    extern disk_t g_disk; // defined in main (see main() below)
+static void sleep_us(long us) {
+    if (us <= 0) return;
+    struct timespec ts = { us / 1000000L, (us % 1000000L) * 1000L };
+    nanosleep(&ts, NULL);
+}
 
-    char tok[64];
-    for (;;) {
-        int r = read_token(cfd, tok, sizeof(tok));
-        if (r == 0) break;           // EOF
-        if (r < 0) { perror("read_token"); break; }
-        if (tok[0] == 'I' && tok[1] == '\0') {
-            char b[64];
-            int n = snprintf(b, sizeof(b), "%d %d\n", g_disk.cylinders, g_disk.sectors);
-            if (write_full(cfd, b, (size_t)n) < 0) break;
-        } else if (tok[0] == 'R' && tok[1] == '\0') {
-            // Expect c and s
-            char t1[32], t2[32];
-            if (read_token(cfd, t1, sizeof(t1)) <= 0 || read_token(cfd, t2, sizeof(t2)) <= 0) { break; }
-            int c = atoi(t1), s = atoi(t2);
-            if (!valid_csl(&g_disk, c, s, BLOCK_SIZE)) {
-                char z = '0'; if (write_full(cfd, &z, 1) < 0) break; continue;
-            }
-            // Simulate seek + read
-            pthread_mutex_lock(&g_disk.lock);
-            simulate_seek_locked(&g_disk, c);
-            off_t off = sector_offset(&g_disk, c, s);
-            char ok = '1';
-            if (write_full(cfd, &ok, 1) < 0) { pthread_mutex_unlock(&g_disk.lock); break; }
-            if (write_full(cfd, g_disk.base + off, BLOCK_SIZE) < 0) { pthread_mutex_unlock(&g_disk.lock); break; }
-            pthread_mutex_unlock(&g_disk.lock);
-        } else if (tok[0] == 'W' && tok[1] == '\0') {
-            char t1[32], t2[32], t3[32];
-            if (read_token(cfd, t1, sizeof(t1)) <= 0 || read_token(cfd, t2, sizeof(t2)) <= 0 || read_token(cfd, t3, sizeof(t3)) <= 0) { break; }
-            int c = atoi(t1), s = atoi(t2), l = atoi(t3);
-            bool ok_args = valid_csl(&g_disk, c, s, l);
-
-            // Read payload (if l > 0) regardless of validity to keep stream in sync
-            uint8_t buf[BLOCK_SIZE];
-            memset(buf, 0, sizeof(buf));
-            if (l > 0) {
-                size_t want = (size_t)((l > BLOCK_SIZE) ? BLOCK_SIZE : l);
-                ssize_t rr = read_full(cfd, buf, want);
-                if (rr < 0 || (size_t)rr < want) { break; }
-            }
+// ---- Latency statistics ----------------------------------------------------
+// Every request is timed phase by phase: waiting for the head (or stripe
+// locks), simulated seek, media work (backend copy, flush, cache) and the
+// socket send. ph_mark(p) charges the time since the previous mark to phase
+// p. Histograms are log2-bucketed by nanoseconds and kept per thread, so
+// recording takes no lock; `S` merges them. Reads of another thread's
+// counters while it records may be a sample behind, which is fine here.
 
-            if (!ok_args) {
-                char z = '0'; if (write_full(cfd, &z, 1) < 0) break; continue;
-            }
+#define LAT_BUCKETS 40                          // bucket b holds [2^(b-1), 2^b) ns
+enum { PH_WAIT, PH_SEEK, PH_MEDIA, PH_SEND, PH_TOTAL, PH_N };
+enum { OPI_I, OPI_R, OPI_W, OPI_RR, OPI_WR, OPI_S, OPI_T, OPI_SN, OPI_SX, OPI_SR, OPI_P, OPI_N };
+
+typedef struct tstats {
+    uint64_t ops[OPI_N], bytes[OPI_N];
+    uint64_t sum_ns[OPI_N][PH_N];
+    uint64_t hist[OPI_N][PH_N][LAT_BUCKETS];
+    struct tstats *next;
+} tstats_t;
+
+static pthread_mutex_t g_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static tstats_t *g_stats_live;                  // one per thread that served a request
+static tstats_t  g_stats_retired;               // folded in from threads that exited
+static _Thread_local tstats_t *tl_stats;
+static _Thread_local uint64_t tl_mark_ns, tl_ph[PH_N];
+
+static uint64_t now_ns(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t ph_start(void) {
+    memset(tl_ph, 0, sizeof(tl_ph));
+    return tl_mark_ns = now_ns();
+}
+
+static void ph_mark(int ph) {
+    uint64_t t = now_ns();
+    tl_ph[ph] += t - tl_mark_ns;
+    tl_mark_ns = t;
+}
+
+static int op_index(uint8_t op) {
+    switch (op) {
+        case 'I': return OPI_I;
+        case 'R': return OPI_R;
+        case 'W': return OPI_W;
+        case 'r': return OPI_RR;
+        case 'w': return OPI_WR;
+        case 'S': return OPI_S;
+        case 'T': return OPI_T;
+        case 'N': return OPI_SN;
+        case 'X': return OPI_SX;
+        case 'q': return OPI_SR;
+        case 'P': return OPI_P;
+        default:  return -1;
+    }
+}
+
+static inline int lat_bucket(uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+static void stats_record(int opi, uint64_t bytes, uint64_t total_ns) {
+    if (opi < 0) return;
+    if (!tl_stats) {
+        if (!(tl_stats = calloc(1, sizeof(*tl_stats)))) return;
+        pthread_mutex_lock(&g_stats_lock);
+        tl_stats->next = g_stats_live; g_stats_live = tl_stats;
+        pthread_mutex_unlock(&g_stats_lock);
+    }
+    tl_ph[PH_TOTAL] = total_ns;
+    tl_stats->ops[opi]++;
+    tl_stats->bytes[opi] += bytes;
+    for (int p = 0; p < PH_N; p++) {
+        tl_stats->sum_ns[opi][p] += tl_ph[p];
+        tl_stats->hist[opi][p][lat_bucket(tl_ph[p])]++;
+    }
+}
+
+static void stats_merge(tstats_t *dst, const tstats_t *src) {
+    for (int o = 0; o < OPI_N; o++) {
+        dst->ops[o] += src->ops[o]; dst->bytes[o] += src->bytes[o];
+        for (int p = 0; p < PH_N; p++) {
+            dst->sum_ns[o][p] += src->sum_ns[o][p];
+            for (int b = 0; b < LAT_BUCKETS; b++) dst->hist[o][p][b] += src->hist[o][p][b];
+        }
+    }
+}
+
+// Called by a connection thread on its way out
+static void stats_retire(void) {
+    if (!tl_stats) return;
+    pthread_mutex_lock(&g_stats_lock);
+    for (tstats_t **pp = &g_stats_live; *pp; pp = &(*pp)->next)
+        if (*pp == tl_stats) { *pp = tl_stats->next; break; }
+    stats_merge(&g_stats_retired, tl_stats);
+    pthread_mutex_unlock(&g_stats_lock);
+    free(tl_stats); tl_stats = NULL;
+}
+
+// Upper bound (us) of the bucket holding the p-quantile
+static double hist_pct_us(const uint64_t *h, uint64_t n, double p) {
+    uint64_t want = (uint64_t)(p * (double)n + 0.5), acc = 0;
+    if (want == 0) want = 1;
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        if ((acc += h[b]) >= want) return (double)(1ull << b) / 1000.0;
+    return (double)(1ull << (LAT_BUCKETS - 1)) / 1000.0;
+}
 
-            if (g_disk.sync_mode == SYNC_IMMEDIATE) {
-                char one = '1'; if (write_full(cfd, &one, 1) < 0) break;
+static void stats_dump(FILE *f, const tstats_t *t) {
+    static const char *const opn[OPI_N] = { "I", "R", "W", "RR", "WR", "S", "T", "N", "X", "SR", "P" };
+    static const char *const phn[PH_N] = { "wait", "seek", "media", "send", "total" };
+    for (int o = 0; o < OPI_N; o++) {
+        uint64_t n = t->ops[o];
+        if (n == 0) continue;
+        fprintf(f, "op %s count=%llu bytes=%llu\n", opn[o], (unsigned long long)n, (unsigned long long)t->bytes[o]);
+        for (int p = 0; p < PH_N; p++) {
+            const uint64_t *h = t->hist[o][p];
+            fprintf(f, "  %-5s mean=%.1fus p50<=%.1fus p90<=%.1fus p99<=%.1fus p999<=%.1fus |", phn[p],
+                    (double)t->sum_ns[o][p] / (double)n / 1000.0, hist_pct_us(h, n, 0.50),
+                    hist_pct_us(h, n, 0.90), hist_pct_us(h, n, 0.99), hist_pct_us(h, n, 0.999));
+            for (int b = 0; b < LAT_BUCKETS; b++) {
+                double us = (double)(1ull << b) / 1000.0;
+                if (h[b]) fprintf(f, us < 1000 ? " %.3g:%llu" : " %.0f:%llu", us, (unsigned long long)h[b]);
             }
+            fputc('\n', f);
+        }
+    }
+}
+
+// ---- Elevator scheduler ----------------------------------------------------
+// Requests queue up in front of the head. sched_acquire() blocks until the
+// policy picks the caller; the caller then owns the head/media (no mutex held
+// while it seeks) and must call sched_release() when done.
+//
+// --qos puts start-time fair queuing over connections under the policy. A
+// connection's requests are tagged on arrival with a virtual start time:
+// max(spindle virtual time, the connection's previous finish tag), and
+// each head turn advances its finish tag by QOS_VT / weight. The policy
+// only chooses among requests tagged within a window of the smallest tag
+// (--qos-window, in percent of a default-weight turn): a busy connection
+// cannot crowd out one that was idle, and weights hold, while the elevator
+// keeps some choice of cylinders. A wider window seeks less but blurs the
+// weights. On top of that every request has
+// a deadline (--qos-read-ms, longer --qos-write-ms); once one passes, the
+// most overdue request is served next whatever the policy or tags say.
+// A connection has at most one request queued per spindle (it is served by
+// one thread at a time), so the pending list doubles as per-connection queues.
+
+#define QOS_VT 1000000ull       // cost of one turn at weight 1
+
+static const char *sync_name(sync_mode_t m) {
+    switch (m) {
+        case SYNC_AFTER:    return "after";
+        case SYNC_PERIODIC: return "periodic";
+        default:            return "immediate";
+    }
+}
+
+static const char *sched_name(sched_policy_t p) {
+    switch (p) {
+        case IOSCHED_SSTF:  return "sstf";
+        case IOSCHED_SCAN:  return "scan";
+        case IOSCHED_CLOOK: return "clook";
+        default:          return "fifo";
+    }
+}
+
+// Tags a new request with its connection's fair-queuing start time and deadline
+static void qos_tag_locked(disk_t *d, io_req_t *r, bool write) {
+    conn_t *cn = tl_conn ? tl_conn : &g_conn_internal;
+    uint64_t *fin = &cn->q_finish[d->index];
+    r->cl = cn;
+    r->tag = *fin > d->qos_vt ? *fin : d->qos_vt;
+    *fin = r->tag + QOS_VT / (uint64_t)cn->weight;
+    r->deadline = now_ns() + (write ? d->qos_write_ns : d->qos_read_ns);
+}
+
+// Under --qos: returns the most overdue request, else narrows the policy's
+// choice (d->qos_limit) to the fair-queuing window
+static io_req_t **qos_pick_locked(disk_t *d) {
+    uint64_t now = now_ns(), min_tag = UINT64_MAX;
+    io_req_t **late = NULL;
+    for (io_req_t **pp = &d->pending; *pp; pp = &(*pp)->next) {
+        if ((*pp)->tag < min_tag) min_tag = (*pp)->tag;
+        if ((*pp)->deadline <= now && (!late || (*pp)->deadline < (*late)->deadline)) late = pp;
+    }
+    d->qos_limit = min_tag + d->qos_window;
+    if (late) { d->st_qos_promoted++; (*late)->cl->st_promoted++; }
+    return late;
+}
 
-            pthread_mutex_lock(&g_disk.lock);
-            simulate_seek_locked(&g_disk, c);
-            off_t off = sector_offset(&g_disk, c, s);
-            // Write l bytes, zero-fill remainder
-            memcpy(g_disk.base + off, buf, (size_t)l);
-            if (l < BLOCK_SIZE) memset(g_disk.base + off + l, 0, (size_t)(BLOCK_SIZE - l));
-            if (g_disk.sync_mode == SYNC_AFTER) {
-                // make durable before responding
-                msync(g_disk.base + off, BLOCK_SIZE, MS_SYNC);
-                char one = '1'; if (write_full(cfd, &one, 1) < 0) { pthread_mutex_unlock(&g_disk.lock); break; }
+static inline bool sched_ok(const disk_t *d, const io_req_t *r) {
+    return r->tag <= d->qos_limit;
+}
+
+// Picks (and unlinks) the next request per policy. Caller holds d->lock.
+static io_req_t *sched_pick_locked(disk_t *d) {
+    io_req_t **best = NULL;
+    int head = d->current_cyl;
+    bool any = false;
+
+    d->qos_limit = UINT64_MAX;
+    if (d->qos && d->pending) best = qos_pick_locked(d);
+    if (!best) switch (d->policy) {
+    case IOSCHED_FIFO:
+        for (io_req_t **pp = &d->pending; *pp; pp = &(*pp)->next)
+            if (sched_ok(d, *pp) && (!best || (*pp)->seq < (*best)->seq)) best = pp;
+        break;
+    case IOSCHED_SSTF:
+        for (io_req_t **pp = &d->pending; *pp; pp = &(*pp)->next) {
+            if (!sched_ok(d, *pp)) continue;
+            if (!best) { best = pp; continue; }
+            int da = abs((*pp)->cyl - head), db = abs((*best)->cyl - head);
+            if (da < db || (da == db && (*pp)->seq < (*best)->seq)) best = pp;
+        }
+        break;
+    case IOSCHED_SCAN:
+        // Nearest request in the sweep direction; if none, run to the edge
+        // and reverse (the edge travel is charged to the next seek). The head
+        // only turns when there is eligible work behind it.
+        for (io_req_t *p = d->pending; p && !any; p = p->next) any = sched_ok(d, p);
+        for (int pass = 0; any && pass < 2 && !best; pass++) {
+            for (io_req_t **pp = &d->pending; *pp; pp = &(*pp)->next) {
+                int dist = ((*pp)->cyl - head) * d->dir;
+                if (dist < 0 || !sched_ok(d, *pp)) continue;
+                if (!best || dist < ((*best)->cyl - head) * d->dir ||
+                    (dist == ((*best)->cyl - head) * d->dir && (*pp)->seq < (*best)->seq)) best = pp;
             }
-            pthread_mutex_unlock(&g_disk.lock);
-        } else {
-            // Unknown token — drain until newline and ignore
-            const char x = '\n';
-            (void)x; // no-op; you may wish to log
+            if (!best) {
+                int edge = (d->dir > 0) ? d->cylinders - 1 : 0;
+                d->carry_cyl += abs(edge - head);
+                d->current_cyl = head = edge;
+                d->dir = -d->dir;
+            }
+        }
+        break;
+    case IOSCHED_CLOOK:
+        // Serve upward only; when nothing is above the head, jump back to
+        // the lowest pending cylinder.
+        for (io_req_t **pp = &d->pending; *pp; pp = &(*pp)->next) {
+            if ((*pp)->cyl < head || !sched_ok(d, *pp)) continue;
+            if (!best || (*pp)->cyl < (*best)->cyl ||
+                ((*pp)->cyl == (*best)->cyl && (*pp)->seq < (*best)->seq)) best = pp;
+        }
+        if (!best) {
+            for (io_req_t **pp = &d->pending; *pp; pp = &(*pp)->next)
+                if (sched_ok(d, *pp) && (!best || (*pp)->cyl < (*best)->cyl ||
+                    ((*pp)->cyl == (*best)->cyl && (*pp)->seq < (*best)->seq))) best = pp;
         }
+        break;
     }
+    if (!best) return NULL;
+    io_req_t *r = *best;
+    *best = r->next;
+    r->next = NULL;
+    if (d->qos && r->tag > d->qos_vt) d->qos_vt = r->tag;
+    return r;
+}
 
-    close(cfd);
-    return NULL;
+static void sched_acquire(disk_t *d, int cyl, bool write) {
+    pthread_mutex_lock(&d->lock);
+    io_req_t r = { .cyl = cyl, .seq = d->next_seq++, .granted = false, .next = d->pending };
+    if (d->qos) qos_tag_locked(d, &r, write);
+    if (!d->busy && d->pending == NULL) {
+        d->busy = true;
+        if (d->qos && r.tag > d->qos_vt) d->qos_vt = r.tag;
+        pthread_mutex_unlock(&d->lock);
+        return;
+    }
+    pthread_cond_init(&r.cv, NULL);
+    d->pending = &r;
+    while (!r.granted) pthread_cond_wait(&r.cv, &d->lock);
+    pthread_mutex_unlock(&d->lock);
+    pthread_cond_destroy(&r.cv);
 }
 
-// Global disk instance
-static disk_t g_disk;
+static void sched_release(disk_t *d) {
+    d->st_ops++;                        // one op = one turn on the head
+    pthread_mutex_lock(&d->lock);
+    io_req_t *next = sched_pick_locked(d);
+    if (next) {
+        next->granted = true;           // ownership passes straight to next
+        pthread_cond_signal(&next->cv);
+    } else {
+        d->busy = false;
+    }
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Sums the per-spindle counters of the logical disk d
+static void spindle_totals(const disk_t *d, uint64_t *ops, uint64_t *cyl, uint64_t *us) {
+    *ops = *cyl = *us = 0;
+    for (int m = 0; m < d->nmem; m++) {
+        *ops += d->mem[m].st_ops; *cyl += d->mem[m].st_seek_cyl; *us += d->mem[m].st_seek_us;
+    }
+}
 
-typedef struct { const char *port; int cyl; int sec; int track_us; const char *file; sync_mode_t sync; } args_t;
+static void sched_report(const disk_t *d) {
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (double)(now.tv_sec - d->st_start.tv_sec) + (double)(now.tv_nsec - d->st_start.tv_nsec) / 1e9;
+    uint64_t ops, cyl, us; spindle_totals(d, &ops, &cyl, &us);
+    if (d->striped) {
+        fprintf(stderr, "sched=striped stripes=%d ops=%llu throughput=%.1f ops/s\n", d->nstripes,
+                (unsigned long long)ops, secs > 0 ? (double)ops / secs : 0.0);
+    } else {
+        double mean = ops ? (double)cyl / (double)ops : 0.0;
+        fprintf(stderr, "sched=%s ops=%llu seek_cyl=%llu mean_seek=%.2f cyl seek_time=%.3f s throughput=%.1f ops/s\n",
+                sched_name(d->policy), (unsigned long long)ops, (unsigned long long)cyl, mean,
+                (double)us / 1e6, secs > 0 ? (double)ops / secs : 0.0);
+    }
+    if (d->mem[0].qos) {
+        uint64_t promoted = 0;
+        for (int m = 0; m < d->nmem; m++) promoted += d->mem[m].st_qos_promoted;
+        fprintf(stderr, "qos: promoted=%llu (past their deadline)\n", (unsigned long long)promoted);
+    }
+    for (int m = 0; d->nmem > 1 && m < d->nmem; m++)
+        fprintf(stderr, "  spindle %d (%s): cyl=%d ops=%llu seek_cyl=%llu seek_time=%.3f s\n", m, d->mem[m].path,
+                d->mem[m].cylinders, (unsigned long long)d->mem[m].st_ops,
+                (unsigned long long)d->mem[m].st_seek_cyl, (double)d->mem[m].st_seek_us / 1e6);
+}
 
-static void usage(const char *prog) {
-    fprintf(stderr,
-        "Usage: %s <port> <cylinders> <sectors_per_cyl> <track_us> <backing_file> [--sync=immediate|after]\n",
-        prog);
+// ---- Spindles (RAID-0) -----------------------------------------------------
+// Logical cylinder L lives in stripe unit u = L / su, on spindle u % nmem,
+// at spindle cylinder (u / nmem) * su + L % su. With one backing file this
+// is the identity. Upper layers (caches, group commit, wire protocol) only
+// see logical cylinders and byte offsets; the helpers below split those
+// into per-spindle pieces.
+
+static int spindle_of(const disk_t *d, int c, int *mc) {
+    int u = c / d->su;
+    *mc = (u / d->nmem) * d->su + c % d->su;
+    return u % d->nmem;
 }
 
-// Main function
-int main(int argc, char **argv) {
-    if (argc < 6) { usage(argv[0]); return 1; }
-    args_t A = {0};
-    A.port = argv[1]; A.cyl = atoi(argv[2]); A.sec = atoi(argv[3]); A.track_us = atoi(argv[4]); A.file = argv[5]; A.sync = SYNC_AFTER;
-    if (argc >= 7) {
-        if (strcmp(argv[6], "--sync=immediate") == 0) A.sync = SYNC_IMMEDIATE;
-        else if (strcmp(argv[6], "--sync=after") == 0) A.sync = SYNC_AFTER;
-        else { usage(argv[0]); return 1; }
+// Spindle cylinders [lo[m], hi[m]] touched by logical cylinders c..last_c
+// (lo[m] = -1 if spindle m is not touched). A contiguous logical span maps
+// to a contiguous span on every spindle.
+static void spindle_span(const disk_t *d, int c, int last_c, int *lo, int *hi) {
+    for (int m = 0; m < d->nmem; m++) lo[m] = hi[m] = -1;
+    for (int L = c; L <= last_c; ) {
+        int end = (L / d->su + 1) * d->su - 1;
+        if (end > last_c) end = last_c;
+        int mc, m = spindle_of(d, L, &mc);
+        if (lo[m] < 0) lo[m] = mc;
+        hi[m] = mc + (end - L);
+        L = end + 1;
+    }
+}
+
+typedef enum { DIO_READ, DIO_WRITE, DIO_DISCARD } dio_t;
+
+static int dio_piece(disk_t *sp, dio_t op, off_t off, void *buf, size_t len) {
+    switch (op) {
+    case DIO_READ:  return sp->be->read(sp, off, buf, len);
+    case DIO_WRITE: return sp->be->write(sp, off, buf, len);
+    default:        return sp->be->discard(sp, off, len);
     }
-    if (A.cyl <= 0 || A.sec <= 0 || A.track_us < 0) { usage(argv[0]); return 1; }
+}
 
-    signal(SIGINT, on_sigint);
+// Applies op to a logical byte range, one backend call per stripe-unit piece
+static int disk_io(disk_t *d, dio_t op, off_t off, void *buf, size_t len) {
+    if (d->nmem == 1) return dio_piece(&d->mem[0], op, off, buf, len);
+    off_t unit = (off_t)d->su * d->sectors * BLOCK_SIZE;
+    uint8_t *p = buf;
+    while (len > 0) {
+        off_t u = off / unit, in = off - u * unit;
+        size_t n = (size_t)(unit - in) < len ? (size_t)(unit - in) : len;
+        disk_t *sp = &d->mem[u % d->nmem];
+        off_t moff = (u / d->nmem) * unit + in;
+        if (dio_piece(sp, op, moff, p, n) < 0) return -1;
+        off += (off_t)n; len -= n;
+        if (p) p += n;
+    }
+    return 0;
+}
 
-    // Prepare backing file
-    int fd = open(A.file, O_RDWR | O_CREAT, 0644);
-    if (fd < 0) { perror("open backing file"); return 1; }
-    size_t total = (size_t)A.cyl * (size_t)A.sec * (size_t)BLOCK_SIZE;
-    if (ftruncate(fd, (off_t)total) < 0) { perror("ftruncate"); close(fd); return 1; }
-    void *base = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (base == MAP_FAILED) { perror("mmap"); close(fd); return 1; }
+static int disk_read(disk_t *d, off_t off, void *buf, size_t len) {
+    return disk_io(d, DIO_READ, off, buf, len);
+}
 
-    // Initializing disk
-    g_disk.base = (uint8_t *)base;
-    g_disk.bytes = total;
-    g_disk.fd = fd;
-    g_disk.cylinders = A.cyl;
-    g_disk.sectors = A.sec;
-    g_disk.track_us = A.track_us;
-    g_disk.current_cyl = 0;
-    g_disk.sync_mode = A.sync;
-    pthread_mutex_init(&g_disk.lock, NULL);
+// Makes a logical byte range durable: one sync per spindle it touches
+static int disk_sync(disk_t *d, off_t off, size_t len) {
+    if (d->nmem == 1) return d->be->sync(&d->mem[0], off, len);
+    off_t cb = (off_t)d->sectors * BLOCK_SIZE;
+    int lo[MAX_SPINDLES], hi[MAX_SPINDLES], rc = 0;
+    spindle_span(d, (int)(off / cb), (int)((off + (off_t)len - 1) / cb), lo, hi);
+    for (int m = 0; m < d->nmem; m++)
+        if (lo[m] >= 0 && d->be->sync(&d->mem[m], (off_t)lo[m] * cb, (size_t)(hi[m] - lo[m] + 1) * (size_t)cb) < 0) rc = -1;
+    return rc;
+}
 
-    int lfd = mk_listen_socket(A.port);
-    if (lfd < 0) { fprintf(stderr, "Failed to listen on %s\n", A.port); return 1; }
-    fprintf(stderr, "disk_server listening on %s (cyl=%d sec=%d track_us=%d sync=%s)\n",
-            A.port, A.cyl, A.sec, A.track_us, (A.sync==SYNC_AFTER?"after":"immediate"));
+// ---- Media access ----------------------------------------------------------
+// Every sector access is bracketed by media_begin()/media_end(). With
+// track_us > 0 that is a turn on the head (elevator + seek) of every
+// spindle the access touches. With track_us == 0 there is nothing to
+// serialize: the access read- or write-locks just the stripes of the
+// cylinders it touches, so different sectors run in parallel and each
+// sector stays linearizable. Spindles, and stripes within a spindle, are
+// always taken in ascending index order.
 
-    // Accept loop
-    while (!g_stop) {
-        struct sockaddr_storage ss; socklen_t slen = sizeof(ss);
-        int cfd = accept(lfd, (struct sockaddr *)&ss, &slen);
-        if (cfd < 0) { if (errno == EINTR) continue; perror("accept"); break; }
-        int *heap_fd = malloc(sizeof(int)); if (!heap_fd) { close(cfd); continue; }
-        *heap_fd = cfd;
-        pthread_t th; pthread_create(&th, NULL, client_thread, heap_fd); pthread_detach(th);
+static int stripes_init(disk_t *d, int n) {
+    pthread_rwlockattr_t at;
+    pthread_rwlockattr_init(&at);
+    // glibc rwlocks favour readers by default; a hot sector must not starve writers
+    pthread_rwlockattr_setkind_np(&at, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    d->stripe = malloc((size_t)n * sizeof(*d->stripe));
+    if (!d->stripe) { perror("malloc"); return -1; }
+    for (int i = 0; i < n; i++) pthread_rwlock_init(&d->stripe[i], &at);
+    pthread_rwlockattr_destroy(&at);
+    d->nstripes = n;
+    d->striped = true;
+    return 0;
+}
+
+static bool stripe_hit(const disk_t *d, int i, int c, int last_c) {
+    int n = d->nstripes;
+    if (last_c - c + 1 >= n) return true;
+    int a = c % n, b = last_c % n;
+    return (a <= b) ? (i >= a && i <= b) : (i >= a || i <= b);
+}
+
+static void media_begin(disk_t *d, int c, int last_c, bool write) {
+    int lo[MAX_SPINDLES], hi[MAX_SPINDLES];
+    ph_mark(PH_MEDIA);
+    spindle_span(d, c, last_c, lo, hi);
+    for (int m = 0; m < d->nmem; m++) {
+        if (lo[m] < 0) continue;
+        disk_t *sp = &d->mem[m];
+        if (!sp->striped) { sched_acquire(sp, lo[m], write); continue; }
+        for (int i = 0; i < sp->nstripes; i++) {
+            if (!stripe_hit(sp, i, lo[m], hi[m])) continue;
+            if (write) pthread_rwlock_wrlock(&sp->stripe[i]);
+            else pthread_rwlock_rdlock(&sp->stripe[i]);
+        }
     }
+    ph_mark(PH_WAIT);
+    if (d->striped) return;
+    long us = 0;
+    for (int m = 0; m < d->nmem; m++) {
+        if (lo[m] < 0) continue;
+        long t = simulate_seek_locked(&d->mem[m], lo[m]);
+        if (hi[m] != lo[m]) t += simulate_seek_locked(&d->mem[m], hi[m]);
+        if (t > us) us = t;
+    }
+    sleep_us(us);
+    ph_mark(PH_SEEK);
+}
 
-    close(lfd);
-    msync(g_disk.base, g_disk.bytes, MS_SYNC);
-    munmap(g_disk.base, g_disk.bytes);
-    close(g_disk.fd);
+static void media_end(disk_t *d, int c, int last_c) {
+    int lo[MAX_SPINDLES], hi[MAX_SPINDLES];
+    ph_mark(PH_MEDIA);
+    spindle_span(d, c, last_c, lo, hi);
+    for (int m = 0; m < d->nmem; m++) {
+        if (lo[m] < 0) continue;
+        disk_t *sp = &d->mem[m];
+        if (!sp->striped) { sched_release(sp); continue; }
+        for (int i = 0; i < sp->nstripes; i++)
+            if (stripe_hit(sp, i, lo[m], hi[m])) pthread_rwlock_unlock(&sp->stripe[i]);
+        sp->st_ops++;
+    }
+}
+
+// ---- Snapshots (copy-on-write) ---------------------------------------------
+// N freezes a point-in-time view of the logical disk in O(1): it only bumps
+// the snapshot epoch. After that, the first write or discard to each
+// --cow-chunk sized chunk copies the chunk's old contents into a sparse side
+// file at the same offset and tags the chunk with the epoch; later writes to
+// the chunk cost one compare. SR reads tagged chunks from the side file and
+// the rest from the live image, which still holds the snapshot's data there.
+// Live reads never look at the side file. Writers hold `rw` shared across
+// check-copy-write, so N lands between writes, never inside one. The view
+// lives in memory and does not survive a restart.
+
+#define SNAP_LOCKS 64           // chunk copy locks, chunk % SNAP_LOCKS
+
+typedef struct {
+    pthread_rwlock_t rw;        // shared: disk_write/discard and SR; exclusive: N, X
+    pthread_mutex_t lock[SNAP_LOCKS];
+    uint32_t  epoch;            // current snapshot, 0 = none
+    uint32_t  gen;              // last epoch handed out
+    uint32_t *tag;              // per chunk: epoch its old data was saved for
+    uint64_t  nchunks;
+    size_t    chunk_bytes;
+    int       chunk;            // sectors per chunk
+    int       fd;               // side file, opened by the first N
+    const char *path;
+    struct timespec t_taken;
+    _Atomic uint64_t st_saved;  // chunks preserved for the current snapshot
+    _Atomic uint64_t st_copies, st_copy_ns, st_zero;
+    uint64_t  st_snaps, st_drops;
+} snap_t;
+
+static snap_t g_snap = { .fd = -1 };
+
+static int snap_init(const disk_t *d, int chunk, const char *path) {
+    pthread_rwlockattr_t at;
+    pthread_rwlockattr_init(&at);
+    // A stream of writers must not keep N waiting
+    pthread_rwlockattr_setkind_np(&at, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&g_snap.rw, &at);
+    pthread_rwlockattr_destroy(&at);
+    for (int i = 0; i < SNAP_LOCKS; i++) pthread_mutex_init(&g_snap.lock[i], NULL);
+    g_snap.chunk = chunk;
+    g_snap.chunk_bytes = (size_t)chunk * BLOCK_SIZE;
+    g_snap.nchunks = (d->bytes + g_snap.chunk_bytes - 1) / g_snap.chunk_bytes;
+    g_snap.path = path;
+    // calloc of this size is fresh zero pages: memory is only spent on chunks written under a snapshot
+    if (!(g_snap.tag = calloc(g_snap.nchunks, sizeof(uint32_t)))) { perror("calloc"); return -1; }
+    return 0;
+}
+
+// Saves the pre-snapshot contents of chunk ch. Caller holds rw shared and
+// the chunk's lock. All-zero chunks (holes, mostly) are punched instead of
+// written so the side file stays as sparse as the image.
+static int snap_copy(disk_t *d, uint64_t ch) {
+    uint64_t t0 = now_ns();
+    off_t off = (off_t)(ch * g_snap.chunk_bytes);
+    size_t len = g_snap.chunk_bytes;
+    if ((size_t)off + len > d->bytes) len = d->bytes - (size_t)off;
+    uint8_t *buf = malloc(len);
+    if (!buf) return -1;
+    int rc = disk_read(d, off, buf, len);
+    bool zero = rc == 0 && buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+    if (rc == 0 && zero)
+        rc = fallocate(g_snap.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, (off_t)len);
+    else if (rc == 0)
+        rc = pwrite(g_snap.fd, buf, len, off) == (ssize_t)len ? 0 : -1;
+    free(buf);
+    if (rc < 0) { perror("snapshot copy"); return -1; }
+    g_snap.st_copies++; g_snap.st_saved++;
+    if (zero) g_snap.st_zero++;
+    g_snap.st_copy_ns += now_ns() - t0;
+    return 0;
+}
+
+// Copy-before-write for [off, off+len). Caller holds rw shared and the media
+// for the range; the rest of a chunk may lie on cylinders it does not hold,
+// but nobody can write there before the chunk is tagged.
+static int snap_cow(disk_t *d, off_t off, size_t len) {
+    uint32_t e = g_snap.epoch;
+    if (e == 0) return 0;
+    uint64_t c0 = (uint64_t)off / g_snap.chunk_bytes, c1 = ((uint64_t)off + len - 1) / g_snap.chunk_bytes;
+    for (uint64_t ch = c0; ch <= c1; ch++) {
+        if (__atomic_load_n(&g_snap.tag[ch], __ATOMIC_ACQUIRE) == e) continue;
+        pthread_mutex_t *m = &g_snap.lock[ch % SNAP_LOCKS];
+        pthread_mutex_lock(m);
+        int rc = g_snap.tag[ch] == e ? 0 : snap_copy(d, ch);
+        if (rc == 0) __atomic_store_n(&g_snap.tag[ch], e, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(m);
+        if (rc < 0) return -1;
+    }
+    return 0;
+}
+
+// N: takes a new snapshot, replacing the current one. Returns the epoch, or 0.
+static uint32_t snap_take(const disk_t *d) {
+    pthread_rwlock_wrlock(&g_snap.rw);
+    if (g_snap.fd < 0) {
+        g_snap.fd = open(g_snap.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (g_snap.fd < 0 || ftruncate(g_snap.fd, (off_t)d->bytes) < 0) {
+            perror("snapshot file");
+            if (g_snap.fd >= 0) close(g_snap.fd);
+            g_snap.fd = -1;
+            pthread_rwlock_unlock(&g_snap.rw);
+            return 0;
+        }
+    }
+    if (++g_snap.gen == 0) g_snap.gen = 1;      // 0 means "no snapshot"
+    g_snap.epoch = g_snap.gen;
+    g_snap.st_saved = 0;
+    g_snap.st_snaps++;
+    clock_gettime(CLOCK_MONOTONIC, &g_snap.t_taken);
+    uint32_t e = g_snap.epoch;
+    pthread_rwlock_unlock(&g_snap.rw);
+    return e;
+}
+
+// X: drops the snapshot and releases the side file's blocks
+static bool snap_drop(const disk_t *d) {
+    pthread_rwlock_wrlock(&g_snap.rw);
+    bool had = g_snap.epoch != 0;
+    if (had) {
+        g_snap.epoch = 0;
+        g_snap.st_saved = 0;
+        g_snap.st_drops++;
+        if (fallocate(g_snap.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, (off_t)d->bytes) < 0)
+            perror("snapshot punch");
+    }
+    pthread_rwlock_unlock(&g_snap.rw);
+    return had;
+}
+
+// SR: reads [off, off+len) as of the snapshot. Caller holds the media for
+// the range (so untagged chunks cannot change under it) and rw shared.
+static int snap_read(disk_t *d, off_t off, uint8_t *out, size_t len) {
+    uint32_t e = g_snap.epoch;
+    if (e == 0) return -1;
+    while (len > 0) {
+        uint64_t ch = (uint64_t)off / g_snap.chunk_bytes;
+        size_t n = (size_t)((ch + 1) * g_snap.chunk_bytes - (uint64_t)off);
+        if (n > len) n = len;
+        int rc = __atomic_load_n(&g_snap.tag[ch], __ATOMIC_ACQUIRE) == e
+                 ? (pread(g_snap.fd, out, n, off) == (ssize_t)n ? 0 : -1)
+                 : disk_read(d, off, out, n);
+        if (rc < 0) return -1;
+        off += (off_t)n; out += n; len -= n;
+    }
+    return 0;
+}
+
+static void snap_dump(FILE *f) {
+    pthread_rwlock_rdlock(&g_snap.rw);
+    uint64_t copies = g_snap.st_copies;
+    if (g_snap.st_snaps == 0) { pthread_rwlock_unlock(&g_snap.rw); return; }
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC, &now);
+    if (g_snap.epoch)
+        fprintf(f, "snapshot id=%u age=%.1fs chunk=%d saved=%llu (%.1f MB)", g_snap.epoch,
+                (double)(now.tv_sec - g_snap.t_taken.tv_sec) + (double)(now.tv_nsec - g_snap.t_taken.tv_nsec) / 1e9,
+                g_snap.chunk, (unsigned long long)g_snap.st_saved,
+                (double)g_snap.st_saved * (double)g_snap.chunk_bytes / 1048576.0);
+    else
+        fprintf(f, "snapshot none chunk=%d", g_snap.chunk);
+    fprintf(f, " taken=%llu dropped=%llu cow_copies=%llu zero=%llu copy_mean=%.1fus\n",
+            (unsigned long long)g_snap.st_snaps, (unsigned long long)g_snap.st_drops, (unsigned long long)copies,
+            (unsigned long long)g_snap.st_zero, copies ? (double)g_snap.st_copy_ns / (double)copies / 1000.0 : 0.0);
+    pthread_rwlock_unlock(&g_snap.rw);
+}
+
+// ---- Track buffer cache ----------------------------------------------------
+// A read that misses brings in every track it touches with one turn on the
+// head; later reads of those cylinders are copied out of the buffer without
+// seeking. The buffer mirrors media, so fills and write-through patches both
+// happen inside media_begin()/media_end(): a fill can never resurrect data
+// that a concurrent writer has already replaced.
+
+static int tc_init(disk_t *d, int tracks) {
+    if (tracks > d->cylinders) tracks = d->cylinders;
+    d->tc_track_bytes = (size_t)d->sectors * BLOCK_SIZE;
+    d->tc_slot = malloc((size_t)d->cylinders * sizeof(int));
+    d->tc_cyl = malloc((size_t)tracks * sizeof(int));
+    d->tc_prev = malloc((size_t)tracks * sizeof(int));
+    d->tc_next = malloc((size_t)tracks * sizeof(int));
+    d->tc_data = malloc((size_t)tracks * d->tc_track_bytes);
+    if (!d->tc_slot || !d->tc_cyl || !d->tc_prev || !d->tc_next || !d->tc_data) { perror("malloc"); return -1; }
+    for (int c = 0; c < d->cylinders; c++) d->tc_slot[c] = -1;
+    d->tc_mru = d->tc_lru = -1;
+    d->tc_tracks = tracks;
+    pthread_mutex_init(&d->tc_lock, NULL);
+    return 0;
+}
+
+static void tc_unlink_locked(disk_t *d, int i) {
+    if (d->tc_prev[i] >= 0) d->tc_next[d->tc_prev[i]] = d->tc_next[i]; else d->tc_mru = d->tc_next[i];
+    if (d->tc_next[i] >= 0) d->tc_prev[d->tc_next[i]] = d->tc_prev[i]; else d->tc_lru = d->tc_prev[i];
+}
+
+static void tc_push_mru_locked(disk_t *d, int i) {
+    d->tc_prev[i] = -1; d->tc_next[i] = d->tc_mru;
+    if (d->tc_mru >= 0) d->tc_prev[d->tc_mru] = i; else d->tc_lru = i;
+    d->tc_mru = i;
+}
+
+// Copies bytes at off into out if every track they span is cached.
+static bool tc_lookup(disk_t *d, off_t off, size_t len, uint8_t *out) {
+    int c0 = (int)(off / (off_t)d->tc_track_bytes), c1 = (int)((off + (off_t)len - 1) / (off_t)d->tc_track_bytes);
+    pthread_mutex_lock(&d->tc_lock);
+    for (int c = c0; c <= c1; c++)
+        if (d->tc_slot[c] < 0) { d->st_tc_misses++; pthread_mutex_unlock(&d->tc_lock); return false; }
+    for (int c = c0; c <= c1; c++) {
+        int i = d->tc_slot[c];
+        off_t t0 = (off_t)c * (off_t)d->tc_track_bytes, lo = off > t0 ? off : t0;
+        off_t hi = off + (off_t)len < t0 + (off_t)d->tc_track_bytes ? off + (off_t)len : t0 + (off_t)d->tc_track_bytes;
+        memcpy(out + (lo - off), d->tc_data + (size_t)i * d->tc_track_bytes + (size_t)(lo - t0), (size_t)(hi - lo));
+        tc_unlink_locked(d, i); tc_push_mru_locked(d, i);
+    }
+    d->st_tc_hits++;
+    pthread_mutex_unlock(&d->tc_lock);
+    return true;
+}
+
+// Installs one track as read from media (evicting the LRU track if full).
+// Caller holds the media for cylinder c.
+static void tc_insert(disk_t *d, int c, const uint8_t *track) {
+    pthread_mutex_lock(&d->tc_lock);
+    int i = d->tc_slot[c];
+    if (i >= 0) {
+        tc_unlink_locked(d, i);
+    } else if (d->tc_used < d->tc_tracks) {
+        i = d->tc_used++;
+    } else {
+        i = d->tc_lru;
+        tc_unlink_locked(d, i);
+        d->tc_slot[d->tc_cyl[i]] = -1;
+        d->st_tc_evictions++;
+    }
+    d->tc_cyl[i] = c; d->tc_slot[c] = i;
+    memcpy(d->tc_data + (size_t)i * d->tc_track_bytes, track, d->tc_track_bytes);
+    tc_push_mru_locked(d, i);
+    pthread_mutex_unlock(&d->tc_lock);
+}
+
+// Write-through: patches cached copies of [off, off+len) (with zeros if buf
+// is NULL), or drops those tracks if the media write failed and their
+// contents are unknown.
+static void tc_patch(disk_t *d, off_t off, const uint8_t *buf, size_t len, bool ok) {
+    int c0 = (int)(off / (off_t)d->tc_track_bytes), c1 = (int)((off + (off_t)len - 1) / (off_t)d->tc_track_bytes);
+    pthread_mutex_lock(&d->tc_lock);
+    for (int c = c0; c <= c1; c++) {
+        int i = d->tc_slot[c];
+        if (i < 0) continue;
+        if (!ok) {
+            tc_unlink_locked(d, i);
+            d->tc_slot[c] = -1;
+            // Move the last used slot into the hole so slots stay dense
+            int j = --d->tc_used;
+            if (j != i) {
+                memcpy(d->tc_data + (size_t)i * d->tc_track_bytes, d->tc_data + (size_t)j * d->tc_track_bytes, d->tc_track_bytes);
+                d->tc_cyl[i] = d->tc_cyl[j]; d->tc_slot[d->tc_cyl[i]] = i;
+                int p = d->tc_prev[j], nx = d->tc_next[j];      // i takes j's place in the LRU list
+                d->tc_prev[i] = p; d->tc_next[i] = nx;
+                if (p >= 0) d->tc_next[p] = i; else d->tc_mru = i;
+                if (nx >= 0) d->tc_prev[nx] = i; else d->tc_lru = i;
+            }
+            continue;
+        }
+        off_t t0 = (off_t)c * (off_t)d->tc_track_bytes, lo = off > t0 ? off : t0;
+        off_t hi = off + (off_t)len < t0 + (off_t)d->tc_track_bytes ? off + (off_t)len : t0 + (off_t)d->tc_track_bytes;
+        uint8_t *dst = d->tc_data + (size_t)i * d->tc_track_bytes + (size_t)(lo - t0);
+        if (buf) memcpy(dst, buf + (lo - off), (size_t)(hi - lo));
+        else memset(dst, 0, (size_t)(hi - lo));
+    }
+    pthread_mutex_unlock(&d->tc_lock);
+}
+
+// Backend write that keeps the track buffer and any snapshot in step.
+// Caller holds the media.
+static int disk_write(disk_t *d, off_t off, const void *buf, size_t len) {
+    pthread_rwlock_rdlock(&g_snap.rw);
+    int rc = snap_cow(d, off, len);
+    if (rc == 0) rc = disk_io(d, DIO_WRITE, off, (void *)buf, len);
+    pthread_rwlock_unlock(&g_snap.rw);
+    if (d->tc_tracks) tc_patch(d, off, buf, len, rc == 0);
+    return rc;
+}
+
+// Deallocates [off, off+len) on media. Caller holds the media.
+static int disk_discard(disk_t *d, off_t off, size_t len) {
+    pthread_rwlock_rdlock(&g_snap.rw);
+    int rc = snap_cow(d, off, len);
+    if (rc == 0) rc = disk_io(d, DIO_DISCARD, off, NULL, len);
+    pthread_rwlock_unlock(&g_snap.rw);
+    if (d->tc_tracks) tc_patch(d, off, NULL, len, rc == 0);
+    return rc;
+}
+
+// Reads n sectors from (c, s) through the track buffer. On a miss the head
+// seeks once and reads whole tracks c..last_c. Caller does not hold the media.
+static int tc_read(disk_t *d, int c, int s, int n, uint8_t *out) {
+    off_t off = sector_offset(d, c, s);
+    size_t len = (size_t)n * BLOCK_SIZE;
+    if (tc_lookup(d, off, len, out)) return 0;
+    int last_c = (int)(((long long)c * d->sectors + s + n - 1) / d->sectors);
+    size_t span = (size_t)(last_c - c + 1) * d->tc_track_bytes;
+    uint8_t *buf = malloc(span);
+    if (!buf) return -1;
+    media_begin(d, c, last_c, false);
+    int rc = disk_read(d, (off_t)c * (off_t)d->tc_track_bytes, buf, span);
+    if (rc == 0)
+        for (int k = c; k <= last_c; k++) tc_insert(d, k, buf + (size_t)(k - c) * d->tc_track_bytes);
+    media_end(d, c, last_c);
+    if (rc == 0) memcpy(out, buf + (size_t)s * BLOCK_SIZE, len);
+    free(buf);
+    return rc;
+}
+
+static void tc_report(const disk_t *d) {
+    uint64_t n = d->st_tc_hits + d->st_tc_misses;
+    fprintf(stderr, "track cache: tracks=%d hits=%llu misses=%llu hit_rate=%.1f%% evictions=%llu\n", d->tc_tracks,
+            (unsigned long long)d->st_tc_hits, (unsigned long long)d->st_tc_misses,
+            n ? 100.0 * (double)d->st_tc_hits / (double)n : 0.0, (unsigned long long)d->st_tc_evictions);
+}
+
+// ---- Group commit ----------------------------------------------------------
+// A --sync=after writer puts its sector into the backend with the head held,
+// gives the head up, then joins the open batch here. The first writer of a
+// batch leads: it waits up to gc_window_us (or for gc_batch writers), waits
+// for the previous flush to finish, closes the batch and flushes its span
+// once. Everyone in the batch is released when that flush completes.
+// A failed flush is never forgotten: the kernel may already have dropped
+// the pages it could not write, so that batch and every later one report
+// failure, even if a later flush succeeds.
+
+static int gc_commit(disk_t *d, off_t off, size_t len) {
+    pthread_mutex_lock(&d->gc_lock);
+    uint64_t gen = d->gc_open;
+    if (d->gc_joined == 0) { d->gc_lo = off; d->gc_hi = off + (off_t)len; }
+    else {
+        if (off < d->gc_lo) d->gc_lo = off;
+        if (off + (off_t)len > d->gc_hi) d->gc_hi = off + (off_t)len;
+    }
+    d->st_gc_commits++;
+    if (++d->gc_joined >= d->gc_batch) pthread_cond_broadcast(&d->gc_cv);
+
+    if (!d->gc_leader) {
+        d->gc_leader = true;
+        if (d->gc_window_us > 0) {
+            struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+            long long ns = dl.tv_nsec + (long long)d->gc_window_us * 1000;
+            dl.tv_sec += (time_t)(ns / 1000000000LL); dl.tv_nsec = (long)(ns % 1000000000LL);
+            while (d->gc_joined < d->gc_batch)
+                if (pthread_cond_timedwait(&d->gc_cv, &d->gc_lock, &dl) == ETIMEDOUT) break;
+        }
+        // Writers keep joining while the previous batch is on its way out
+        while (d->gc_flushing) pthread_cond_wait(&d->gc_cv, &d->gc_lock);
+        off_t lo = d->gc_lo; size_t span = (size_t)(d->gc_hi - d->gc_lo);
+        d->gc_open++; d->gc_joined = 0; d->gc_leader = false; d->gc_flushing = true;
+        pthread_mutex_unlock(&d->gc_lock);
+
+        int rc = disk_sync(d, lo, span);
+
+        pthread_mutex_lock(&d->gc_lock);
+        d->gc_flushing = false;
+        d->gc_done = gen;
+        if (rc < 0) { perror("backend sync"); if (!d->gc_failed) d->gc_failed = gen; }
+        d->st_gc_flushes++;
+        pthread_cond_broadcast(&d->gc_cv);
+    }
+    while (d->gc_done < gen) pthread_cond_wait(&d->gc_cv, &d->gc_lock);
+    int rc = (d->gc_failed && gen >= d->gc_failed) ? -1 : 0;
+    pthread_mutex_unlock(&d->gc_lock);
+    return rc;
+}
+
+static void gc_report(const disk_t *d) {
+    if (d->st_gc_flushes == 0) return;
+    fprintf(stderr, "group commit: writes=%llu flushes=%llu (%.2f writes/flush)\n",
+            (unsigned long long)d->st_gc_commits, (unsigned long long)d->st_gc_flushes,
+            (double)d->st_gc_commits / (double)d->st_gc_flushes);
+}
+
+// ---- Replication log -------------------------------------------------------
+// With --replica=host:port[,...] this server is a primary: every accepted
+// W/WR/T is appended to an in-memory log inside the critical section that
+// orders it locally (the media for direct writes, wb_lock for the write-back
+// cache), so replicas apply overlapping writes in the primary's order.
+// Shipper threads stream the log; a record is freed once every replica that
+// is not stale has acked it. A replica that is still missing the oldest
+// record when the log is full (--repl-log records) is marked stale and is
+// no longer fed: it has to be reseeded from a copy of the image.
+
+#define REPL_MAX    8
+#define REPL_WINDOW 256       // records in flight per replica
+
+typedef enum { REPL_ASYNC = 0, REPL_SEMISYNC } repl_mode_t;
+typedef enum { RS_DOWN = 0, RS_UP, RS_STALE } repl_state_t;
+
+typedef struct {
+    uint64_t seq, t_ns;       // t_ns: append time, for lag
+    uint8_t  op;              // 'w' (W is shipped as a one-sector WR) or 'T'
+    uint64_t lba;
+    int      n;
+    uint8_t  data[];          // n * BLOCK_SIZE bytes for 'w'
+} repl_rec_t;
+
+typedef struct {
+    char        *host, *port;
+    repl_state_t state;
+    int          fd;
+    bool         broken;      // connection failed; the shipper reconnects
+    uint64_t     sent, acked; // highest seq written to / applied by the replica
+    pthread_t    th;
+    uint64_t     st_acks, st_ack_ns, st_ack_max_ns, st_reconnects;
+} replica_t;
+
+typedef struct {
+    int             nrep;     // 0: not a primary
+    repl_mode_t     mode;
+    int             timeout_ms;
+    replica_t       rep[REPL_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t  cv;       // appends, acks and state changes
+    repl_rec_t    **ring;     // seq s lives at ring[s % cap]
+    uint64_t        cap, first, last;   // retained seqs are [first, last]
+    bool            closed;
+    bool            fallback; // semisync timed out: async until a replica catches up
+    uint64_t        st_waits, st_wait_ns, st_timeouts, st_degraded;
+} repl_t;
+
+static repl_t g_repl;
+static bool   g_read_only;    // replica: only a primary's stream may write
+
+static const char *repl_state_name(repl_state_t s) {
+    return s == RS_UP ? "up" : s == RS_STALE ? "stale" : "down";
+}
+
+// Parses "host:port[,host:port...]". Returns 0 or -1 on a malformed list.
+static int repl_init(const char *list, repl_mode_t mode, uint64_t cap, int timeout_ms) {
+    char *dup = strdup(list), *save = NULL;
+    if (!dup) return -1;
+    for (char *t = strtok_r(dup, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        char *colon = strrchr(t, ':');
+        if (!colon || colon == t || !colon[1] || g_repl.nrep == REPL_MAX) { free(dup); return -1; }
+        *colon = '\0';
+        replica_t *r = &g_repl.rep[g_repl.nrep++];
+        r->host = strdup(t); r->port = strdup(colon + 1); r->fd = -1;
+        if (!r->host || !r->port) { free(dup); return -1; }
+    }
+    free(dup);
+    if (g_repl.nrep == 0) return -1;
+    g_repl.mode = mode; g_repl.timeout_ms = timeout_ms;
+    g_repl.cap = cap; g_repl.first = 1; g_repl.last = 0;
+    if (!(g_repl.ring = calloc(cap, sizeof(*g_repl.ring)))) return -1;
+    pthread_mutex_init(&g_repl.lock, NULL);
+    pthread_cond_init(&g_repl.cv, NULL);
+    return 0;
+}
+
+// Frees records every replica that can still catch up has acked
+static void repl_trim_locked(void) {
+    uint64_t keep = g_repl.last;
+    for (int i = 0; i < g_repl.nrep; i++)
+        if (g_repl.rep[i].state != RS_STALE && g_repl.rep[i].acked < keep) keep = g_repl.rep[i].acked;
+    while (g_repl.first <= keep) {
+        free(g_repl.ring[g_repl.first % g_repl.cap]);
+        g_repl.ring[g_repl.first++ % g_repl.cap] = NULL;
+    }
+}
+
+// Logs one accepted write ('w': n sectors of data, 'T': discard of n
+// sectors). Call with the lock that orders the local write held. Returns
+// the record's seq for repl_wait(), 0 when not replicating.
+static uint64_t repl_append(uint8_t op, uint64_t lba, int n, const uint8_t *data) {
+    if (g_repl.nrep == 0) return 0;
+    size_t bytes = (op == 'w') ? (size_t)n * BLOCK_SIZE : 0;
+    repl_rec_t *r = malloc(sizeof(*r) + bytes);
+    pthread_mutex_lock(&g_repl.lock);
+    if (!r) {
+        // A hole in the stream would silently fork the replicas: cut them off
+        for (int i = 0; i < g_repl.nrep; i++) g_repl.rep[i].state = RS_STALE;
+        fprintf(stderr, "replication: out of memory, all replicas stale\n");
+    }
+    if (g_repl.last - g_repl.first + 1 == g_repl.cap) {
+        for (int i = 0; i < g_repl.nrep; i++) {
+            replica_t *p = &g_repl.rep[i];
+            if (p->state == RS_STALE || p->acked >= g_repl.first) continue;
+            p->state = RS_STALE;
+            fprintf(stderr, "replication: %s:%s fell %llu records behind, stale\n", p->host, p->port,
+                    (unsigned long long)(g_repl.last - p->acked));
+        }
+        repl_trim_locked();
+    }
+    uint64_t seq = ++g_repl.last;
+    if (r) {
+        r->seq = seq; r->t_ns = now_ns(); r->op = op; r->lba = lba; r->n = n;
+        if (bytes) memcpy(r->data, data, bytes);
+    }
+    g_repl.ring[seq % g_repl.cap] = r;
+    if (!r) repl_trim_locked();
+    pthread_cond_broadcast(&g_repl.cv);
+    pthread_mutex_unlock(&g_repl.lock);
+    return seq;
+}
+
+// --repl=semisync: holds a write's reply until one replica has applied seq.
+// Gives up at once while no replica is connected, and after
+// --repl-timeout-ms; a timeout drops to async until some replica has
+// caught up with the whole log, so a stalled replica costs one timeout.
+static void repl_wait(uint64_t seq) {
+    if (seq == 0 || g_repl.mode != REPL_SEMISYNC) return;
+    uint64_t t0 = now_ns();
+    struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+    dl.tv_sec += g_repl.timeout_ms / 1000;
+    dl.tv_nsec += (long)(g_repl.timeout_ms % 1000) * 1000000L;
+    if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+    pthread_mutex_lock(&g_repl.lock);
+    for (;;) {
+        bool up = false, done = false;
+        for (int i = 0; i < g_repl.nrep; i++) {
+            if (g_repl.rep[i].state == RS_UP) up = true;
+            if (g_repl.rep[i].state != RS_STALE && g_repl.rep[i].acked >= seq) done = true;
+        }
+        if (done) break;
+        if (!up || g_repl.fallback) { g_repl.st_degraded++; break; }
+        if (pthread_cond_timedwait(&g_repl.cv, &g_repl.lock, &dl) == ETIMEDOUT) {
+            g_repl.st_timeouts++;
+            g_repl.fallback = true;
+            break;
+        }
+    }
+    g_repl.st_waits++;
+    g_repl.st_wait_ns += now_ns() - t0;
+    pthread_mutex_unlock(&g_repl.lock);
+}
+
+// Replication state for S and the shutdown report. Lag is how far the
+// replica's acked position trails the log, in records and in age of the
+// oldest record it has not applied yet.
+static void repl_dump(FILE *f) {
+    if (g_repl.nrep == 0) return;
+    pthread_mutex_lock(&g_repl.lock);
+    uint64_t now = now_ns();
+    fprintf(f, "replication mode=%s seq=%llu retained=%llu", g_repl.mode == REPL_SEMISYNC ? "semisync" : "async",
+            (unsigned long long)g_repl.last, (unsigned long long)(g_repl.last + 1 - g_repl.first));
+    if (g_repl.mode == REPL_SEMISYNC)
+        fprintf(f, " waits=%llu wait_mean=%.1fus timeouts=%llu degraded=%llu%s", (unsigned long long)g_repl.st_waits,
+                g_repl.st_waits ? (double)g_repl.st_wait_ns / (double)g_repl.st_waits / 1000.0 : 0.0,
+                (unsigned long long)g_repl.st_timeouts, (unsigned long long)g_repl.st_degraded,
+                g_repl.fallback ? " (async fallback)" : "");
+    fputc('\n', f);
+    for (int i = 0; i < g_repl.nrep; i++) {
+        replica_t *r = &g_repl.rep[i];
+        repl_rec_t *next = (r->state != RS_STALE && r->acked < g_repl.last) ? g_repl.ring[(r->acked + 1) % g_repl.cap] : NULL;
+        fprintf(f, "replica %d %s:%s state=%s acked=%llu lag_ops=%llu lag_ms=%.2f ack_mean_ms=%.2f ack_max_ms=%.2f reconnects=%llu\n",
+                i, r->host, r->port, repl_state_name(r->state), (unsigned long long)r->acked,
+                (unsigned long long)(g_repl.last - r->acked), next ? (double)(now - next->t_ns) / 1e6 : 0.0,
+                r->st_acks ? (double)r->st_ack_ns / (double)r->st_acks / 1e6 : 0.0,
+                (double)r->st_ack_max_ns / 1e6, (unsigned long long)r->st_reconnects);
+    }
+    pthread_mutex_unlock(&g_repl.lock);
+}
+
+// ---- Write-back cache (--sync=periodic) -------------------------------------
+// Writes are copied into a hash of dirty sectors and acked at once; the
+// flusher thread writes them back every wb_flush_ms (or as soon as wb_high
+// sectors are dirty), in cylinder order, then syncs. An entry only leaves the
+// table after media holds that exact version, so a read that misses the
+// table can go to media. Writers block while their sectors would push the
+// table past 2*wb_high (a write larger than that waits for an empty table).
+
+static wb_ent_t **wb_find_locked(disk_t *d, uint64_t lba) {
+    wb_ent_t **pp = &d->wb_tab[lba & (d->wb_nbuckets - 1)];
+    while (*pp && (*pp)->lba != lba) pp = &(*pp)->next;
+    return pp;
+}
+
+static int wb_init(disk_t *d, size_t high, int flush_ms) {
+    d->wb_high = high;
+    d->wb_flush_ms = flush_ms;
+    d->wb_nbuckets = 1;
+    while (d->wb_nbuckets < 2 * high) d->wb_nbuckets <<= 1;
+    d->wb_tab = calloc(d->wb_nbuckets, sizeof(*d->wb_tab));
+    if (!d->wb_tab) { perror("calloc"); return -1; }
+    pthread_mutex_init(&d->wb_lock, NULL);
+    pthread_cond_init(&d->wb_cv, NULL);
+    return 0;
+}
+
+// Caches n sectors starting at lba and logs them for replicas (*seq).
+// Returns 0 when cached, 1 when the cache is closed for shutdown (caller
+// writes through), -1 on allocation failure.
+static int wb_put(disk_t *d, uint64_t lba, const uint8_t *data, int n, uint64_t *seq) {
+    pthread_mutex_lock(&d->wb_lock);
+    while (!d->wb_closed && d->wb_dirty > 0 && d->wb_dirty + (size_t)n > 2 * d->wb_high) {
+        pthread_cond_broadcast(&d->wb_cv);              // kick the flusher, then wait for room
+        pthread_cond_wait(&d->wb_cv, &d->wb_lock);
+    }
+    if (d->wb_closed) { pthread_mutex_unlock(&d->wb_lock); return 1; }
+    for (int i = 0; i < n; i++) {
+        wb_ent_t **pp = wb_find_locked(d, lba + (uint64_t)i);
+        if (*pp) {
+            d->st_wb_coalesced++;                       // overwrite before write-back
+        } else {
+            wb_ent_t *e = malloc(sizeof(*e));
+            if (!e) { pthread_mutex_unlock(&d->wb_lock); return -1; }
+            e->lba = lba + (uint64_t)i; e->next = NULL;
+            *pp = e;
+            if (++d->wb_dirty > d->st_wb_peak) d->st_wb_peak = d->wb_dirty;
+        }
+        memcpy((*pp)->data, data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        (*pp)->ver = ++d->wb_ver;
+    }
+    d->st_wb_writes += (uint64_t)n;
+    *seq = repl_append('w', lba, n, data);
+    if (d->wb_dirty >= d->wb_high) pthread_cond_broadcast(&d->wb_cv);
+    pthread_mutex_unlock(&d->wb_lock);
+    return 0;
+}
+
+// Copies cached sectors of [lba, lba+n) into out and marks them in hit[].
+// Returns the number of hits. Must run before the media read it overlays.
+static int wb_get(disk_t *d, uint64_t lba, int n, uint8_t *out, bool *hit) {
+    int hits = 0;
+    pthread_mutex_lock(&d->wb_lock);
+    for (int i = 0; i < n; i++) {
+        wb_ent_t *e = *wb_find_locked(d, lba + (uint64_t)i);
+        hit[i] = (e != NULL);
+        if (e) { memcpy(out + (size_t)i * BLOCK_SIZE, e->data, BLOCK_SIZE); hits++; }
+    }
+    pthread_mutex_unlock(&d->wb_lock);
+    return hits;
+}
+
+// Forgets cached sectors in [lba, lba+n) (discard). The caller holds the
+// media for the range, so the flusher cannot be writing them meanwhile,
+// and it skips snapshot entries that are gone by the time it gets there.
+// Logged for replicas under wb_lock, in order with wb_put().
+static uint64_t wb_drop(disk_t *d, uint64_t lba, uint64_t n) {
+    pthread_mutex_lock(&d->wb_lock);
+    if (n <= d->wb_nbuckets) {
+        for (uint64_t i = 0; i < n; i++) {
+            wb_ent_t **pp = wb_find_locked(d, lba + i);
+            if (*pp) { wb_ent_t *e = *pp; *pp = e->next; free(e); d->wb_dirty--; }
+        }
+    } else {
+        for (size_t b = 0; b < d->wb_nbuckets; b++)
+            for (wb_ent_t **pp = &d->wb_tab[b]; *pp; ) {
+                if ((*pp)->lba - lba < n) { wb_ent_t *e = *pp; *pp = e->next; free(e); d->wb_dirty--; }
+                else pp = &(*pp)->next;
+            }
+    }
+    uint64_t seq = repl_append('T', lba, (int)n, NULL);
+    pthread_cond_broadcast(&d->wb_cv);                  // writers waiting for room
+    pthread_mutex_unlock(&d->wb_lock);
+    return seq;
+}
+
+static bool wb_present(disk_t *d, uint64_t lba) {
+    pthread_mutex_lock(&d->wb_lock);
+    bool hit = *wb_find_locked(d, lba) != NULL;
+    pthread_mutex_unlock(&d->wb_lock);
+    return hit;
+}
+
+static int wb_cmp_lba(const void *a, const void *b) {
+    uint64_t x = ((const wb_ent_t *)a)->lba, y = ((const wb_ent_t *)b)->lba;
+    return (x > y) - (x < y);
+}
+
+// One write-back pass over everything dirty at the time of the call.
+static void wb_flush_once(disk_t *d) {
+    struct timespec t0, t1; clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_mutex_lock(&d->wb_lock);
+    size_t k = 0, n = d->wb_dirty;
+    wb_ent_t *snap = n ? malloc(n * sizeof(*snap)) : NULL;
+    if (!snap) { pthread_mutex_unlock(&d->wb_lock); return; }
+    for (size_t b = 0; b < d->wb_nbuckets; b++)
+        for (wb_ent_t *e = d->wb_tab[b]; e; e = e->next) snap[k++] = *e;
+    pthread_mutex_unlock(&d->wb_lock);
+
+    // Ascending lba = one upward sweep; one turn on the head per cylinder
+    qsort(snap, k, sizeof(*snap), wb_cmp_lba);
+    for (size_t i = 0; i < k; ) {
+        int cyl = (int)(snap[i].lba / (uint64_t)d->sectors);
+        media_begin(d, cyl, cyl, true);
+        for (; i < k && (int)(snap[i].lba / (uint64_t)d->sectors) == cyl; i++)
+            if (wb_present(d, snap[i].lba) && disk_write(d, (off_t)(snap[i].lba * BLOCK_SIZE), snap[i].data, BLOCK_SIZE) < 0) {
+                perror("write-back"); snap[i].ver = 0;
+            }
+        media_end(d, cyl, cyl);
+    }
+    off_t lo = (off_t)(snap[0].lba * BLOCK_SIZE);
+    bool synced = disk_sync(d, lo, (size_t)((snap[k - 1].lba + 1) * BLOCK_SIZE - (uint64_t)lo)) == 0;
+    if (!synced) perror("write-back sync");
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t us = (uint64_t)(t1.tv_sec - t0.tv_sec) * 1000000u + (uint64_t)((t1.tv_nsec - t0.tv_nsec) / 1000);
+
+    // Drop entries that were not rewritten meanwhile
+    pthread_mutex_lock(&d->wb_lock);
+    for (size_t i = 0; synced && i < k; i++) {
+        wb_ent_t **pp = wb_find_locked(d, snap[i].lba);
+        if (*pp && (*pp)->ver == snap[i].ver) {
+            wb_ent_t *e = *pp; *pp = e->next; free(e);
+            d->wb_dirty--;
+            d->st_wb_flushed++;
+        }
+    }
+    d->st_wb_flushes++;
+    d->st_wb_flush_us += us;
+    if (us > d->st_wb_flush_max_us) d->st_wb_flush_max_us = us;
+    pthread_cond_broadcast(&d->wb_cv);
+    pthread_mutex_unlock(&d->wb_lock);
+    free(snap);
+}
+
+static void *wb_flusher(void *arg) {
+    disk_t *d = arg;
+    for (;;) {
+        pthread_mutex_lock(&d->wb_lock);
+        struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+        long long ns = dl.tv_nsec + (long long)d->wb_flush_ms * 1000000LL;
+        dl.tv_sec += (time_t)(ns / 1000000000LL); dl.tv_nsec = (long)(ns % 1000000000LL);
+        while (!d->wb_closed && d->wb_dirty < d->wb_high)
+            if (pthread_cond_timedwait(&d->wb_cv, &d->wb_lock, &dl) == ETIMEDOUT) break;
+        bool last = d->wb_closed;                       // no inserts once closed
+        pthread_mutex_unlock(&d->wb_lock);
+        wb_flush_once(d);
+        if (last) break;
+    }
+    return NULL;
+}
+
+// Closes the cache and waits for the flusher's final drain.
+static void wb_stop(disk_t *d) {
+    pthread_mutex_lock(&d->wb_lock);
+    d->wb_closed = true;
+    pthread_cond_broadcast(&d->wb_cv);
+    pthread_mutex_unlock(&d->wb_lock);
+    pthread_join(d->wb_thread, NULL);
+    if (d->wb_dirty) fprintf(stderr, "write-back: %zu sectors could not be written\n", d->wb_dirty);
+}
+
+static void wb_report(const disk_t *d) {
+    fprintf(stderr, "write-back: writes=%llu coalesced=%llu flushes=%llu flushed=%llu peak_dirty=%llu "
+            "dirty=%zu flush_mean=%.2f ms flush_max=%.2f ms\n",
+            (unsigned long long)d->st_wb_writes, (unsigned long long)d->st_wb_coalesced,
+            (unsigned long long)d->st_wb_flushes, (unsigned long long)d->st_wb_flushed,
+            (unsigned long long)d->st_wb_peak, d->wb_dirty,
+            d->st_wb_flushes ? (double)d->st_wb_flush_us / (double)d->st_wb_flushes / 1000.0 : 0.0,
+            (double)d->st_wb_flush_max_us / 1000.0);
+}
+
+// Global disk instance
+static disk_t g_disk;
+
+// ---- Wire protocols --------------------------------------------------------
+// Text:   I | R c s | W c s l <data> | RR c s n | WR c s n <n*128 bytes> | T c s n | S
+//         | N | X | SR c s n, single ASCII status byte replies (RR and SR
+//         append n*128 data bytes).
+//         T discards (TRIMs) n sectors: they read back as zeros.
+//         N takes a snapshot (replacing any current one), X drops it and
+//         SR reads a range as of the snapshot ('0' if there is none).
+//         P w sets this connection's weight (1..QOS_WEIGHT_MAX) for --qos.
+// Binary: client sends DISK_BIN_MAGIC as its very first byte, then fixed
+//         bin_req_t headers (network byte order) with W payload appended.
+//         Every reply is a bin_resp_t header followed by `len` data bytes.
+
+typedef struct {
+    uint8_t  op;              // 'I', 'R', 'W', 'r' (range read), 'w' (range write), 'T' (discard), 'S' (stats),
+                              // 'N' (snapshot), 'X' (drop snapshot), 'q' (snapshot range read), 'P' (weight)
+    uint8_t  flags;           // BIN_F_* (0 for ordinary clients)
+    uint16_t reserved;
+    uint32_t id;              // echoed back in the response
+    uint32_t cyl;
+    uint32_t sec;
+    uint32_t len;             // W: payload 0..128; r/w/q: n*128 bytes to move; T: n sectors; P: weight
+} __attribute__((packed)) bin_req_t;
+
+#define BIN_F_REPL 0x01       // write from a primary's replication stream (allowed on --read-only
+                              // when the connection comes from a --primary address)
+
+typedef struct {
+    uint8_t  op;              // echo of request op
+    uint8_t  status;          // 1 ok, 0 invalid
+    uint16_t reserved;
+    uint32_t id;              // echo of request id
+    uint32_t len;             // bytes of data following the header
+} __attribute__((packed)) bin_resp_t;
+
+// One parsed request, protocol independent. Range ops (op 'r'/'w'/'q') carry
+// the sector count in n; a range write's payload is heap-allocated.
+typedef struct req {
+    uint8_t  op;              // 'I', 'R', 'W', 'r', 'w', 'T', 'S', 'N', 'X', 'q', 'P' (0 = unknown, ignored)
+    uint8_t  flags;           // BIN_F_*, binary protocol only
+    uint32_t id;
+    int      c, s, l, n;
+    uint8_t *data;            // payload: inl, or malloc'd for range writes
+    uint8_t  inl[BLOCK_SIZE];
+    struct req *next;         // epoll mode ready list
+} req_t;
+
+static void req_clear(req_t *rq) {
+    rq->op = 0; rq->flags = 0; rq->id = 0; rq->c = rq->s = rq->l = rq->n = 0;
+    rq->data = rq->inl; rq->next = NULL;
+}
+
+static void req_release(req_t *rq) {
+    if (rq->data != rq->inl) free(rq->data);
+    rq->data = rq->inl;
+}
+
+// Reads a range-write payload of `bytes` into rq. Oversized or invalid
+// payloads are still drained so the stream stays framed.
+static int read_range_payload(conn_t *cn, req_t *rq, size_t bytes) {
+    if (bytes == 0) return 1;
+    if (bytes <= (size_t)RANGE_MAX_SECTORS * BLOCK_SIZE && (rq->data = malloc(bytes)) != NULL)
+        return got(conn_read_full(cn, rq->data, bytes), bytes);
+    rq->data = rq->inl; rq->n = -1;
+    while (bytes > 0) {
+        size_t chunk = bytes > BLOCK_SIZE ? BLOCK_SIZE : bytes;
+        int r = got(conn_read_full(cn, rq->inl, chunk), chunk);
+        if (r != 1) return r;
+        bytes -= chunk;
+    }
+    return 1;
+}
+
+// Reads `cnt` argument tokens into bufs of 32 bytes each
+static int read_args(conn_t *cn, char (*t)[32], int cnt) {
+    for (int i = 0; i < cnt; i++) {
+        int r = got_tok(conn_read_token(cn, t[i], sizeof(t[i])));
+        if (r != 1) return r;
+    }
+    return 1;
+}
+
+// Returns 1 on a parsed request, 0 on EOF, -1 on error/short read,
+// CONN_AGAIN if a non-blocking connection has only part of a request.
+static int parse_text(conn_t *cn, req_t *rq) {
+    char tok[64], t[3][32];
+    int r = conn_read_token(cn, tok, sizeof(tok));
+    if (r <= 0) return r;
+    req_clear(rq);
+    if (!strcmp(tok, "RR") || !strcmp(tok, "WR") || !strcmp(tok, "SR")) {
+        if ((r = read_args(cn, t, 3)) != 1) return r;
+        rq->op = (tok[0] == 'R') ? 'r' : (tok[0] == 'W') ? 'w' : 'q'; rq->c = atoi(t[0]); rq->s = atoi(t[1]); rq->n = atoi(t[2]);
+        if (rq->op == 'w' && rq->n > 0) {
+            // Like W, drain at most the capped payload size
+            int n = rq->n > RANGE_MAX_SECTORS ? RANGE_MAX_SECTORS : rq->n;
+            return read_range_payload(cn, rq, (size_t)n * BLOCK_SIZE);
+        }
+        return 1;
+    }
+    if (tok[1] != '\0') return 1;                 // unknown token, ignore
+    switch (tok[0]) {
+    case 'I':
+    case 'S':
+    case 'N':
+    case 'X':
+        rq->op = (uint8_t)tok[0];
+        return 1;
+    case 'R':
+        if ((r = read_args(cn, t, 2)) != 1) return r;
+        rq->op = 'R'; rq->c = atoi(t[0]); rq->s = atoi(t[1]);
+        return 1;
+    case 'P':
+        if ((r = read_args(cn, t, 1)) != 1) return r;
+        rq->op = 'P'; rq->n = atoi(t[0]);
+        return 1;
+    case 'T':
+        if ((r = read_args(cn, t, 3)) != 1) return r;
+        rq->op = 'T'; rq->c = atoi(t[0]); rq->s = atoi(t[1]); rq->n = atoi(t[2]);
+        return 1;
+    case 'W':
+        if ((r = read_args(cn, t, 3)) != 1) return r;
+        rq->op = 'W'; rq->c = atoi(t[0]); rq->s = atoi(t[1]); rq->l = atoi(t[2]);
+        // Read payload (if l > 0) regardless of validity to keep stream in sync
+        if (rq->l > 0) {
+            size_t want = (size_t)((rq->l > BLOCK_SIZE) ? BLOCK_SIZE : rq->l);
+            return got(conn_read_full(cn, rq->inl, want), want);
+        }
+        return 1;
+    default:
+        return 1;                                 // unknown token, ignore
+    }
+}
+
+static int parse_bin(conn_t *cn, req_t *rq) {
+    bin_req_t h;
+    ssize_t rr = conn_read_full(cn, &h, sizeof(h));
+    if (rr == 0) return 0;
+    int r = got(rr, sizeof(h));
+    if (r != 1) return r;
+    req_clear(rq);
+    rq->op = h.op; rq->id = ntohl(h.id);
+    rq->flags = cn->primary ? h.flags : 0;        // anyone else's BIN_F_REPL is ignored
+    uint32_t c = ntohl(h.cyl), s = ntohl(h.sec), l = ntohl(h.len);
+    // Out-of-range values map to -1 so valid_csl() rejects them
+    rq->c = (c > INT32_MAX) ? -1 : (int)c;
+    rq->s = (s > INT32_MAX) ? -1 : (int)s;
+    rq->l = (l > BLOCK_SIZE) ? -1 : (int)l;
+    if (h.op == 'T' || h.op == 'P') {
+        rq->l = 0; rq->n = (l > INT32_MAX) ? -1 : (int)l;
+        return 1;
+    }
+    if (h.op == 'r' || h.op == 'w' || h.op == 'q') {
+        rq->l = 0;
+        rq->n = (l % BLOCK_SIZE != 0 || l / BLOCK_SIZE > RANGE_MAX_SECTORS) ? -1 : (int)(l / BLOCK_SIZE);
+        if (h.op == 'w') {
+            r = read_range_payload(cn, rq, l);
+            if (l % BLOCK_SIZE != 0) rq->n = -1;
+            return r;
+        }
+        return 1;
+    }
+    if (h.op == 'W' && l > 0) {
+        // Always consume the full payload to stay framed
+        uint32_t left = l;
+        while (left > 0) {
+            size_t chunk = left > BLOCK_SIZE ? BLOCK_SIZE : left;
+            if ((r = got(conn_read_full(cn, rq->inl, chunk), chunk)) != 1) return r;
+            left -= (uint32_t)chunk;
+        }
+    }
+    return 1;
+}
+
+// Parses the next request off cn. On CONN_AGAIN the input position is
+// rewound so the same request is parsed again from the start later.
+static int parse_request(conn_t *cn, req_t *rq) {
+    int r = conn_sniff(cn);
+    if (r != 1) return r;
+    cn->mark = cn->rpos;
+    req_clear(rq);
+    r = (cn->proto == PROTO_BIN) ? parse_bin(cn, rq) : parse_text(cn, rq);
+    if (r == CONN_AGAIN) { req_release(rq); cn->rpos = cn->mark; }
+    return r;
+}
+
+// Sends one reply. Thread-mode sockets block until it is all written. In
+// epoll mode the part the socket will not take now is kept in cn->out; the
+// worker stops serving the connection and its event loop finishes the send
+// on EPOLLOUT, so a client that stops reading never holds a worker.
+static int conn_send(conn_t *cn, struct iovec *iov, int cnt) {
+    if (!cn->nonblock) return writev_full(cn->fd, iov, cnt) < 0 ? -1 : 0;
+    int i = 0;
+    while (cn->olen == cn->opos && i < cnt) {
+        ssize_t w = writev(cn->fd, iov + i, cnt - i);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        while (i < cnt && (size_t)w >= iov[i].iov_len) { w -= (ssize_t)iov[i].iov_len; i++; }
+        if (i < cnt) { iov[i].iov_base = (uint8_t *)iov[i].iov_base + w; iov[i].iov_len -= (size_t)w; }
+    }
+    size_t left = 0;
+    for (int k = i; k < cnt; k++) left += iov[k].iov_len;
+    if (left == 0) return 0;
+    if (cn->opos == cn->olen) cn->opos = cn->olen = 0;
+    if (cn->olen + left > cn->ocap) {
+        size_t cap = cn->ocap ? cn->ocap : CONN_BUFSZ;
+        while (cap < cn->olen + left) cap *= 2;
+        uint8_t *nb = realloc(cn->out, cap);
+        if (!nb) return -1;
+        cn->out = nb; cn->ocap = cap;
+    }
+    for (; i < cnt; i++) { memcpy(cn->out + cn->olen, iov[i].iov_base, iov[i].iov_len); cn->olen += iov[i].iov_len; }
+    return 0;
+}
+
+static int conn_write(conn_t *cn, const void *buf, size_t n) {
+    struct iovec iov = { (void *)buf, n };
+    return conn_send(cn, &iov, 1);
+}
+
+// Event loop side: pushes out what conn_send kept. 1 = all sent, 0 = the
+// socket is full again, -1 = error.
+static int conn_flush(conn_t *cn) {
+    while (cn->opos < cn->olen) {
+        ssize_t w = write(cn->fd, cn->out + cn->opos, cn->olen - cn->opos);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        cn->opos += (size_t)w;
+    }
+    cn->opos = cn->olen = 0;
+    return 1;
+}
+
+static int send_bin(conn_t *cn, const req_t *rq, int ok, const void *data, uint32_t len) {
+    bin_resp_t h = { .op = rq->op, .status = (uint8_t)(ok ? 1 : 0), .reserved = 0,
+                     .id = htonl(rq->id), .len = htonl(len) };
+    struct iovec iov[2] = { { &h, sizeof(h) }, { (void *)data, len } };
+    return conn_send(cn, iov, len ? 2 : 1);
+}
+
+// Reply helpers charge the time up to the call to media work and the
+// write itself to the send phase.
+
+// Status-only reply: '1'/'0' in text mode, empty binary frame otherwise
+static int reply_status(conn_t *cn, const req_t *rq, int ok) {
+    ph_mark(PH_MEDIA);
+    int rc;
+    if (cn->proto == PROTO_BIN) {
+        rc = send_bin(cn, rq, ok, NULL, 0);
+    } else {
+        char b = ok ? '1' : '0';
+        rc = conn_write(cn, &b, 1);
+    }
+    ph_mark(PH_SEND);
+    return rc;
+}
+
+static int reply_data(conn_t *cn, const req_t *rq, const void *data, uint32_t len) {
+    ph_mark(PH_MEDIA);
+    int rc;
+    if (cn->proto == PROTO_BIN) {
+        rc = send_bin(cn, rq, 1, data, len);
+    } else {
+        char one = '1';
+        struct iovec iov[2] = { { &one, 1 }, { (void *)data, len } };
+        rc = conn_send(cn, iov, 2);
+    }
+    ph_mark(PH_SEND);
+    return rc;
+}
+
+static int reply_geometry(conn_t *cn, const req_t *rq) {
+    ph_mark(PH_MEDIA);
+    int rc;
+    if (cn->proto == PROTO_BIN) {
+        uint32_t g[2] = { htonl((uint32_t)g_disk.cylinders), htonl((uint32_t)g_disk.sectors) };
+        rc = send_bin(cn, rq, 1, g, sizeof(g));
+    } else {
+        char b[64];
+        int n = snprintf(b, sizeof(b), "%d %d\n", g_disk.cylinders, g_disk.sectors);
+        rc = conn_write(cn, b, (size_t)n);
+    }
+    ph_mark(PH_SEND);
+    return rc;
+}
+
+// S: counters plus the merged per-op phase histograms as text. Text mode
+// prefixes the report with "STATS <len>\n"; binary mode sends it as data.
+static int reply_stats(conn_t *cn, const req_t *rq) {
+    char *buf = NULL; size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) return reply_status(cn, rq, 0);
+    tstats_t *all = calloc(1, sizeof(*all));
+    if (all) {
+        pthread_mutex_lock(&g_stats_lock);
+        stats_merge(all, &g_stats_retired);
+        for (tstats_t *t = g_stats_live; t; t = t->next) stats_merge(all, t);
+        pthread_mutex_unlock(&g_stats_lock);
+    }
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ops, cyl, us; spindle_totals(&g_disk, &ops, &cyl, &us);
+    fprintf(f, "uptime=%.1fs media_ops=%llu seek_cyl=%llu seek_us=%llu sched=%s sync=%s backend=%s\n",
+            (double)(now.tv_sec - g_disk.st_start.tv_sec) + (double)(now.tv_nsec - g_disk.st_start.tv_nsec) / 1e9,
+            (unsigned long long)ops, (unsigned long long)cyl,
+            (unsigned long long)us, g_disk.striped ? "striped" : sched_name(g_disk.policy),
+            sync_name(g_disk.sync_mode), g_disk.be->name);
+    for (int m = 0; g_disk.nmem > 1 && m < g_disk.nmem; m++)
+        fprintf(f, "spindle %d cyl=%d su=%d ops=%llu seek_cyl=%llu head=%d\n", m, g_disk.mem[m].cylinders, g_disk.su,
+                (unsigned long long)g_disk.mem[m].st_ops, (unsigned long long)g_disk.mem[m].st_seek_cyl,
+                g_disk.mem[m].current_cyl);
+    if (g_disk.sync_mode == SYNC_AFTER)
+        fprintf(f, "group_commit writes=%llu flushes=%llu\n",
+                (unsigned long long)g_disk.st_gc_commits, (unsigned long long)g_disk.st_gc_flushes);
+    if (g_disk.sync_mode == SYNC_PERIODIC) {
+        pthread_mutex_lock(&g_disk.wb_lock);
+        fprintf(f, "write_back dirty=%zu peak_dirty=%llu coalesced=%llu flushes=%llu flush_mean=%.2fms flush_max=%.2fms\n",
+                g_disk.wb_dirty, (unsigned long long)g_disk.st_wb_peak, (unsigned long long)g_disk.st_wb_coalesced,
+                (unsigned long long)g_disk.st_wb_flushes,
+                g_disk.st_wb_flushes ? (double)g_disk.st_wb_flush_us / (double)g_disk.st_wb_flushes / 1000.0 : 0.0,
+                (double)g_disk.st_wb_flush_max_us / 1000.0);
+        pthread_mutex_unlock(&g_disk.wb_lock);
+    }
+    if (g_disk.tc_tracks) {
+        pthread_mutex_lock(&g_disk.tc_lock);
+        fprintf(f, "track_cache tracks=%d cached=%d hits=%llu misses=%llu evictions=%llu\n", g_disk.tc_tracks,
+                g_disk.tc_used, (unsigned long long)g_disk.st_tc_hits, (unsigned long long)g_disk.st_tc_misses,
+                (unsigned long long)g_disk.st_tc_evictions);
+        pthread_mutex_unlock(&g_disk.tc_lock);
+    }
+    if (g_disk.mem[0].qos) {
+        uint64_t promoted = 0;
+        for (int m = 0; m < g_disk.nmem; m++) promoted += g_disk.mem[m].st_qos_promoted;
+        fprintf(f, "qos read_deadline=%.1fms write_deadline=%.1fms window=%llu%% promoted=%llu\n",
+                (double)g_disk.mem[0].qos_read_ns / 1e6, (double)g_disk.mem[0].qos_write_ns / 1e6,
+                (unsigned long long)(g_disk.mem[0].qos_window * 100 / (QOS_VT / QOS_WEIGHT_DEFAULT)),
+                (unsigned long long)promoted);
+    }
+    clients_dump(f);
+    repl_dump(f);
+    snap_dump(f);
+    if (all) stats_dump(f, all);
+    fclose(f);
+    free(all);
+
+    ph_mark(PH_MEDIA);
+    int rc;
+    if (cn->proto == PROTO_BIN) {
+        rc = send_bin(cn, rq, 1, buf, (uint32_t)len);
+    } else {
+        char hdr[32];
+        int n = snprintf(hdr, sizeof(hdr), "STATS %zu\n", len);
+        struct iovec iov[2] = { { hdr, (size_t)n }, { buf, len } };
+        rc = conn_send(cn, iov, 2);
+    }
+    ph_mark(PH_SEND);
+    free(buf);
+    return rc;
+}
+
+// ---- Replica shippers ------------------------------------------------------
+// One thread per replica: connect as a binary client, check the geometry
+// with I, then stream log records as w/T frames tagged BIN_F_REPL with
+// id = low 32 bits of seq, at most REPL_WINDOW unacked. A receiver thread
+// reads the (in-order) replies and advances acked. On any error the
+// connection is dropped and re-established every REPL_RETRY_MS, resuming
+// from acked+1; records that were sent but not acked are simply resent.
+
+#define REPL_RETRY_MS 500
+
+static int repl_connect(replica_t *r) {
+    struct addrinfo hints = {0}, *res = NULL, *it;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(r->host, r->port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (it = res; it; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, it->ai_addr, it->ai_addrlen) == 0) break;
+        close(fd); fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+    int one = 1; setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint8_t magic = DISK_BIN_MAGIC;
+    bin_req_t q = { .op = 'I' };
+    bin_resp_t h; uint32_t g[2];
+    if (write_full(fd, &magic, 1) < 0 || write_full(fd, &q, sizeof(q)) < 0 ||
+        read_full(fd, &h, sizeof(h)) != sizeof(h) || h.status != 1 || ntohl(h.len) != sizeof(g) ||
+        read_full(fd, g, sizeof(g)) != sizeof(g)) {
+        close(fd); return -1;
+    }
+    if ((int)ntohl(g[0]) != g_disk.cylinders || (int)ntohl(g[1]) != g_disk.sectors) {
+        fprintf(stderr, "replication: %s:%s has geometry %u x %u, want %d x %d\n", r->host, r->port,
+                ntohl(g[0]), ntohl(g[1]), g_disk.cylinders, g_disk.sectors);
+        close(fd); return -2;
+    }
+    return fd;
+}
+
+static void *repl_receiver(void *arg) {
+    replica_t *r = arg;
+    bin_resp_t h;
+    while (read_full(r->fd, &h, sizeof(h)) == sizeof(h)) {
+        pthread_mutex_lock(&g_repl.lock);
+        uint64_t seq = r->acked + 1;
+        bool bad = r->state != RS_UP || seq > r->sent || ntohl(h.id) != (uint32_t)seq || h.len != 0;
+        if (!bad && h.status != 1) {
+            // The replica refused a write we applied: it has diverged
+            fprintf(stderr, "replication: %s:%s rejected seq %llu, stale\n", r->host, r->port, (unsigned long long)seq);
+            r->state = RS_STALE;
+            bad = true;
+        }
+        if (!bad) {
+            uint64_t lag = now_ns() - g_repl.ring[seq % g_repl.cap]->t_ns;
+            r->acked = seq; r->st_acks++; r->st_ack_ns += lag;
+            if (lag > r->st_ack_max_ns) r->st_ack_max_ns = lag;
+            if (seq == g_repl.last) g_repl.fallback = false;
+            repl_trim_locked();
+        }
+        pthread_cond_broadcast(&g_repl.cv);
+        pthread_mutex_unlock(&g_repl.lock);
+        if (bad) break;
+    }
+    pthread_mutex_lock(&g_repl.lock);
+    r->broken = true;
+    pthread_cond_broadcast(&g_repl.cv);
+    pthread_mutex_unlock(&g_repl.lock);
+    return NULL;
+}
+
+// Sends log records until the connection breaks, the replica goes stale,
+// or shutdown finds it fully acked. Called and returns with the lock held.
+static void repl_stream_locked(replica_t *r, uint8_t *frame) {
+    while (!r->broken && r->state == RS_UP) {
+        if (g_repl.closed && r->acked == g_repl.last) return;
+        if (r->sent == g_repl.last || r->sent >= r->acked + REPL_WINDOW) {
+            pthread_cond_wait(&g_repl.cv, &g_repl.lock);
+            continue;
+        }
+        // Copy the frame out: once unlocked the record may be freed
+        repl_rec_t *rec = g_repl.ring[(r->sent + 1) % g_repl.cap];
+        size_t bytes = (rec->op == 'w') ? (size_t)rec->n * BLOCK_SIZE : 0;
+        bin_req_t *q = (bin_req_t *)frame;
+        q->op = rec->op; q->flags = BIN_F_REPL; q->reserved = 0;
+        q->id = htonl((uint32_t)rec->seq);
+        q->cyl = htonl((uint32_t)(rec->lba / (uint64_t)g_disk.sectors));
+        q->sec = htonl((uint32_t)(rec->lba % (uint64_t)g_disk.sectors));
+        q->len = htonl(rec->op == 'w' ? (uint32_t)bytes : (uint32_t)rec->n);
+        memcpy(frame + sizeof(*q), rec->data, bytes);
+        r->sent++;
+        int fd = r->fd;
+        pthread_mutex_unlock(&g_repl.lock);
+        ssize_t w = write_full(fd, frame, sizeof(*q) + bytes);
+        pthread_mutex_lock(&g_repl.lock);
+        if (w < 0) r->broken = true;
+    }
+}
+
+static void *repl_shipper(void *arg) {
+    replica_t *r = arg;
+    uint8_t *frame = malloc(sizeof(bin_req_t) + (size_t)RANGE_MAX_SECTORS * BLOCK_SIZE);
+    bool first = true;
+    pthread_mutex_lock(&g_repl.lock);
+    while (frame && !g_repl.closed && r->state != RS_STALE) {
+        if (!first) {
+            struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+            dl.tv_nsec += REPL_RETRY_MS * 1000000L;
+            if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+            pthread_cond_timedwait(&g_repl.cv, &g_repl.lock, &dl);
+            if (g_repl.closed) break;
+        }
+        pthread_mutex_unlock(&g_repl.lock);
+        int fd = repl_connect(r);
+        pthread_mutex_lock(&g_repl.lock);
+        if (fd == -2) { r->state = RS_STALE; break; }
+        if (fd < 0) { first = false; continue; }
+        if (r->state == RS_STALE || r->acked + 1 < g_repl.first) {
+            // Records it needs are gone (or it went stale while we dialled)
+            r->state = RS_STALE;
+            fprintf(stderr, "replication: %s:%s is too far behind, stale\n", r->host, r->port);
+            close(fd);
+            break;
+        }
+        if (!first) r->st_reconnects++;
+        first = false;
+        r->fd = fd; r->broken = false; r->sent = r->acked; r->state = RS_UP;
+        pthread_cond_broadcast(&g_repl.cv);
+        pthread_t rx;
+        if (pthread_create(&rx, NULL, repl_receiver, r) != 0) {
+            r->state = RS_DOWN; r->fd = -1; close(fd);
+            continue;
+        }
+        repl_stream_locked(r, frame);
+        if (r->state == RS_UP) r->state = RS_DOWN;
+        r->fd = -1;
+        pthread_cond_broadcast(&g_repl.cv);
+        pthread_mutex_unlock(&g_repl.lock);
+        shutdown(fd, SHUT_RDWR);
+        pthread_join(rx, NULL);
+        close(fd);
+        pthread_mutex_lock(&g_repl.lock);
+    }
+    pthread_mutex_unlock(&g_repl.lock);
+    free(frame);
+    return NULL;
+}
+
+static int repl_start(void) {
+    for (int i = 0; i < g_repl.nrep; i++)
+        if (pthread_create(&g_repl.rep[i].th, NULL, repl_shipper, &g_repl.rep[i]) != 0) return -1;
+    return 0;
+}
+
+// Shutdown: give connected replicas up to drain_ms to ack the tail of the
+// log, then cut the connections and join the shippers.
+static void repl_stop(int drain_ms) {
+    if (g_repl.nrep == 0) return;
+    struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+    dl.tv_sec += drain_ms / 1000;
+    dl.tv_nsec += (long)(drain_ms % 1000) * 1000000L;
+    if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+    pthread_mutex_lock(&g_repl.lock);
+    g_repl.closed = true;
+    pthread_cond_broadcast(&g_repl.cv);
+    for (;;) {
+        bool busy = false;
+        for (int i = 0; i < g_repl.nrep; i++)
+            if (g_repl.rep[i].state == RS_UP && g_repl.rep[i].acked < g_repl.last) busy = true;
+        if (!busy || pthread_cond_timedwait(&g_repl.cv, &g_repl.lock, &dl) == ETIMEDOUT) break;
+    }
+    for (int i = 0; i < g_repl.nrep; i++)
+        if (g_repl.rep[i].fd >= 0) shutdown(g_repl.rep[i].fd, SHUT_RDWR);
+    pthread_mutex_unlock(&g_repl.lock);
+    for (int i = 0; i < g_repl.nrep; i++) pthread_join(g_repl.rep[i].th, NULL);
+}
+
+// --read-only replicas take writes only from their primary's stream. parse_bin
+// keeps BIN_F_REPL only on connections from a --primary address.
+static bool write_allowed(const req_t *rq) {
+    return !g_read_only || (rq->flags & BIN_F_REPL);
+}
+
+// Executes one request against g_disk. Returns -1 if the connection is dead.
+// Writes are logged for replicas where they are ordered locally; with
+// --repl=semisync the reply then waits in repl_wait().
+static int serve_op(conn_t *cn, req_t *rq) {
+    switch (rq->op) {
+    case 'I':
+        return reply_geometry(cn, rq);
+    case 'S':
+        return reply_stats(cn, rq);
+    case 'N':
+        // Writes acked before N are part of the snapshot: push the
+        // write-back cache's dirty sectors to media first
+        if (g_disk.sync_mode == SYNC_PERIODIC) wb_flush_once(&g_disk);
+        return reply_status(cn, rq, snap_take(&g_disk) != 0);
+    case 'X':
+        return reply_status(cn, rq, snap_drop(&g_disk));
+    case 'P':
+        // This connection's share of the head under --qos
+        if (rq->n < 1 || rq->n > QOS_WEIGHT_MAX) return reply_status(cn, rq, 0);
+        cn->weight = rq->n;
+        return reply_status(cn, rq, 1);
+    case 'q': {
+        // Snapshot range read: same locking as RR, then chunk by chunk from
+        // the side file or the live image
+        if (!valid_range(&g_disk, rq->c, rq->s, rq->n)) return reply_status(cn, rq, 0);
+        int last_c = (int)(((long long)rq->c * g_disk.sectors + rq->s + rq->n - 1) / g_disk.sectors);
+        size_t bytes = (size_t)rq->n * BLOCK_SIZE;
+        int ok = (rq->data = malloc(bytes)) != NULL;
+        if (ok) {
+            media_begin(&g_disk, rq->c, last_c, false);
+            pthread_rwlock_rdlock(&g_snap.rw);      // after the media, like disk_write
+            ok = snap_read(&g_disk, sector_offset(&g_disk, rq->c, rq->s), rq->data, bytes) == 0;
+            pthread_rwlock_unlock(&g_snap.rw);
+            media_end(&g_disk, rq->c, last_c);
+        }
+        int rc = ok ? reply_data(cn, rq, rq->data, (uint32_t)bytes) : reply_status(cn, rq, 0);
+        if (!rq->data) rq->data = rq->inl;
+        return rc;
+    }
+    case 'R': {
+        if (!valid_csl(&g_disk, rq->c, rq->s, BLOCK_SIZE)) return reply_status(cn, rq, 0);
+        uint8_t blk[BLOCK_SIZE];
+        bool hit;
+        if (g_disk.sync_mode == SYNC_PERIODIC &&
+            wb_get(&g_disk, (uint64_t)rq->c * (uint64_t)g_disk.sectors + (uint64_t)rq->s, 1, blk, &hit))
+            return reply_data(cn, rq, blk, BLOCK_SIZE);
+        if (g_disk.tc_tracks)
+            return (tc_read(&g_disk, rq->c, rq->s, 1, blk) == 0) ? reply_data(cn, rq, blk, BLOCK_SIZE)
+                                                                : reply_status(cn, rq, 0);
+        // Simulate seek + read into a private buffer; the send happens after
+        // the media is released so a slow client cannot hold up the disk
+        media_begin(&g_disk, rq->c, rq->c, false);
+        off_t off = sector_offset(&g_disk, rq->c, rq->s);
+        int ok = disk_read(&g_disk, off, blk, BLOCK_SIZE) == 0;
+        media_end(&g_disk, rq->c, rq->c);
+        return ok ? reply_data(cn, rq, blk, BLOCK_SIZE) : reply_status(cn, rq, 0);
+    }
+    case 'W': {
+        if (!valid_csl(&g_disk, rq->c, rq->s, rq->l) || !write_allowed(rq)) return reply_status(cn, rq, 0);
+        // Write l bytes, zero-fill remainder
+        if (rq->l < BLOCK_SIZE) memset(rq->inl + rq->l, 0, (size_t)(BLOCK_SIZE - rq->l));
+        uint64_t lba = (uint64_t)rq->c * (uint64_t)g_disk.sectors + (uint64_t)rq->s, seq = 0;
+        if (g_disk.sync_mode == SYNC_PERIODIC) {
+            int r = wb_put(&g_disk, lba, rq->inl, 1, &seq);
+            if (r == 0) repl_wait(seq);
+            if (r <= 0) return reply_status(cn, rq, r == 0);
+            // cache closed for shutdown: write through below
+        }
+        if (g_disk.sync_mode == SYNC_IMMEDIATE && reply_status(cn, rq, 1) < 0) return -1;
+
+        media_begin(&g_disk, rq->c, rq->c, true);
+        off_t off = sector_offset(&g_disk, rq->c, rq->s);
+        int ok = disk_write(&g_disk, off, rq->inl, BLOCK_SIZE) == 0;
+        if (ok) seq = repl_append('w', lba, 1, rq->inl);
+        media_end(&g_disk, rq->c, rq->c);
+        if (g_disk.sync_mode == SYNC_IMMEDIATE) {
+            if (!ok) perror("backend write");
+            return 0;
+        }
+        // make durable before responding (flush shared with other writers)
+        ok = ok && gc_commit(&g_disk, off, BLOCK_SIZE) == 0;
+        repl_wait(seq);
+        return reply_status(cn, rq, ok);
+    }
+    case 'r': {
+        // Range read: one sweep from c to the last cylinder touched, then
+        // (media released) status + all sectors in a single gathered send
+        if (!valid_range(&g_disk, rq->c, rq->s, rq->n)) return reply_status(cn, rq, 0);
+        int last_c = (int)(((long long)rq->c * g_disk.sectors + rq->s + rq->n - 1) / g_disk.sectors);
+        uint8_t *ov = NULL;
+        bool hit[RANGE_MAX_SECTORS];
+        if (g_disk.sync_mode == SYNC_PERIODIC && (ov = malloc((size_t)rq->n * BLOCK_SIZE)) != NULL &&
+            wb_get(&g_disk, (uint64_t)rq->c * (uint64_t)g_disk.sectors + (uint64_t)rq->s, rq->n, ov, hit) == 0) {
+            free(ov); ov = NULL;
+        }
+        size_t bytes = (size_t)rq->n * BLOCK_SIZE;
+        int ok = (rq->data = malloc(bytes)) != NULL;
+        if (ok && g_disk.tc_tracks) {
+            // Track buffer: served without the head, or one fill of whole tracks
+            ok = tc_read(&g_disk, rq->c, rq->s, rq->n, rq->data) == 0;
+        } else if (ok) {
+            media_begin(&g_disk, rq->c, last_c, false);
+            ok = disk_read(&g_disk, sector_offset(&g_disk, rq->c, rq->s), rq->data, bytes) == 0;
+            media_end(&g_disk, rq->c, last_c);
+        }
+        // Cached sectors were captured before the media read; lay them on top
+        for (int i = 0; ok && ov && i < rq->n; i++)
+            if (hit[i]) memcpy(rq->data + (size_t)i * BLOCK_SIZE, ov + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        int rc = ok ? reply_data(cn, rq, rq->data, (uint32_t)bytes) : reply_status(cn, rq, 0);
+        if (!rq->data) rq->data = rq->inl;
+        free(ov);
+        return rc;
+    }
+    case 'w': {
+        if (!valid_range(&g_disk, rq->c, rq->s, rq->n) || !write_allowed(rq)) return reply_status(cn, rq, 0);
+        uint64_t lba = (uint64_t)rq->c * (uint64_t)g_disk.sectors + (uint64_t)rq->s, seq = 0;
+        if (g_disk.sync_mode == SYNC_PERIODIC) {
+            int r = wb_put(&g_disk, lba, rq->data, rq->n, &seq);
+            if (r == 0) repl_wait(seq);
+            if (r <= 0) return reply_status(cn, rq, r == 0);
+        }
+        if (g_disk.sync_mode == SYNC_IMMEDIATE && reply_status(cn, rq, 1) < 0) return -1;
+        int last_c = (int)(((long long)rq->c * g_disk.sectors + rq->s + rq->n - 1) / g_disk.sectors);
+        size_t bytes = (size_t)rq->n * BLOCK_SIZE;
+
+        media_begin(&g_disk, rq->c, last_c, true);
+        off_t off = sector_offset(&g_disk, rq->c, rq->s);
+        int ok = disk_write(&g_disk, off, rq->data, bytes) == 0;
+        if (ok) seq = repl_append('w', lba, rq->n, rq->data);
+        media_end(&g_disk, rq->c, last_c);
+        if (g_disk.sync_mode == SYNC_IMMEDIATE) {
+            if (!ok) perror("backend write");
+            return 0;
+        }
+        ok = ok && gc_commit(&g_disk, off, bytes) == 0;
+        repl_wait(seq);
+        return reply_status(cn, rq, ok);
+    }
+    case 'T': {
+        // Discard: punch the sectors out of the image (and any cache), no size cap
+        if (!valid_span(&g_disk, rq->c, rq->s, rq->n) || !write_allowed(rq)) return reply_status(cn, rq, 0);
+        if (g_disk.sync_mode == SYNC_IMMEDIATE && reply_status(cn, rq, 1) < 0) return -1;
+        uint64_t lba = (uint64_t)rq->c * (uint64_t)g_disk.sectors + (uint64_t)rq->s;
+        int last_c = (int)((lba + (uint64_t)rq->n - 1) / (uint64_t)g_disk.sectors);
+        off_t off = sector_offset(&g_disk, rq->c, rq->s);
+        size_t bytes = (size_t)rq->n * BLOCK_SIZE;
+
+        uint64_t seq = 0;
+        media_begin(&g_disk, rq->c, last_c, true);
+        if (g_disk.sync_mode == SYNC_PERIODIC) seq = wb_drop(&g_disk, lba, (uint64_t)rq->n);
+        int ok = disk_discard(&g_disk, off, bytes) == 0;
+        if (ok && g_disk.sync_mode != SYNC_PERIODIC) seq = repl_append('T', lba, rq->n, NULL);
+        media_end(&g_disk, rq->c, last_c);
+        if (g_disk.sync_mode == SYNC_IMMEDIATE) {
+            if (!ok) perror("discard");
+            return 0;
+        }
+        if (g_disk.sync_mode == SYNC_AFTER) ok = ok && gc_commit(&g_disk, off, bytes) == 0;
+        repl_wait(seq);
+        return reply_status(cn, rq, ok);
+    }
+    default:
+        // Unknown op: text mode silently skips the token; binary mode must
+        // answer so the client's id matching stays in step
+        return (cn->proto == PROTO_BIN) ? reply_status(cn, rq, 0) : 0;
+    }
+}
+
+static int serve_request(conn_t *cn, req_t *rq) {
+    uint64_t t0 = ph_start();
+    tl_conn = cn;
+    int rc = serve_op(cn, rq);
+    tl_conn = NULL;
+    ph_mark(PH_MEDIA);
+    if (rq->op) {
+        cn->st_ops++;
+        cn->st_wait_ns += tl_ph[PH_WAIT];
+        if (tl_ph[PH_WAIT] > cn->st_wait_max_ns) cn->st_wait_max_ns = tl_ph[PH_WAIT];
+    }
+    uint64_t bytes = (rq->op == 'R') ? BLOCK_SIZE : (rq->op == 'W' && rq->l > 0) ? (uint64_t)rq->l :
+                     ((rq->op == 'r' || rq->op == 'w' || rq->op == 'T' || rq->op == 'q') && rq->n > 0) ? (uint64_t)rq->n * BLOCK_SIZE : 0;
+    stats_record(op_index(rq->op), bytes, tl_mark_ns - t0);
+    return rc;
+}
+
+static void *client_thread(void *arg) {
+    conn_t *cn = arg;
+    req_t rq;
+    for (;;) {
+        int r = parse_request(cn, &rq);
+        if (r == 0) break;           // EOF
+        if (r < 0) break;            // read error or truncated request
+        int rc = serve_request(cn, &rq);
+        req_release(&rq);
+        if (rc < 0) break;
+    }
+
+    close(cn->fd);
+    conn_free(cn);
+    stats_retire();
+    return NULL;
+}
+
+// ---- epoll mode ------------------------------------------------------------
+// Event-loop threads own the (non-blocking) sockets: on readiness they parse
+// every complete request and hand the connection to the worker pool. Sockets
+// are armed EPOLLONESHOT, so a connection belongs to exactly one thread at a
+// time and its requests are served in order. The worker re-arms it when done.
+
+typedef struct {
+    int        nloops;
+    int       *epfd;          // one epoll instance per event loop
+    pthread_mutex_t lock;     // protects the work queue
+    pthread_cond_t  cv;
+    conn_t    *head, *tail;   // connections with ready requests (or eof/closing)
+} evpool_t;
+
+static evpool_t g_ev;
+
+// While a reply is stuck the connection waits for room to send it, not for
+// more input (which would only queue more replies)
+static void ev_rearm(int epfd, conn_t *cn) {
+    uint32_t want = cn->olen > cn->opos ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+    struct epoll_event ev = { .events = want | EPOLLONESHOT, .data.ptr = cn };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, cn->fd, &ev);
+}
+
+static void ev_push_work(conn_t *cn) {
+    pthread_mutex_lock(&g_ev.lock);
+    cn->next_work = NULL;
+    if (g_ev.tail) g_ev.tail->next_work = cn; else g_ev.head = cn;
+    g_ev.tail = cn;
+    pthread_cond_signal(&g_ev.cv);
+    pthread_mutex_unlock(&g_ev.lock);
+}
+
+// Parses everything the socket has; queues the requests on the connection.
+static void ev_drain_input(conn_t *cn) {
+    for (;;) {
+        req_t *rq = malloc(sizeof(*rq));
+        if (!rq) { cn->closing = true; return; }
+        int r = parse_request(cn, rq);
+        if (r != 1) {
+            free(rq);
+            if (r != CONN_AGAIN) cn->eof = true;    // serve what is queued, then close
+            return;
+        }
+        if (cn->ready_tail) cn->ready_tail->next = rq; else cn->ready_head = rq;
+        cn->ready_tail = rq;
+    }
+}
+
+static void *event_loop(void *arg) {
+    int epfd = *(int *)arg;
+    struct epoll_event evs[64];
+    while (!g_stop) {
+        int n = epoll_wait(epfd, evs, 64, 500);
+        if (n < 0) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
+        for (int i = 0; i < n; i++) {
+            conn_t *cn = evs[i].data.ptr;
+            if (cn->olen > cn->opos) {          // EPOLLOUT: finish the stuck reply first
+                int f = conn_flush(cn);
+                if (f == 0) { ev_rearm(epfd, cn); continue; }
+                if (f < 0) cn->closing = true;
+            }
+            if (!cn->eof && !cn->closing) ev_drain_input(cn);
+            if (cn->ready_head || cn->eof || cn->closing) ev_push_work(cn);
+            else ev_rearm(epfd, cn);
+        }
+    }
+    return NULL;
+}
+
+static void *worker_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&g_ev.lock);
+        while (!g_ev.head) pthread_cond_wait(&g_ev.cv, &g_ev.lock);
+        conn_t *cn = g_ev.head;
+        g_ev.head = cn->next_work;
+        if (!g_ev.head) g_ev.tail = NULL;
+        pthread_mutex_unlock(&g_ev.lock);
+
+        // In order; a reply left in cn->out pauses the rest until it is sent
+        while (cn->ready_head && !cn->closing && cn->olen == cn->opos) {
+            req_t *rq = cn->ready_head;
+            cn->ready_head = rq->next;
+            if (serve_request(cn, rq) < 0) cn->closing = true;
+            req_release(rq);
+            free(rq);
+        }
+        if (!cn->ready_head) cn->ready_tail = NULL;
+
+        int epfd = g_ev.epfd[cn->fd % g_ev.nloops];
+        if (cn->closing || (cn->eof && !cn->ready_head && cn->olen == cn->opos)) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, cn->fd, NULL);
+            close(cn->fd);
+            while (cn->ready_head) {
+                req_t *rq = cn->ready_head;
+                cn->ready_head = rq->next;
+                req_release(rq);
+                free(rq);
+            }
+            conn_free(cn);
+        } else {
+            ev_rearm(epfd, cn);
+        }
+    }
+    return NULL;
+}
+
+static int ev_start(int nloops, int nworkers) {
+    // 10k connections need more descriptors than the usual soft limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    g_ev.nloops = nloops;
+    g_ev.epfd = calloc((size_t)nloops, sizeof(int));
+    if (!g_ev.epfd) return -1;
+    pthread_mutex_init(&g_ev.lock, NULL);
+    pthread_cond_init(&g_ev.cv, NULL);
+    for (int i = 0; i < nloops; i++) {
+        g_ev.epfd[i] = epoll_create1(0);
+        if (g_ev.epfd[i] < 0) { perror("epoll_create1"); return -1; }
+        pthread_t th; pthread_create(&th, NULL, event_loop, &g_ev.epfd[i]); pthread_detach(th);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_t th; pthread_create(&th, NULL, worker_thread, NULL); pthread_detach(th);
+    }
+    return 0;
+}
+
+// Hands a freshly accepted socket to an event loop (picked by fd so the
+// worker can find the same epoll instance again).
+static int ev_add(int cfd) {
+    int fl = fcntl(cfd, F_GETFL, 0);
+    if (fl < 0 || fcntl(cfd, F_SETFL, fl | O_NONBLOCK) < 0) return -1;
+    conn_t *cn = conn_new(cfd, true);
+    if (!cn) return -1;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = cn };
+    if (epoll_ctl(g_ev.epfd[cfd % g_ev.nloops], EPOLL_CTL_ADD, cfd, &ev) < 0) { conn_free(cn); return -1; }
+    return 0;
+}
+
+typedef enum { IO_THREAD = 0, IO_EPOLL = 1 } io_mode_t;
+
+typedef struct {
+    const char *port; int cyl; int sec; int track_us; const char *file; sync_mode_t sync; sched_policy_t sched;
+    io_mode_t io; int loops; int workers; const backend_t *be; int gc_window_us; int gc_batch;
+    int flush_ms; int wb_high; int stripes; int track_cache; int su; advise_t advise;
+    const char *replicas; repl_mode_t repl; int repl_log; int repl_timeout_ms; const char *primaries;
+    const char *snap_file; int cow_chunk; bool qos; int qos_read_ms; int qos_write_ms;
+    int qos_window;
+} args_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s <port> <cylinders> <sectors_per_cyl> <track_us> <backing_file>[,<backing_file>...]\n"
+        "          [--sync=immediate|after|periodic] [--stripe-unit=N]\n"
+        "          [--sched=fifo|sstf|scan|clook] [--io=thread|epoll] [--loops=N] [--workers=N]\n"
+        "          [--backend=mmap|pread|uring] [--gc-window=US] [--gc-batch=N]\n"
+        "          [--flush-ms=N] [--wb-high=N] [--stripes=N] [--track-cache=N]\n"
+        "          [--advise=random|sequential|normal]\n"
+        "          [--replica=host:port[,...]] [--repl=async|semisync] [--repl-log=N]\n"
+        "          [--repl-timeout-ms=N] [--read-only] [--primary=host[,...]]\n"
+        "          [--snap-file=PATH] [--cow-chunk=N]\n"
+        "          [--qos] [--qos-read-ms=N] [--qos-write-ms=N] [--qos-window=PCT]\n",
+        prog);
+}
+
+// Main function
+int main(int argc, char **argv) {
+    if (argc < 6) { usage(argv[0]); return 1; }
+    args_t A = {0};
+    A.port = argv[1]; A.cyl = atoi(argv[2]); A.sec = atoi(argv[3]); A.track_us = atoi(argv[4]); A.file = argv[5]; A.sync = SYNC_AFTER;
+    A.sched = IOSCHED_FIFO; A.io = IO_THREAD; A.loops = 1; A.workers = 4; A.be = &g_backends[0];
+    A.gc_window_us = 0; A.gc_batch = 64; A.flush_ms = 100; A.wb_high = 1024; A.stripes = 64; A.su = 1;
+    A.repl = REPL_ASYNC; A.repl_log = 65536; A.repl_timeout_ms = 1000; A.cow_chunk = 32;
+    A.qos_read_ms = 50; A.qos_write_ms = 500; A.qos_window = 25;
+    for (int i = 6; i < argc; i++) {
+        if (strcmp(argv[i], "--sync=immediate") == 0) A.sync = SYNC_IMMEDIATE;
+        else if (strcmp(argv[i], "--sync=after") == 0) A.sync = SYNC_AFTER;
+        else if (strcmp(argv[i], "--sync=periodic") == 0) A.sync = SYNC_PERIODIC;
+        else if (strncmp(argv[i], "--flush-ms=", 11) == 0) A.flush_ms = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--wb-high=", 10) == 0) A.wb_high = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--stripes=", 10) == 0) A.stripes = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--track-cache=", 14) == 0) A.track_cache = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--stripe-unit=", 14) == 0) A.su = atoi(argv[i] + 14);
+        else if (strcmp(argv[i], "--advise=random") == 0) A.advise = ADV_RANDOM;
+        else if (strcmp(argv[i], "--advise=sequential") == 0) A.advise = ADV_SEQUENTIAL;
+        else if (strcmp(argv[i], "--advise=normal") == 0) A.advise = ADV_NORMAL;
+        else if (strncmp(argv[i], "--replica=", 10) == 0) A.replicas = argv[i] + 10;
+        else if (strcmp(argv[i], "--repl=async") == 0) A.repl = REPL_ASYNC;
+        else if (strcmp(argv[i], "--repl=semisync") == 0) A.repl = REPL_SEMISYNC;
+        else if (strncmp(argv[i], "--repl-log=", 11) == 0) A.repl_log = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--repl-timeout-ms=", 18) == 0) A.repl_timeout_ms = atoi(argv[i] + 18);
+        else if (strcmp(argv[i], "--read-only") == 0) g_read_only = true;
+        else if (strncmp(argv[i], "--primary=", 10) == 0) A.primaries = argv[i] + 10;
+        else if (strncmp(argv[i], "--snap-file=", 12) == 0) A.snap_file = argv[i] + 12;
+        else if (strncmp(argv[i], "--cow-chunk=", 12) == 0) A.cow_chunk = atoi(argv[i] + 12);
+        else if (strcmp(argv[i], "--qos") == 0) A.qos = true;
+        else if (strncmp(argv[i], "--qos-read-ms=", 14) == 0) A.qos_read_ms = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--qos-write-ms=", 15) == 0) A.qos_write_ms = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--qos-window=", 13) == 0) A.qos_window = atoi(argv[i] + 13);
+        else if (strcmp(argv[i], "--sched=fifo") == 0) A.sched = IOSCHED_FIFO;
+        else if (strcmp(argv[i], "--sched=sstf") == 0) A.sched = IOSCHED_SSTF;
+        else if (strcmp(argv[i], "--sched=scan") == 0) A.sched = IOSCHED_SCAN;
+        else if (strcmp(argv[i], "--sched=clook") == 0) A.sched = IOSCHED_CLOOK;
+        else if (strcmp(argv[i], "--io=thread") == 0) A.io = IO_THREAD;
+        else if (strcmp(argv[i], "--io=epoll") == 0) A.io = IO_EPOLL;
+        else if (strncmp(argv[i], "--loops=", 8) == 0) A.loops = atoi(argv[i] + 8);
+        else if (strncmp(argv[i], "--workers=", 10) == 0) A.workers = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--gc-window=", 12) == 0) A.gc_window_us = atoi(argv[i] + 12);
+        else if (strncmp(argv[i], "--gc-batch=", 11) == 0) A.gc_batch = atoi(argv[i] + 11);
+        else if (strncmp(argv[i], "--backend=", 10) == 0) { if (!(A.be = backend_find(argv[i] + 10))) { usage(argv[0]); return 1; } }
+        else { usage(argv[0]); return 1; }
+    }
+    if (A.cyl <= 0 || A.sec <= 0 || A.track_us < 0 || A.loops <= 0 || A.workers <= 0 ||
+        A.gc_window_us < 0 || A.gc_batch <= 0 || A.flush_ms <= 0 || A.wb_high <= 0 ||
+        A.stripes <= 0 || A.track_cache < 0 || A.su <= 0 || A.repl_log <= 0 || A.repl_timeout_ms <= 0 ||
+        A.cow_chunk <= 0 || A.cow_chunk > RANGE_MAX_SECTORS || A.qos_read_ms <= 0 || A.qos_write_ms <= 0 ||
+        A.qos_window < 0) {
+        usage(argv[0]); return 1;
+    }
+    if (A.replicas && A.repl == REPL_SEMISYNC && A.sync == SYNC_IMMEDIATE) {
+        fprintf(stderr, "--repl=semisync needs --sync=after or periodic (immediate replies before the write)\n"); return 1;
+    }
+    if ((uint64_t)A.cyl * (uint64_t)A.sec > (uint64_t)INT64_MAX / BLOCK_SIZE) {
+        fprintf(stderr, "geometry too large for a 64-bit offset\n"); return 1;
+    }
+
+    // One spindle per comma-separated backing file
+    char *paths[MAX_SPINDLES]; int nmem = 0;
+    char *flist = strdup(A.file), *save = NULL;
+    if (!flist) { perror("strdup"); return 1; }
+    for (char *t = strtok_r(flist, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+        if (nmem == MAX_SPINDLES) { fprintf(stderr, "at most %d backing files\n", MAX_SPINDLES); return 1; }
+        paths[nmem++] = t;
+    }
+    if (nmem == 0 || (long long)A.su * nmem > A.cyl) {
+        fprintf(stderr, "need 1..%d backing files and cylinders >= stripe unit * files\n", MAX_SPINDLES); return 1;
+    }
+
+    // No SA_RESTART: accept() must return EINTR so the loop sees g_stop
+    struct sigaction sa; memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint; sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initializing disk (the logical device seen by clients)
+    size_t total = (size_t)A.cyl * (size_t)A.sec * (size_t)BLOCK_SIZE;
+    g_disk.be = A.be;
+    g_disk.bytes = total;
+    g_disk.fd = -1;
+    g_disk.cylinders = A.cyl;
+    g_disk.sectors = A.sec;
+    g_disk.track_us = A.track_us;
+    g_disk.sync_mode = A.sync;
+    g_disk.policy = A.sched;
+    g_disk.nmem = nmem;
+    g_disk.su = A.su;
+    g_disk.striped = (A.track_us == 0);
+    g_disk.nstripes = A.stripes;
+    g_disk.mem = calloc((size_t)nmem, sizeof(disk_t));
+    if (!g_disk.mem) { perror("calloc"); return 1; }
+    // Spindle sizes: stripe units dealt round-robin, the last one may be short
+    int units = (A.cyl + A.su - 1) / A.su, last = (units - 1) % nmem;
+    for (int m = 0; m < nmem; m++) {
+        int got = units / nmem + (m < units % nmem);
+        g_disk.mem[m].cylinders = got * A.su - (m == last ? units * A.su - A.cyl : 0);
+    }
+
+    // Prepare backing files, one spindle each
+    for (int m = 0; m < nmem; m++) {
+        disk_t *sp = &g_disk.mem[m];
+        sp->path = paths[m];
+        sp->fd = open(sp->path, O_RDWR | O_CREAT, 0644);
+        if (sp->fd < 0) { perror("open backing file"); return 1; }
+        sp->bytes = (size_t)sp->cylinders * (size_t)A.sec * (size_t)BLOCK_SIZE;
+        if (ftruncate(sp->fd, (off_t)sp->bytes) < 0) { perror("ftruncate"); return 1; }
+        sp->be = A.be;
+        sp->sectors = A.sec;
+        sp->track_us = A.track_us;
+        sp->current_cyl = 0;
+        sp->sync_mode = A.sync;
+        sp->policy = A.sched;
+        sp->dir = 1;
+        sp->index = m;
+        sp->qos = A.qos && A.track_us > 0;
+        sp->qos_read_ns = (uint64_t)A.qos_read_ms * 1000000u;
+        sp->qos_write_ns = (uint64_t)A.qos_write_ms * 1000000u;
+        sp->qos_window = (uint64_t)A.qos_window * (QOS_VT / QOS_WEIGHT_DEFAULT) / 100;
+        pthread_mutex_init(&sp->lock, NULL);
+        if (A.track_us == 0 && stripes_init(sp, A.stripes) < 0) return 1;
+        if (sp->be->open(sp) < 0) return 1;
+        disk_advise(sp, A.advise);
+    }
+    if (A.track_cache > 0 && tc_init(&g_disk, A.track_cache) < 0) return 1;
+    char *snap_path = NULL;
+    if (!A.snap_file && (snap_path = malloc(strlen(paths[0]) + 6)) != NULL) sprintf(snap_path, "%s.snap", paths[0]);
+    if (snap_init(&g_disk, A.cow_chunk, A.snap_file ? A.snap_file : snap_path) < 0 || !g_snap.path) return 1;
+    pthread_mutex_init(&g_disk.gc_lock, NULL);
+    pthread_cond_init(&g_disk.gc_cv, NULL);
+    g_disk.gc_window_us = A.gc_window_us;
+    g_disk.gc_batch = A.gc_batch;
+    g_disk.gc_open = 1;
+    clock_gettime(CLOCK_MONOTONIC, &g_disk.st_start);
+    if (A.sync == SYNC_PERIODIC) {
+        if (wb_init(&g_disk, (size_t)A.wb_high, A.flush_ms) < 0) return 1;
+        if (pthread_create(&g_disk.wb_thread, NULL, wb_flusher, &g_disk) != 0) { perror("pthread_create"); return 1; }
+    }
+
+    if (A.replicas) {
+        if (repl_init(A.replicas, A.repl, (uint64_t)A.repl_log, A.repl_timeout_ms) < 0) {
+            fprintf(stderr, "bad --replica list (host:port[,host:port...], at most %d)\n", REPL_MAX); return 1;
+        }
+        if (repl_start() < 0) { perror("pthread_create"); return 1; }
+    }
+    if (A.primaries && primary_init(A.primaries) < 0) { fprintf(stderr, "bad --primary list (host[,host...])\n"); return 1; }
+    if (g_read_only && g_nprimaries == 0)
+        fprintf(stderr, "warning: --read-only without --primary: every write will be refused\n");
+
+    int lfd = mk_listen_socket(A.port);
+    if (lfd < 0) { fprintf(stderr, "Failed to listen on %s\n", A.port); return 1; }
+    if (A.io == IO_EPOLL && ev_start(A.loops, A.workers) < 0) return 1;
+    fprintf(stderr, "disk_server listening on %s (cyl=%d sec=%d track_us=%d sync=%s sched=%s io=%s backend=%s track_cache=%d "
+            "spindles=%d stripe_unit=%d replicas=%d%s%s)\n",
+            A.port, A.cyl, A.sec, A.track_us, sync_name(A.sync), (g_disk.striped ? "striped" : sched_name(A.sched)),
+            (A.io==IO_EPOLL?"epoll":"thread"), A.be->name, g_disk.tc_tracks, nmem, A.su,
+            g_repl.nrep, g_read_only ? " read-only" : "", g_disk.mem[0].qos ? " qos" : "");
+
+    // Accept loop
+    while (!g_stop) {
+        struct sockaddr_storage ss; socklen_t slen = sizeof(ss);
+        int cfd = accept(lfd, (struct sockaddr *)&ss, &slen);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                // Out of descriptors: back off instead of killing the server
+                struct timespec ts = { 0, 10 * 1000 * 1000 };
+                perror("accept"); nanosleep(&ts, NULL); continue;
+            }
+            perror("accept"); break;
+        }
+        // Pipelined clients (and disk_proxy's pooled connections) get many
+        // small replies back to back; Nagle would hold each behind an ACK
+        int one = 1; setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (A.io == IO_EPOLL) {
+            if (ev_add(cfd) < 0) close(cfd);
+            continue;
+        }
+        conn_t *cn = conn_new(cfd, false); if (!cn) { close(cfd); continue; }
+        pthread_t th;
+        if (pthread_create(&th, NULL, client_thread, cn) != 0) { close(cfd); conn_free(cn); continue; }
+        pthread_detach(th);
+    }
+
+    close(lfd);
+    if (A.sync == SYNC_PERIODIC) wb_stop(&g_disk);     // drain before the image is closed
+    repl_stop(2000);
+    sched_report(&g_disk);
+    gc_report(&g_disk);
+    if (A.sync == SYNC_PERIODIC) wb_report(&g_disk);
+    if (g_disk.tc_tracks) tc_report(&g_disk);
+    repl_dump(stderr);
+    snap_dump(stderr);
+    for (int m = 0; m < nmem; m++) {
+        g_disk.be->close(&g_disk.mem[m]);
+        close(g_disk.mem[m].fd);
+    }
+    if (g_snap.fd >= 0) close(g_snap.fd);
+    free(snap_path);
+    free(flist);
     return 0;
 }
@@ -1,15 +1,34 @@
 // Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
-// Description: Same as command client, but randomizd. Queries geometry, then performs N random
-//              reads/writes over valid (c,s). Writes are full 128-byte random blocks.
-//              Prints progress as 'R'/'W' (or '!' on error).
-// Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic disk_client_rand.c -o disk_client_rand
-// Run:           ./random_client <host> <port> <N_ops> <seed>
+// Description: Load generator for disk_server. Queries geometry, then drives random reads/writes
+//              over valid (c,s) from several threads and connections. Writes are full 128-byte
+//              random blocks. Prints throughput and latency percentiles at the end.
+// Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread random_client.c -o random_client -lm
+// Run:           ./random_client <host> <port> <N_ops> <seed> [--bin] [--threads=T] [--conns=C]
+//                               [--qd=K] [--reads=PCT] [--dist=uniform|seq|zipf|cyl] [--zipf=THETA] [--cyl=K]
+//                               [--rate=OPS] [--warmup=SEC] [--duration=SEC] [--csv=FILE]
+//                               [--read-from=host:port[,...]]
 // Example: ./random_client  127.0.0.1 9090 10000 42
+//          ./random_client  127.0.0.1 9090 0 42 --bin --threads=4 --conns=64 --duration=10 --warmup=2
+//          --bin speaks the binary framed protocol (see disk_server.c) instead of text.
+//          N_ops is the total op budget across all connections (ignored with --duration).
+//          Without --rate each connection is a closed loop (next op as soon as the last returns);
+//          --rate=OPS issues on a fixed schedule and measures latency from the intended start.
+//          --qd=K keeps up to K requests in flight per connection (replies come back in order).
+//          --read-from deals connections round-robin over the primary and these replicas; replica
+//          connections only read, primary ones take all the writes (the overall mix stays --reads).
 
 // Libraries used
+#define _GNU_SOURCE             // ppoll
 #include <arpa/inet.h>
 #include <errno.h>
+#include <math.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -21,8 +40,23 @@
 #include <unistd.h>
 
 // Constants defined
-#define _POSIX_C_SOURCE 200809L
 #define BLOCK_SIZE 128
+#define DISK_BIN_MAGIC 0xB1
+#define LAT_SUB_BITS 5                                  // 32 sub-buckets per power of two (~3%)
+#define LAT_NBUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+// Binary protocol frames; must match disk_server.c
+typedef struct {
+    uint8_t  op, flags; uint16_t reserved;
+    uint32_t id, cyl, sec, len;
+} __attribute__((packed)) bin_req_t;
+
+typedef struct {
+    uint8_t  op, status; uint16_t reserved;
+    uint32_t id, len;
+} __attribute__((packed)) bin_resp_t;
+
+typedef enum { DIST_UNIFORM = 0, DIST_SEQ, DIST_ZIPF, DIST_CYL } dist_t;
 
 static ssize_t read_full(int fd, void *buf, size_t n) {
     uint8_t *p = buf; size_t left = n;
@@ -49,50 +83,431 @@ static int connect_to(const char *host, const char *port) {
     return fd;
 }
 
-static void fill_rand(uint8_t *p, size_t n, unsigned *seed) {
-    for (size_t i=0;i<n;i++) p[i] = (uint8_t)(rand_r(seed) & 0xFF);
+// Sends one binary request (plus optional payload) and reads the reply header;
+// up to `cap` reply bytes land in `out`. Returns status (0/1) or -1 on I/O error.
+static int bin_call(int fd, uint8_t op, uint32_t id, int c, int s, const uint8_t *data, uint32_t len,
+                    uint8_t *out, uint32_t cap) {
+    uint8_t frame[sizeof(bin_req_t) + BLOCK_SIZE];
+    bin_req_t h = { .op = op, .id = htonl(id), .cyl = htonl((uint32_t)c), .sec = htonl((uint32_t)s), .len = htonl(len) };
+    memcpy(frame, &h, sizeof(h));
+    if (len > 0) memcpy(frame + sizeof(h), data, len);
+    if (write_full(fd, frame, sizeof(h) + len) < 0) return -1;
+    bin_resp_t rh;
+    if (read_full(fd, &rh, sizeof(rh)) != (ssize_t)sizeof(rh)) return -1;
+    uint32_t rlen = ntohl(rh.len);
+    if (ntohl(rh.id) != id || rlen > cap) return -1;
+    if (rlen > 0 && read_full(fd, out, rlen) != (ssize_t)rlen) return -1;
+    return rh.status;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*: per-thread, far cheaper than rand_r() per byte
+static uint64_t rng_next(uint64_t *s) {
+    uint64_t x = *s; x ^= x >> 12; x ^= x << 25; x ^= x >> 27; *s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+static double rng_unit(uint64_t *s) { return (double)(rng_next(s) >> 11) * (1.0 / 9007199254740992.0); }
+
+static void fill_rand(uint8_t *p, size_t n, uint64_t *seed) {
+    for (size_t i = 0; i < n; i += 8) { uint64_t v = rng_next(seed); memcpy(p + i, &v, n - i < 8 ? n - i : 8); }
+}
+
+// ---- Latency histogram -----------------------------------------------------
+// Log-linear buckets over nanoseconds: exact below 32 ns, then 32 buckets per
+// power of two. Each thread fills its own; main merges them at the end.
+
+static int lat_index(uint64_t v) {
+    if (v < (1u << LAT_SUB_BITS)) return (int)v;
+    int m = 63 - __builtin_clzll(v);
+    return ((m - LAT_SUB_BITS + 1) << LAT_SUB_BITS) | (int)((v >> (m - LAT_SUB_BITS)) & ((1u << LAT_SUB_BITS) - 1));
+}
+
+static double lat_value_us(int i) {                     // bucket midpoint
+    if (i < (1 << LAT_SUB_BITS)) return (double)i / 1000.0;
+    int g = i >> LAT_SUB_BITS;
+    uint64_t mant = (uint64_t)((i & ((1 << LAT_SUB_BITS) - 1)) | (1 << LAT_SUB_BITS));
+    double lo = (double)(mant << (g - 1)), width = (double)(1ull << (g - 1));
+    return (lo + width / 2.0) / 1000.0;
+}
+
+static double lat_pct_us(const uint64_t *h, uint64_t n, double p) {
+    uint64_t want = (uint64_t)ceil(p * (double)n), acc = 0;
+    if (want == 0) want = 1;
+    for (int i = 0; i < LAT_NBUCKETS; i++) if ((acc += h[i]) >= want) return lat_value_us(i);
+    return 0.0;
+}
+
+// ---- Workload --------------------------------------------------------------
+
+#define MAX_ENDPOINTS 9                                 // primary + replicas
+
+typedef struct { const char *host, *port; } endpoint_t;
+
+typedef struct {
+    const char *host, *port; bool bin; long n_ops; unsigned seed;
+    endpoint_t ep[MAX_ENDPOINTS]; int nep;              // ep[0] is the primary
+    int threads, conns, qd, read_pct, cyl_k; dist_t dist; double theta;
+    double rate, warmup_s, duration_s; const char *csv;
+    int CYL, SEC; uint64_t nsect;
+    double z_zetan, z_eta, z_alpha, z_half;             // zipf constants (Gray et al.)
+} cfg_t;
+
+static cfg_t g_cfg;
+static atomic_bool g_recording;                         // inside the measured window
+static atomic_bool g_stop;                              // stop issuing new ops
+static atomic_long g_tickets;                           // remaining op budget (N_ops mode)
+
+// One request on the wire. The server answers a connection's requests in
+// order, so replies are matched against the oldest entry of the ring.
+typedef struct {
+    uint8_t  op;                                        // 'R' or 'W'
+    uint32_t id;
+    uint64_t t_start;                                   // send time (closed) or due time (open loop)
+} inflight_t;
+
+typedef struct {
+    int      fd;
+    int      head, inflight;                            // ring of --qd outstanding ops
+    inflight_t *q;
+    uint32_t id;
+    uint64_t seq;                                       // DIST_SEQ cursor
+    int      ep;                                        // endpoint index, 0 = primary
+    int      wr_bp;                                     // write share in basis points
+} lconn_t;
+
+typedef struct {
+    int idx; pthread_t th;
+    lconn_t *conns; int nconns;
+    uint64_t rng;
+    uint64_t ops, reads, writes, errors, t_last, replica_reads;
+    uint64_t *hist;
+    bool failed;
+} worker_t;
+
+static void zipf_init(cfg_t *c) {
+    double n = (double)c->nsect, zeta2 = 1.0 + pow(0.5, c->theta), zetan = 0.0;
+    for (uint64_t i = 1; i <= c->nsect; i++) zetan += 1.0 / pow((double)i, c->theta);
+    c->z_zetan = zetan;
+    c->z_alpha = 1.0 / (1.0 - c->theta);
+    c->z_eta = (1.0 - pow(2.0 / n, 1.0 - c->theta)) / (1.0 - zeta2 / zetan);
+    c->z_half = pow(0.5, c->theta);
+}
+
+// Rank 0 is the hottest sector; hot sectors are the low-numbered ones
+static uint64_t zipf_next(const cfg_t *c, uint64_t *rng) {
+    double u = rng_unit(rng), uz = u * c->z_zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + c->z_half) return 1;
+    uint64_t r = (uint64_t)((double)c->nsect * pow(c->z_eta * u - c->z_eta + 1.0, c->z_alpha));
+    return r < c->nsect ? r : c->nsect - 1;
+}
+
+static void pick_target(worker_t *w, lconn_t *cn, int *c, int *s) {
+    const cfg_t *g = &g_cfg;
+    uint64_t lba;
+    switch (g->dist) {
+    case DIST_SEQ:  lba = cn->seq++ % g->nsect; break;
+    case DIST_ZIPF: lba = zipf_next(g, &w->rng); break;
+    case DIST_CYL:  lba = (uint64_t)g->cyl_k * (uint64_t)g->SEC + rng_next(&w->rng) % (uint64_t)g->SEC; break;
+    default:        lba = rng_next(&w->rng) % g->nsect; break;
+    }
+    *c = (int)(lba / (uint64_t)g->SEC);
+    *s = (int)(lba % (uint64_t)g->SEC);
+}
+
+static bool take_ticket(void) {
+    if (g_cfg.duration_s > 0 || !atomic_load(&g_recording)) return true;
+    return atomic_fetch_sub(&g_tickets, 1) > 0;
+}
+
+static int send_op(worker_t *w, lconn_t *cn, uint64_t t_start) {
+    int c, s; pick_target(w, cn, &c, &s);
+    bool wr = (int)(rng_next(&w->rng) % 10000) < cn->wr_bp;
+    uint8_t frame[sizeof(bin_req_t) + 64 + BLOCK_SIZE]; size_t n;
+    cn->id++;
+    if (g_cfg.bin) {
+        bin_req_t h = { .op = wr ? 'W' : 'R', .id = htonl(cn->id), .cyl = htonl((uint32_t)c),
+                        .sec = htonl((uint32_t)s), .len = htonl(wr ? BLOCK_SIZE : 0) };
+        memcpy(frame, &h, sizeof(h)); n = sizeof(h);
+    } else {
+        n = (size_t)snprintf((char *)frame, 64, wr ? "W %d %d %d " : "R %d %d ", c, s, BLOCK_SIZE);
+    }
+    if (wr) { fill_rand(frame + n, BLOCK_SIZE, &w->rng); n += BLOCK_SIZE; }
+    if (write_full(cn->fd, frame, n) < 0) return -1;
+    inflight_t *f = &cn->q[(cn->head + cn->inflight++) % g_cfg.qd];
+    f->op = wr ? 'W' : 'R'; f->id = cn->id; f->t_start = t_start;
+    return 0;
+}
+
+// Reads the reply for cn's oldest outstanding op into *done.
+// Returns 1 ok, 0 server said no, -1 dead.
+static int recv_op(lconn_t *cn, inflight_t *done) {
+    uint8_t blk[BLOCK_SIZE];
+    *done = cn->q[cn->head];
+    cn->head = (cn->head + 1) % g_cfg.qd; cn->inflight--;
+    if (g_cfg.bin) {
+        bin_resp_t rh;
+        if (read_full(cn->fd, &rh, sizeof(rh)) != (ssize_t)sizeof(rh)) return -1;
+        uint32_t rlen = ntohl(rh.len);
+        if (ntohl(rh.id) != done->id || rlen > BLOCK_SIZE) return -1;
+        if (rlen > 0 && read_full(cn->fd, blk, rlen) != (ssize_t)rlen) return -1;
+        return rh.status == 1;
+    }
+    char status; if (read_full(cn->fd, &status, 1) != 1) return -1;
+    if (status != '1') return 0;
+    if (done->op == 'R' && read_full(cn->fd, blk, BLOCK_SIZE) != BLOCK_SIZE) return -1;
+    return 1;
+}
+
+static bool reply_waiting(int fd) {
+    uint8_t b;
+    return recv(fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) == 1;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct pollfd *pfd = calloc((size_t)w->nconns, sizeof(*pfd));
+    int *pidx = calloc((size_t)w->nconns, sizeof(*pidx));
+    if (!pfd || !pidx) { w->failed = true; free(pfd); free(pidx); return NULL; }
+    // Open loop: this thread's share of --rate, on a fixed schedule
+    uint64_t interval = g_cfg.rate > 0 ? (uint64_t)(1e9 * g_cfg.threads / g_cfg.rate) : 0;
+    uint64_t next_due = now_ns();
+    bool done = false;
+
+    for (;;) {
+        int outstanding = 0, idle = 0;
+        for (int i = 0; i < w->nconns; i++) {
+            lconn_t *cn = &w->conns[i];
+            while (cn->inflight < g_cfg.qd && !done) {
+                if (atomic_load(&g_stop)) done = true;
+                else if (interval == 0) {
+                    if (!take_ticket()) done = true;
+                    else if (send_op(w, cn, now_ns()) < 0) { w->failed = true; done = true; }
+                } else if (now_ns() >= next_due) {
+                    // Late sends keep their due time so queueing shows up in latency
+                    if (!take_ticket()) done = true;
+                    else if (send_op(w, cn, next_due) < 0) { w->failed = true; done = true; }
+                    next_due += interval;
+                } else {
+                    break;
+                }
+            }
+            outstanding += cn->inflight;
+            if (cn->inflight < g_cfg.qd) idle++;
+        }
+        if (done && outstanding == 0) break;
+
+        int np = 0;
+        for (int i = 0; i < w->nconns; i++)
+            if (w->conns[i].inflight) { pfd[np].fd = w->conns[i].fd; pfd[np].events = POLLIN; pidx[np++] = i; }
+        // Sleep until the next due time, unless every connection is full:
+        // then only a reply can make progress, so block for one
+        struct timespec to = { 0, 100 * 1000 * 1000 };
+        if (interval && !done && idle > 0) {
+            uint64_t now = now_ns(), wait = next_due > now ? next_due - now : 0;
+            if (wait < 100000000u) to.tv_nsec = (long)wait;
+        }
+        if (np == 0 && to.tv_nsec == 0) continue;
+        int r = ppoll(pfd, (nfds_t)np, &to, NULL);
+        if (r < 0 && errno != EINTR) { w->failed = true; break; }
+        for (int k = 0; r > 0 && k < np; k++) {
+            if (!(pfd[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            lconn_t *cn = &w->conns[pidx[k]];
+            // Take every reply that has already arrived, not just one per poll
+            do {
+                inflight_t f;
+                int st = recv_op(cn, &f);
+                uint64_t t = now_ns();
+                if (st < 0) { w->failed = true; done = true; close(cn->fd); cn->fd = -1; cn->inflight = 0; break; }
+                if (!atomic_load(&g_recording)) continue;
+                w->ops++; w->t_last = t;
+                if (f.op == 'W') w->writes++; else w->reads++;
+                if (cn->ep > 0) w->replica_reads++;
+                if (st == 0) w->errors++;
+                w->hist[lat_index(t - f.t_start)]++;
+            } while (cn->inflight > 0 && reply_waiting(cn->fd));
+        }
+        // A dead connection stays out of the rotation
+        for (int i = 0; i < w->nconns; i++)
+            if (w->conns[i].fd < 0) { free(w->conns[i].q); w->conns[i] = w->conns[--w->nconns]; i--; }
+        if (w->nconns == 0) break;
+    }
+    free(pfd); free(pidx);
+    return NULL;
+}
+
+// Connection k goes to endpoint k % nep. Replica connections only read, so
+// the primary's share of writes is scaled up to keep the requested mix.
+static int open_conn(lconn_t *cn, int k) {
+    memset(cn, 0, sizeof(*cn));
+    if (!(cn->q = calloc((size_t)g_cfg.qd, sizeof(*cn->q)))) return -1;
+    cn->ep = k % g_cfg.nep;
+    if (cn->ep == 0) {
+        int primary = (g_cfg.conns + g_cfg.nep - 1) / g_cfg.nep;
+        long bp = (long)(100 - g_cfg.read_pct) * 100 * g_cfg.conns / primary;
+        cn->wr_bp = bp > 10000 ? 10000 : (int)bp;
+    }
+    cn->fd = connect_to(g_cfg.ep[cn->ep].host, g_cfg.ep[cn->ep].port);
+    if (cn->fd < 0) return -1;
+    int one = 1; setsockopt(cn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (g_cfg.bin) { uint8_t magic = DISK_BIN_MAGIC; if (write_full(cn->fd, &magic, 1) < 0) return -1; }
+    return 0;
+}
+
+static void sleep_s(double s) {
+    struct timespec ts = { (time_t)s, (long)((s - (double)(time_t)s) * 1e9) };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+}
+
+static const char *dist_name(dist_t d) {
+    switch (d) { case DIST_SEQ: return "seq"; case DIST_ZIPF: return "zipf"; case DIST_CYL: return "cyl"; default: return "uniform"; }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s <host> <port> <N_ops> <seed> [--bin] [--threads=T] [--conns=C] [--qd=K] [--reads=PCT]\n"
+        "          [--dist=uniform|seq|zipf|cyl] [--zipf=THETA] [--cyl=K] [--rate=OPS]\n"
+        "          [--warmup=SEC] [--duration=SEC] [--csv=FILE] [--read-from=host:port[,...]]\n", prog);
 }
 
 // Main function
 int main(int argc, char **argv) {
-    if (argc != 5) { fprintf(stderr, "Usage: %s <host> <port> <N_ops> <seed>\n", argv[0]); return 1; }
-    const char *host = argv[1], *port = argv[2];
-    long N = strtol(argv[3], NULL, 10); unsigned seed = (unsigned)strtoul(argv[4], NULL, 10);
-    if (N <= 0) { fprintf(stderr, "N_ops must be > 0\n"); return 1; }
-
-    int fd = connect_to(host, port); if (fd < 0) { perror("connect"); return 1; }
-
-    // Query geometry
-    const char *msg = "I "; if (write_full(fd, msg, strlen(msg)) < 0) { perror("write I"); return 1; }
-    char line[128] = {0}; ssize_t r = read(fd, line, sizeof(line)-1); if (r <= 0) { perror("read I"); return 1; }
-    int CYL=0, SEC=0; if (sscanf(line, "%d %d", &CYL, &SEC) != 2) { fprintf(stderr, "Bad I response: %s\n", line); return 1; }
-    fprintf(stderr, "Geometry: cyl=%d sec=%d\n", CYL, SEC);
-
-    for (long i=0;i<N;i++) {
-        int c = rand_r(&seed) % CYL;
-        int s = rand_r(&seed) % SEC;
-        bool do_write = (rand_r(&seed) & 1) != 0;
-        if (do_write) {
-            char hdr[64]; int n = snprintf(hdr, sizeof(hdr), "W %d %d %d ", c, s, BLOCK_SIZE);
-            if (write_full(fd, hdr, (size_t)n) < 0) { perror("write hdr"); break; }
-            uint8_t blk[BLOCK_SIZE]; fill_rand(blk, sizeof blk, &seed);
-            if (write_full(fd, blk, BLOCK_SIZE) < 0) { perror("write data"); break; }
-            char status; if (read_full(fd, &status, 1) != 1) { perror("read status"); break; }
-            putchar(status=='1' ? 'W' : '!');
-        } else {
-            char hdr[64]; int n = snprintf(hdr, sizeof(hdr), "R %d %d ", c, s);
-            if (write_full(fd, hdr, (size_t)n) < 0) { perror("write hdr"); break; }
-            char status; if (read_full(fd, &status, 1) != 1) { perror("read status"); break; }
-            if (status == '1') {
-                uint8_t blk[BLOCK_SIZE]; if (read_full(fd, blk, BLOCK_SIZE) != BLOCK_SIZE) { perror("read blk"); break; }
-                putchar('R');
-            } else {
-                putchar('!');
+    if (argc < 5) { usage(argv[0]); return 1; }
+    cfg_t *g = &g_cfg;
+    g->host = argv[1]; g->port = argv[2];
+    g->n_ops = strtol(argv[3], NULL, 10); g->seed = (unsigned)strtoul(argv[4], NULL, 10);
+    g->threads = 1; g->conns = 0; g->qd = 1; g->read_pct = 50; g->dist = DIST_UNIFORM; g->theta = 0.99; g->cyl_k = -1;
+    for (int i = 5; i < argc; i++) {
+        const char *a = argv[i];
+        if (!strcmp(a, "--bin")) g->bin = true;
+        else if (!strncmp(a, "--threads=", 10)) g->threads = atoi(a + 10);
+        else if (!strncmp(a, "--conns=", 8)) g->conns = atoi(a + 8);
+        else if (!strncmp(a, "--qd=", 5)) g->qd = atoi(a + 5);
+        else if (!strncmp(a, "--reads=", 8)) g->read_pct = atoi(a + 8);
+        else if (!strcmp(a, "--dist=uniform")) g->dist = DIST_UNIFORM;
+        else if (!strcmp(a, "--dist=seq")) g->dist = DIST_SEQ;
+        else if (!strcmp(a, "--dist=zipf")) g->dist = DIST_ZIPF;
+        else if (!strcmp(a, "--dist=cyl")) g->dist = DIST_CYL;
+        else if (!strncmp(a, "--zipf=", 7)) g->theta = atof(a + 7);
+        else if (!strncmp(a, "--cyl=", 6)) g->cyl_k = atoi(a + 6);
+        else if (!strncmp(a, "--rate=", 7)) g->rate = atof(a + 7);
+        else if (!strncmp(a, "--warmup=", 9)) g->warmup_s = atof(a + 9);
+        else if (!strncmp(a, "--duration=", 11)) g->duration_s = atof(a + 11);
+        else if (!strncmp(a, "--csv=", 6)) g->csv = a + 6;
+        else if (!strncmp(a, "--read-from=", 12)) {
+            char *list = strdup(a + 12), *save = NULL;
+            if (!list) { perror("strdup"); return 1; }
+            for (char *t = strtok_r(list, ",", &save); t; t = strtok_r(NULL, ",", &save)) {
+                char *colon = strrchr(t, ':');
+                if (!colon || colon == t || g->nep + 1 == MAX_ENDPOINTS) { usage(argv[0]); return 1; }
+                *colon = '\0';
+                g->ep[++g->nep] = (endpoint_t){ t, colon + 1 };   // list is kept for the whole run
             }
         }
-        fflush(stdout);
+        else { usage(argv[0]); return 1; }
+    }
+    g->ep[0] = (endpoint_t){ g->host, g->port };
+    g->nep++;
+    if (g->conns <= 0) g->conns = g->threads > g->nep ? g->threads : g->nep;
+    if (g->threads <= 0 || g->conns < g->threads || g->conns < g->nep || g->qd <= 0 || g->read_pct < 0 || g->read_pct > 100 || g->rate < 0 ||
+        g->warmup_s < 0 || g->duration_s < 0 || (g->duration_s == 0 && g->n_ops <= 0) ||
+        g->theta <= 0 || g->theta >= 1) {
+        usage(argv[0]); return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Query geometry on a throwaway connection
+    int fd = connect_to(g->host, g->port); if (fd < 0) { perror("connect"); return 1; }
+    if (g->bin) {
+        uint8_t magic = DISK_BIN_MAGIC; if (write_full(fd, &magic, 1) < 0) { perror("write magic"); return 1; }
+        uint32_t geo[2];
+        if (bin_call(fd, 'I', 0, 0, 0, NULL, 0, (uint8_t *)geo, sizeof(geo)) != 1) { fprintf(stderr, "Bad I response\n"); return 1; }
+        g->CYL = (int)ntohl(geo[0]); g->SEC = (int)ntohl(geo[1]);
+    } else {
+        const char *msg = "I "; if (write_full(fd, msg, strlen(msg)) < 0) { perror("write I"); return 1; }
+        char line[128] = {0}; ssize_t r = read(fd, line, sizeof(line)-1); if (r <= 0) { perror("read I"); return 1; }
+        if (sscanf(line, "%d %d", &g->CYL, &g->SEC) != 2) { fprintf(stderr, "Bad I response: %s\n", line); return 1; }
     }
-    putchar('\n');
     close(fd);
-    return 0;
+    fprintf(stderr, "Geometry: cyl=%d sec=%d\n", g->CYL, g->SEC);
+    g->nsect = (uint64_t)g->CYL * (uint64_t)g->SEC;
+    if (g->cyl_k < 0 || g->cyl_k >= g->CYL) g->cyl_k = g->CYL / 2;
+    if (g->dist == DIST_ZIPF) zipf_init(g);
+
+    // Connections are dealt round-robin to threads (and to endpoints)
+    worker_t *W = calloc((size_t)g->threads, sizeof(*W));
+    if (!W) { perror("calloc"); return 1; }
+    for (int t = 0, k = 0; t < g->threads; t++) {
+        W[t].idx = t;
+        W[t].nconns = g->conns / g->threads + (t < g->conns % g->threads);
+        W[t].conns = calloc((size_t)W[t].nconns, sizeof(lconn_t));
+        W[t].hist = calloc(LAT_NBUCKETS, sizeof(uint64_t));
+        W[t].rng = ((uint64_t)g->seed << 20) ^ (0x9E3779B97F4A7C15ULL * (uint64_t)(t + 1));
+        if (!W[t].conns || !W[t].hist) { perror("calloc"); return 1; }
+        for (int i = 0; i < W[t].nconns; i++) {
+            if (open_conn(&W[t].conns[i], k++) < 0) { perror("connect"); return 1; }
+            W[t].conns[i].seq = rng_next(&W[t].rng) % g->nsect;
+        }
+    }
+
+    atomic_store(&g_tickets, g->n_ops);
+    atomic_store(&g_recording, g->warmup_s == 0);
+    for (int t = 0; t < g->threads; t++)
+        if (pthread_create(&W[t].th, NULL, worker_main, &W[t]) != 0) { perror("pthread_create"); return 1; }
+
+    if (g->warmup_s > 0) { sleep_s(g->warmup_s); atomic_store(&g_recording, true); }
+    uint64_t t0 = now_ns(), t1 = 0;
+    if (g->duration_s > 0) {
+        sleep_s(g->duration_s);
+        atomic_store(&g_recording, false);
+        t1 = now_ns();
+        atomic_store(&g_stop, true);
+    }
+    for (int t = 0; t < g->threads; t++) pthread_join(W[t].th, NULL);
+
+    // Merge
+    uint64_t ops = 0, reads = 0, writes = 0, errors = 0, rreads = 0, last = t0; bool failed = false;
+    uint64_t *hist = calloc(LAT_NBUCKETS, sizeof(uint64_t));
+    if (!hist) { perror("calloc"); return 1; }
+    for (int t = 0; t < g->threads; t++) {
+        ops += W[t].ops; reads += W[t].reads; writes += W[t].writes; errors += W[t].errors; rreads += W[t].replica_reads;
+        if (W[t].t_last > last) last = W[t].t_last;
+        failed |= W[t].failed;
+        for (int i = 0; i < LAT_NBUCKETS; i++) hist[i] += W[t].hist[i];
+    }
+    if (t1 == 0) t1 = last;
+    double secs = (double)(t1 - t0) / 1e9, tput = secs > 0 ? (double)ops / secs : 0.0;
+    double p50 = lat_pct_us(hist, ops, 0.50), p90 = lat_pct_us(hist, ops, 0.90), p99 = lat_pct_us(hist, ops, 0.99),
+           p999 = lat_pct_us(hist, ops, 0.999), pmax = lat_pct_us(hist, ops, 1.0);
+
+    printf("proto=%s threads=%d conns=%d qd=%d dist=%s reads=%d%% mode=%s\n", g->bin ? "bin" : "text", g->threads, g->conns,
+           g->qd, dist_name(g->dist), g->read_pct, g->rate > 0 ? "open" : "closed");
+    printf("ops=%llu (R=%llu W=%llu) errors=%llu time=%.3f s throughput=%.1f ops/s\n", (unsigned long long)ops,
+           (unsigned long long)reads, (unsigned long long)writes, (unsigned long long)errors, secs, tput);
+    if (g->nep > 1)
+        printf("endpoints=%d reads_from_replicas=%llu (%.1f%% of reads)\n", g->nep, (unsigned long long)rreads,
+               reads ? 100.0 * (double)rreads / (double)reads : 0.0);
+    printf("latency_us p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n", p50, p90, p99, p999, pmax);
+    if (failed) fprintf(stderr, "warning: some connections failed during the run\n");
+
+    if (g->csv) {
+        FILE *f = fopen(g->csv, "a");
+        if (!f) { perror("csv"); return 1; }
+        if (ftell(f) == 0)
+            fprintf(f, "proto,threads,conns,qd,dist,read_pct,mode,rate,ops,errors,secs,ops_per_s,p50_us,p90_us,p99_us,p999_us,max_us\n");
+        fprintf(f, "%s,%d,%d,%d,%s,%d,%s,%.0f,%llu,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", g->bin ? "bin" : "text",
+                g->threads, g->conns, g->qd, dist_name(g->dist), g->read_pct, g->rate > 0 ? "open" : "closed", g->rate,
+                (unsigned long long)ops, (unsigned long long)errors, secs, tput, p50, p90, p99, p999, pmax);
+        fclose(f);
+    }
+    for (int t = 0; t < g->threads; t++) {
+        for (int i = 0; i < W[t].nconns; i++) { close(W[t].conns[i].fd); free(W[t].conns[i].q); }
+        free(W[t].conns); free(W[t].hist);
+    }
+    free(W); free(hist);
+    return failed ? 2 : 0;
 }
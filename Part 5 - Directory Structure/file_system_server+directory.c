@@ -1,10 +1,15 @@
 // Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
 // Description: Same as previous part/question, but with a directory for fixed structure
+//              L 2 lists blocks and contiguous runs per file (fragmentation report).
 // Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread fs_server.c -o fs_server
-// Run:           ./fs_server <port> <cylinders> <sectors_per_cyl> <backing_file>
+// Run:           ./fs_server <port> <cylinders> <sectors_per_cyl> <backing_file> [--max-files=N] [--journal-blocks=N]
 // Example: ./fs_server 10090 200 32 ./fs.img
+//          --max-files=N sizes the directory the next F formats (default 16).
+//          --journal-blocks=N sizes the metadata journal F creates (0 = none; default:
+//          automatic, none on volumes too small to spare 1/8 for it).
 
 // Libraries used
+#define _POSIX_C_SOURCE 200809L
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -20,16 +25,21 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 // Constants defined
-#define _POSIX_C_SOURCE 200809L
 #define BLOCK_SIZE 128
 #define NAME_MAXLEN 48
 #define DIR_DEFAULT_BLOCKS 8   // Note: Sam reasoning as previous part
 #define BACKLOG 64
 #define FAT_FREE (-1)
 #define FAT_EOC  (-2)
+#define DIRTY_MAX 32           // page ranges kept per kind before new ones are folded in
+#define JNL_MAGIC 0x4A4E4C31u  // 'JNL1' journal header
+#define JTX_MAGIC 0x4A545831u  // 'JTX1' transaction record
+#define JNL_TAGS (BLOCK_SIZE / 4)  // home block numbers per tag block
+#define JNL_CKPT_MS 1000       // checkpoint at least this often while the log is not empty
 
 // ---- On-disk structures (packed into 128-byte blocks) ----------------------
 
@@ -45,7 +55,9 @@ typedef struct {
     uint32_t dir_blocks;       // number of directory blocks
     uint32_t data_start;       // first data block index
     uint32_t max_files;        // computed from dir_blocks
-    uint8_t  reserved[128 - (11*4)];
+    uint32_t journal_start;    // block index of the journal header
+    uint32_t journal_blocks;   // header + log; 0 = no journal
+    uint8_t  reserved[128 - (13*4)];
 } __attribute__((packed)) super_t;
 
 // 64-byte directory entry: fits 2 per 128-byte block
@@ -58,8 +70,29 @@ typedef struct {
     uint8_t  _pad2[64 - (1+3+4+4+NAME_MAXLEN)];
 } __attribute__((packed)) dirent_t;
 
+// First journal block; the rest is a ring of transaction records
+typedef struct {
+    uint32_t magic;            // 'JNL1'
+    uint32_t tail;             // log offset of the oldest record not checkpointed yet
+    uint64_t tail_seq;         // its sequence number
+    uint8_t  reserved[128 - 16];
+} __attribute__((packed)) jhdr_t;
+
+// Transaction record: this header, ceil(n/32) tag blocks (home block numbers)
+// and n block images. n == 0 marks a wrap: the record with this seq is at 0.
+typedef struct {
+    uint32_t magic;            // 'JTX1'
+    uint32_t nblocks;
+    uint64_t seq;              // consecutive, so replay stops at the first stale record
+    uint64_t sum;              // FNV-1a over tags and images, seeded with seq
+    uint8_t  reserved[128 - 24];
+} __attribute__((packed)) jrec_t;
+
 // ---- In-memory state -----------------------------------------
 
+enum { DIRTY_DATA, DIRTY_FAT, DIRTY_DIR, DIRTY_KINDS };   // also the sync order
+typedef struct { size_t lo, hi; } prange_t;                // pages [lo, hi)
+
 typedef struct {
     int fd;
     uint8_t *base;             // mmap base
@@ -68,6 +101,58 @@ typedef struct {
     int32_t *fat;              // pointer to FAT (int32 table)
     dirent_t *dir;             // pointer to first dir block
     pthread_mutex_t lock;      // serialize FS metadata + data access
+    uint32_t fmt_dir_blocks;   // directory size used by F
+    long fmt_journal_blocks;   // journal size used by F, -1 = automatic
+
+    // Directory index (memory only, rebuilt at mount and by F): name hash ->
+    // chain of used slots, and a stack of free slots
+    int32_t *dh_head;          // bucket -> first slot, -1 if empty
+    int32_t *dh_next;          // slot -> next slot in its bucket, or next free slot
+    uint32_t dh_mask;          // buckets - 1
+    int32_t  free_head;        // first free slot, -1 if the directory is full
+
+    // Free-space map (memory only, rebuilt from the FAT at mount and by F)
+    uint64_t *fm_bits;         // one bit per block, set = free
+    uint64_t *fm_sum;          // one bit per fm_bits word that has a free block
+    uint32_t fm_words;         // words in fm_bits
+    uint32_t fm_rover;         // next-fit search starts here
+    uint32_t free_blocks;      // cached count of free data blocks
+
+    // Pages the current command changed, by kind (under lock; see dirty_sync).
+    // Journaled, only DIRTY_DATA is used: the running transaction's data pages
+    size_t page;               // system page size
+    prange_t dirty[DIRTY_KINDS][DIRTY_MAX];
+    int ndirty[DIRTY_KINDS];
+
+    // Metadata journal (sb->journal_blocks > 0). fat/dir point into a private
+    // copy; home blocks change only when committed records are checkpointed.
+    uint8_t  *meta;            // private copy of the FAT + directory blocks
+    uint32_t  meta_blocks;
+    uint64_t *txn_stamp;       // per meta block: running txn that logged it
+    uint32_t *txn_blocks;      // meta blocks (relative) logged by the running txn
+    uint32_t  txn_n;
+    uint32_t *txn_free;        // blocks the running txn freed (see fm_defer_free)
+    uint32_t  txn_nfree;
+    uint32_t *txn_free_spare;  // the other free list; NULL while a commit holds it
+    uint8_t  *j_rec;           // commit record: room for the header, tags and every meta block
+    bool      txn_data;        // running txn wrote data blocks
+    uint64_t  txn_seq;         // running txn; commands wait for it to commit
+    uint64_t  op_seq;          // txn the last command joined (0 = none)
+    uint64_t  fmt_gen;         // bumped by F: frees held by older txns are void
+    // Lock order: lock -> j_io -> ck_lock -> j_lock
+    pthread_rwlock_t j_io;     // shared by commit and checkpoint I/O, exclusive for F
+    pthread_mutex_t ck_lock;   // one checkpoint at a time
+    pthread_mutex_t j_lock;
+    pthread_cond_t  j_cv;      // a commit finished
+    pthread_cond_t  ck_cv;     // wakes the checkpointer
+    bool      j_committing, j_closed;
+    uint64_t  j_done;          // last txn on disk
+    uint32_t  j_size;          // log blocks (journal_blocks - 1)
+    uint32_t  j_head, j_tail;  // log offsets: after the last durable record, oldest record
+    uint32_t  j_used;          // log blocks from tail to head, plus any reservation
+    uint64_t  j_seq, j_tail_seq; // next record's seq, seq at tail
+    uint64_t  st_ops, st_commits, st_ckpts;
+    pthread_t j_thread;
 } fs_t;
 
 static volatile sig_atomic_t g_stop = 0;
@@ -111,18 +196,58 @@ static ssize_t write_full(int fd, const void *buf, size_t n) {
     return (ssize_t)n;
 }
 
-// token reader: reads next non-empty whitespace-separated ASCII token
-static int read_token(int fd, char *out, size_t outsz) {
-    char ch;
-    for (;;) { ssize_t r = read(fd,&ch,1); if (r==0) return 0; if (r<0){ if(errno==EINTR) continue; return -1;} if (ch!=' '&&ch!='\t'&&ch!='\n'&&ch!='\r') break; }
+// ---- Buffered connection input ---------------------------------------------
+// One large recv() refills the per-connection buffer; tokens and payloads are
+// carved out of it instead of costing a read() per byte.
+
+#define CONN_BUFSZ 4096
+
+typedef struct {
+    int fd;
+    size_t rpos, rend;         // unread input is in[rpos..rend)
+    uint8_t in[CONN_BUFSZ];
+} conn_t;
+
+// one recv() into the free tail of the buffer: bytes added, 0 on EOF, -1 on error
+static ssize_t conn_fill(conn_t *cn) {
+    if (cn->rpos == cn->rend) cn->rpos = cn->rend = 0;
+    else if (cn->rend == sizeof(cn->in)) { memmove(cn->in, cn->in+cn->rpos, cn->rend-cn->rpos); cn->rend -= cn->rpos; cn->rpos = 0; }
+    for (;;) {
+        ssize_t r = recv(cn->fd, cn->in+cn->rend, sizeof(cn->in)-cn->rend, 0);
+        if (r<0 && errno==EINTR) continue;
+        if (r>0) cn->rend += (size_t)r;
+        return r;
+    }
+}
+
+static inline int is_ws(uint8_t ch) { return ch==' '||ch=='\t'||ch=='\n'||ch=='\r'; }
+
+// token reader: reads next non-empty whitespace-separated ASCII token (eats one trailing delimiter)
+static int conn_read_token(conn_t *cn, char *out, size_t outsz) {
+    for (;;) {
+        while (cn->rpos<cn->rend && is_ws(cn->in[cn->rpos])) cn->rpos++;
+        if (cn->rpos<cn->rend) break;
+        ssize_t r = conn_fill(cn); if (r==0) return 0; if (r<0) return -1;
+    }
     size_t i=0;
     for (;;) {
-        if (i+1<outsz) out[i++]=ch;
-        ssize_t r=read(fd,&ch,1);
-        if (r==0){ out[i]='\0'; return 1; }
-        if (r<0){ if(errno==EINTR) continue; out[i]='\0'; return -1; }
-        if (ch==' '||ch=='\t'||ch=='\n'||ch=='\r'){ out[i]='\0'; return 1; }
+        while (cn->rpos<cn->rend && !is_ws(cn->in[cn->rpos])) { if (i+1<outsz) out[i++]=(char)cn->in[cn->rpos]; cn->rpos++; }
+        if (cn->rpos<cn->rend) { cn->rpos++; break; }
+        ssize_t r = conn_fill(cn); if (r==0) break; if (r<0) { out[i]='\0'; return -1; }
+    }
+    out[i]='\0'; return 1;
+}
+
+// read_full() that drains buffered input first; big remainders go straight to buf
+static ssize_t conn_read_full(conn_t *cn, void *buf, size_t n) {
+    uint8_t *p=buf; size_t left=n;
+    while (left>0) {
+        size_t have = cn->rend-cn->rpos;
+        if (have>0) { size_t k = have<left ? have : left; memcpy(p, cn->in+cn->rpos, k); cn->rpos+=k; p+=k; left-=k; continue; }
+        if (left >= sizeof(cn->in)) { ssize_t r = read_full(cn->fd, p, left); if (r<0) return -1; return (ssize_t)(n-left+(size_t)r); }
+        ssize_t r = conn_fill(cn); if (r==0) return (ssize_t)(n-left); if (r<0) return -1;
     }
+    return (ssize_t)n;
 }
 
 // ---- FS core --------------------------------------------------
@@ -133,15 +258,22 @@ static void fs_bind_views(fs_t *fs) {
     fs->dir = (dirent_t *)block_ptr(fs, fs->sb->dir_start);
 }
 
-static int fs_format(fs_t *fs, uint32_t cyl, uint32_t sec) {
+// Fills *out with the layout F would write; -1 if the volume cannot hold it
+static int fs_layout(const fs_t *fs, uint32_t cyl, uint32_t sec, super_t *out) {
     size_t total_blocks = blocks_total(cyl, sec);
     if (total_blocks < 16) return -1; // need some room for meta + data
 
     // Layout
     uint32_t fat_entries_per_block = BLOCK_SIZE / sizeof(int32_t); // 32
     uint32_t fat_blocks = (uint32_t)((total_blocks + fat_entries_per_block - 1) / fat_entries_per_block);
-    uint32_t dir_blocks = DIR_DEFAULT_BLOCKS;
-    if (1 + fat_blocks + dir_blocks >= total_blocks) return -1;
+    uint32_t dir_blocks = fs->fmt_dir_blocks;
+    // The log must hold a record of every FAT and directory block at once (plus
+    // the header and one spare block); auto-sizing adds half that again, or skips
+    // the journal on volumes where it would take more than 1/8 of the space
+    uint32_t meta = fat_blocks + dir_blocks, jneed = 3 + (meta + JNL_TAGS - 1) / JNL_TAGS + meta, jblocks;
+    if (fs->fmt_journal_blocks >= 0) jblocks = fs->fmt_journal_blocks == 0 ? 0 : fs->fmt_journal_blocks < (long)jneed ? jneed : (uint32_t)fs->fmt_journal_blocks;
+    else jblocks = jneed + jneed / 2 <= total_blocks / 8 ? jneed + jneed / 2 : jneed <= total_blocks / 8 ? jneed : 0;
+    if (1 + fat_blocks + dir_blocks + (size_t)jblocks >= total_blocks) return -1;
 
     super_t sb = {0};
     sb.magic        = 0x46534C31u; // 'FSL1'
@@ -153,8 +285,18 @@ static int fs_format(fs_t *fs, uint32_t cyl, uint32_t sec) {
     sb.fat_blocks   = fat_blocks;
     sb.dir_start    = sb.fat_start + sb.fat_blocks;
     sb.dir_blocks   = dir_blocks;
-    sb.data_start   = sb.dir_start + sb.dir_blocks;
+    sb.journal_start  = sb.dir_start + sb.dir_blocks;
+    sb.journal_blocks = jblocks;
+    sb.data_start   = sb.journal_start + sb.journal_blocks;
     sb.max_files    = (sb.dir_blocks * BLOCK_SIZE) / sizeof(dirent_t);
+    *out = sb;
+    return 0;
+}
+
+static int fs_format(fs_t *fs, uint32_t cyl, uint32_t sec) {
+    super_t sb;
+    if (fs_layout(fs, cyl, sec, &sb) < 0) return -1;
+    size_t total_blocks = sb.total_blocks;
 
     // Write superblock
     memcpy(block_ptr(fs,0), &sb, sizeof(sb));
@@ -177,36 +319,250 @@ static int fs_format(fs_t *fs, uint32_t cyl, uint32_t sec) {
         de->used = 0; de->first_block = -1; de->size_bytes = 0; de->name[0]='\0';
     }
 
+    // Empty journal; the log is zeroed so no record from before F can replay
+    if (sb.journal_blocks) {
+        memset(block_ptr(fs, sb.journal_start), 0, (size_t)sb.journal_blocks * BLOCK_SIZE);
+        jhdr_t jh = { .magic = JNL_MAGIC, .tail = 0, .tail_seq = 1 };
+        memcpy(block_ptr(fs, sb.journal_start), &jh, sizeof(jh));
+    }
+
     // Persist
     msync(fs->base, fs->bytes, MS_SYNC);
     return 0;
 }
 
+// ---- Dirty ranges ----------------------------------------------------------
+// Mutating commands record the pages they changed instead of syncing the whole
+// mapping. dirty_sync() flushes data first, then FAT, then directory, so a
+// dirent or FAT entry never reaches disk ahead of the blocks it points at.
+
+static void dirty_mark(fs_t *fs, int kind, const void *p, size_t len) {
+    if (len == 0) return;
+    if (fs->meta && kind != DIRTY_DATA) {  // journaled: metadata blocks join the running transaction
+        size_t off = (size_t)((const uint8_t *)p - fs->meta);
+        for (uint32_t b = (uint32_t)(off / BLOCK_SIZE); b <= (off + len - 1) / BLOCK_SIZE; b++)
+            if (fs->txn_stamp[b] != fs->txn_seq) { fs->txn_stamp[b] = fs->txn_seq; fs->txn_blocks[fs->txn_n++] = b; }
+        return;
+    }
+    if (fs->meta) fs->txn_data = true;     // data pages are flushed by the commit
+    size_t off = (size_t)((const uint8_t *)p - fs->base);
+    size_t lo = off / fs->page, hi = (off + len - 1) / fs->page + 1;
+    prange_t *r = fs->dirty[kind]; int *n = &fs->ndirty[kind];
+    for (int i = 0; i < *n; i++) {
+        if (lo > r[i].hi || hi < r[i].lo) continue;
+        if (lo < r[i].lo) r[i].lo = lo;        // overlaps or touches: widen it
+        if (hi > r[i].hi) r[i].hi = hi;
+        return;
+    }
+    if (*n < DIRTY_MAX) { r[(*n)++] = (prange_t){ lo, hi }; return; }
+    if (lo < r[*n - 1].lo) r[*n - 1].lo = lo;  // full: fold into the last range
+    if (hi > r[*n - 1].hi) r[*n - 1].hi = hi;
+}
+
+// True if pages [lo, hi) were all synced by an earlier kind in this pass
+static bool dirty_synced(fs_t *fs, int kind, size_t lo, size_t hi) {
+    for (int k = 0; k < kind; k++)
+        for (int i = 0; i < fs->ndirty[k]; i++)
+            if (fs->dirty[k][i].lo <= lo && hi <= fs->dirty[k][i].hi) return true;
+    return false;
+}
+
+// Each msync is a flush of its own, so a page that shares data with metadata
+// is written once, by the first kind that needs it
+static void dirty_sync(fs_t *fs) {
+    if (fs->meta) { fs->op_seq = fs->txn_seq; return; }   // the client waits for the commit (jnl_wait)
+    for (int k = 0; k < DIRTY_KINDS; k++) {
+        for (int i = 0; i < fs->ndirty[k]; i++) {
+            if (dirty_synced(fs, k, fs->dirty[k][i].lo, fs->dirty[k][i].hi)) continue;
+            size_t lo = fs->dirty[k][i].lo * fs->page, hi = fs->dirty[k][i].hi * fs->page;
+            if (hi > fs->bytes) hi = fs->bytes;
+            msync(fs->base + lo, hi - lo, MS_SYNC);
+        }
+    }
+    for (int k = 0; k < DIRTY_KINDS; k++) fs->ndirty[k] = 0;
+}
+
+// ---- Directory index -------------------------------------------------------
+// Lookups hash the name (as stored: at most NAME_MAXLEN-1 bytes) and walk one
+// short chain instead of scanning every slot; creates pop a free slot.
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;                  // FNV-1a
+    for (int i = 0; i < NAME_MAXLEN - 1 && name[i]; i++) { h ^= (uint8_t)name[i]; h *= 16777619u; }
+    return h;
+}
+
+static void dir_index_add(fs_t *fs, int idx) {
+    uint32_t b = name_hash(fs->dir[idx].name) & fs->dh_mask;
+    fs->dh_next[idx] = fs->dh_head[b]; fs->dh_head[b] = idx;
+}
+
+static void dir_index_remove(fs_t *fs, int idx) {
+    int32_t *pp = &fs->dh_head[name_hash(fs->dir[idx].name) & fs->dh_mask];
+    while (*pp >= 0 && *pp != idx) pp = &fs->dh_next[*pp];
+    if (*pp == idx) *pp = fs->dh_next[idx];
+}
+
+// (Re)builds the index from the on-disk directory; free slots are stacked so
+// the lowest is handed out first, as the old linear scan did
+static int dir_index_build(fs_t *fs) {
+    uint32_t n = fs->sb->max_files, nb = 16;
+    while (nb < 2 * n) nb *= 2;
+    free(fs->dh_head); free(fs->dh_next);
+    fs->dh_head = malloc(nb * sizeof(int32_t));
+    fs->dh_next = malloc((n ? n : 1) * sizeof(int32_t));
+    if (!fs->dh_head || !fs->dh_next) { perror("malloc"); return -1; }
+    fs->dh_mask = nb - 1;
+    for (uint32_t b = 0; b < nb; b++) fs->dh_head[b] = -1;
+    fs->free_head = -1;
+    for (uint32_t i = n; i-- > 0; ) {
+        if (fs->dir[i].used) dir_index_add(fs, (int)i);
+        else { fs->dh_next[i] = fs->free_head; fs->free_head = (int32_t)i; }
+    }
+    return 0;
+}
+
 static int dir_find(fs_t *fs, const char *name) {
-    for (uint32_t i=0;i<fs->sb->max_files;i++) {
-        dirent_t *de = &fs->dir[i];
-        if (de->used && strncmp(de->name, name, NAME_MAXLEN) == 0) return (int)i;
+    for (int32_t i = fs->dh_head[name_hash(name) & fs->dh_mask]; i >= 0; i = fs->dh_next[i])
+        if (strncmp(fs->dir[i].name, name, NAME_MAXLEN - 1) == 0) return (int)i;
+    return -1;
+}
+
+// Pops a free slot (-1 if the directory is full)
+static int dir_take_free(fs_t *fs) {
+    int idx = fs->free_head;
+    if (idx >= 0) fs->free_head = fs->dh_next[idx];
+    return idx;
+}
+
+static void dir_put_free(fs_t *fs, int idx) {
+    fs->dh_next[idx] = fs->free_head; fs->free_head = idx;
+}
+
+// ---- Free-space map --------------------------------------------------------
+// One free bit per block and a summary bit per 64-block word that still has a
+// free block, so searches skip full stretches 4096 blocks at a time. The FAT
+// stays the on-disk truth; the map is rebuilt from it at mount and by F.
+
+#define FIT_SCAN_RUNS 1024     // free runs examined looking for one that fits a whole request
+
+static inline bool fm_is_free(fs_t *fs, uint32_t b) {
+    return (fs->fm_bits[b >> 6] >> (b & 63)) & 1;
+}
+
+static inline void fm_mark_free(fs_t *fs, uint32_t b) {
+    uint32_t w = b >> 6;
+    fs->fm_bits[w] |= 1ull << (b & 63);
+    fs->fm_sum[w >> 6] |= 1ull << (w & 63);
+    fs->free_blocks++;
+}
+
+static inline void fm_mark_used(fs_t *fs, uint32_t b) {
+    uint32_t w = b >> 6;
+    fs->fm_bits[w] &= ~(1ull << (b & 63));
+    if (!fs->fm_bits[w]) fs->fm_sum[w >> 6] &= ~(1ull << (w & 63));
+    fs->free_blocks--;
+}
+
+// First free block at or after b, -1 if there is none
+static int32_t fm_next_free(fs_t *fs, uint32_t b) {
+    if (b >= fs->sb->total_blocks) return -1;
+    uint32_t w = b >> 6, s = w >> 6, nsum = (fs->fm_words + 63) >> 6;
+    uint64_t m = fs->fm_bits[w] & (~0ull << (b & 63));
+    if (m) return (int32_t)((w << 6) + (uint32_t)__builtin_ctzll(m));
+    m = (w & 63) == 63 ? 0 : fs->fm_sum[s] & (~0ull << ((w & 63) + 1));
+    while (!m) { if (++s >= nsum) return -1; m = fs->fm_sum[s]; }
+    w = (s << 6) + (uint32_t)__builtin_ctzll(m);
+    return (int32_t)((w << 6) + (uint32_t)__builtin_ctzll(fs->fm_bits[w]));
+}
+
+// Length of the free run starting at b, counted up to max
+static uint32_t fm_run_len(fs_t *fs, uint32_t b, uint32_t max) {
+    uint32_t len = 0;
+    while (len < max && ((b + len) >> 6) < fs->fm_words) {
+        uint32_t sh = (b + len) & 63;
+        uint64_t used = ~(fs->fm_bits[(b + len) >> 6] >> sh);
+        uint32_t n = used ? (uint32_t)__builtin_ctzll(used) : 64;
+        len += n;
+        if (n < 64 - sh) break;
+    }
+    return len < max ? len : max;
+}
+
+static int fm_build(fs_t *fs) {
+    uint32_t n = fs->sb->total_blocks;
+    fs->fm_words = (n + 63) >> 6;
+    free(fs->fm_bits); free(fs->fm_sum);
+    fs->fm_bits = calloc(fs->fm_words, sizeof(uint64_t));
+    fs->fm_sum  = calloc((fs->fm_words + 63) >> 6, sizeof(uint64_t));
+    if (!fs->fm_bits || !fs->fm_sum) { perror("calloc"); return -1; }
+    fs->fm_rover = fs->sb->data_start; fs->free_blocks = 0;
+    if (fs->sb->data_start == 0) return 0;     // not formatted yet: nothing to hand out
+    for (uint32_t b = fs->sb->data_start; b < n; b++)
+        if (fs->fat[b] == FAT_FREE) fm_mark_free(fs, b);
+    return 0;
+}
+
+// Journaled: a freed block stays taken in the map until the transaction that
+// freed it is on disk, so nothing overwrites it while a crash could still
+// bring the old chain back. That also means no block is freed twice in one
+// transaction, so the list (one slot per data block) cannot overflow.
+static void fm_defer_free(fs_t *fs, uint32_t b) {
+    fs->txn_free[fs->txn_nfree++] = b;
+}
+
+// Next-fit search from the rover (wrapping once) for a free run of at least
+// want blocks; returns its start, or -1 after FIT_SCAN_RUNS runs that were
+// all too short
+static int32_t fm_find_fit(fs_t *fs, uint32_t want) {
+    uint32_t start = fs->fm_rover, pos = start;
+    bool wrapped = false;
+    for (int tries = 0; tries < FIT_SCAN_RUNS; tries++) {
+        int32_t b = fm_next_free(fs, pos);
+        if (b < 0 || (wrapped && (uint32_t)b >= start)) {
+            if (wrapped) break;
+            wrapped = true; pos = fs->sb->data_start; continue;
+        }
+        uint32_t n = fm_run_len(fs, (uint32_t)b, want);
+        if (n == want) return b;
+        pos = (uint32_t)b + n;
     }
     return -1;
 }
-static int dir_find_free(fs_t *fs) {
-    for (uint32_t i=0;i<fs->sb->max_files;i++) if (!fs->dir[i].used) return (int)i; return -1;
+
+// Marks n free blocks from b used and links them onto the chain being built
+static void take_run(fs_t *fs, uint32_t b, uint32_t n, int32_t *head, int32_t *prev) {
+    if (*prev >= 0) dirty_mark(fs, DIRTY_FAT, &fs->fat[*prev], sizeof(int32_t));
+    dirty_mark(fs, DIRTY_FAT, &fs->fat[b], n * sizeof(int32_t));
+    for (uint32_t i = b; i < b + n; i++) {
+        fm_mark_used(fs, i);
+        if (*head < 0) *head = (int32_t)i; else fs->fat[*prev] = (int32_t)i;
+        *prev = (int32_t)i; fs->fat[i] = FAT_EOC;
+    }
+    fs->fm_rover = b + n < fs->sb->total_blocks ? b + n : fs->sb->data_start;
 }
 
-static int32_t alloc_chain(fs_t *fs, uint32_t blocks_needed) {
+// Allocates a chain laid out in as few contiguous runs as possible: first the
+// free run at goal (the block after a file's tail, -1 for none), then one run
+// that fits the rest, and only if there is none the free runs in address
+// order from the rover
+static int32_t alloc_chain(fs_t *fs, uint32_t blocks_needed, int32_t goal) {
+    if (blocks_needed == 0 || blocks_needed > fs->free_blocks) return -1;
     int32_t head = -1, prev = -1;
-    uint32_t got = 0;
-    for (uint32_t i = fs->sb->data_start; i < fs->sb->total_blocks && got < blocks_needed; i++) {
-        if (fs->fat[i] == FAT_FREE) {
-            if (head < 0) head = (int32_t)i; else fs->fat[prev] = (int32_t)i;
-            prev = (int32_t)i; fs->fat[i] = FAT_EOC; got++;
-        }
+    uint32_t left = blocks_needed;
+    if (goal >= (int32_t)fs->sb->data_start && (uint32_t)goal < fs->sb->total_blocks && fm_is_free(fs, (uint32_t)goal)) {
+        uint32_t n = fm_run_len(fs, (uint32_t)goal, left);
+        take_run(fs, (uint32_t)goal, n, &head, &prev); left -= n;
     }
-    if (got < blocks_needed) {
-        // rollback
-        int32_t b = head;
-        while (b >= 0) { int32_t next = fs->fat[b]; fs->fat[b] = FAT_FREE; if (next == FAT_EOC) break; b = next; }
-        return -1;
+    if (left > 0) {
+        int32_t b = fm_find_fit(fs, left);
+        if (b >= 0) { take_run(fs, (uint32_t)b, left, &head, &prev); left = 0; }
+    }
+    while (left > 0) {
+        int32_t b = fm_next_free(fs, fs->fm_rover);
+        if (b < 0) b = fm_next_free(fs, fs->sb->data_start);
+        uint32_t n = fm_run_len(fs, (uint32_t)b, left);
+        take_run(fs, (uint32_t)b, n, &head, &prev); left -= n;
     }
     return head;
 }
@@ -215,44 +571,63 @@ static void free_chain(fs_t *fs, int32_t head) {
     int safety = 0;
     while (head >= 0 && safety < (int)fs->sb->total_blocks) {
         int32_t next = fs->fat[head];
-        fs->fat[head] = FAT_FREE;
+        if (next != FAT_FREE) { if (fs->meta) fm_defer_free(fs, (uint32_t)head); else fm_mark_free(fs, (uint32_t)head); }
+        fs->fat[head] = FAT_FREE; dirty_mark(fs, DIRTY_FAT, &fs->fat[head], sizeof(int32_t));
         if (next == FAT_EOC) break;
         head = next; safety++;
     }
 }
 
-static ssize_t io_read_chain(fs_t *fs, int32_t head, uint8_t *out, size_t want) {
-    size_t off=0; int safety=0; int32_t b=head;
-    while (b >= 0 && off < want && safety < (int)fs->sb->total_blocks) {
-        size_t to_copy = (want - off < BLOCK_SIZE) ? (want - off) : BLOCK_SIZE;
-        memcpy(out + off, block_ptr(fs,(uint32_t)b), to_copy);
-        off += to_copy;
-        int32_t next = fs->fat[b];
-        if (next == FAT_EOC) break; b = next; safety++;
+// Copies n bytes at byte offset off of the chain starting at head, with one
+// memcpy per run of consecutive blocks (fat[b] == b+1). Writes zero the rest
+// of the last block touched. Returns the bytes copied.
+static size_t chain_copy(fs_t *fs, int32_t head, size_t off, uint8_t *buf, size_t n, bool write) {
+    int32_t b = head; uint32_t hops = 0, limit = fs->sb->total_blocks;
+    for (; b >= 0 && off >= BLOCK_SIZE && hops < limit; off -= BLOCK_SIZE, hops++) b = fs->fat[b];
+    size_t done = 0;
+    while (b >= 0 && done < n && hops < limit) {
+        uint32_t e = (uint32_t)b; size_t span = BLOCK_SIZE - off;
+        while (span < n - done && fs->fat[e] == (int32_t)e + 1) { e++; span += BLOCK_SIZE; hops++; }
+        if (span > n - done) span = n - done;
+        uint8_t *p = block_ptr(fs, (uint32_t)b) + off;
+        if (write) {
+            memcpy(p, buf + done, span);
+            if (done + span == n) memset(p + span, 0, (size_t)(block_ptr(fs, e) + BLOCK_SIZE - (p + span)));
+            dirty_mark(fs, DIRTY_DATA, p, (size_t)(block_ptr(fs, e) + BLOCK_SIZE - p));
+        } else memcpy(buf + done, p, span);
+        done += span; off = 0;
+        b = fs->fat[e]; hops++;
     }
-    return (ssize_t)off;
+    return done;
+}
+
+static ssize_t io_read_chain(fs_t *fs, int32_t head, uint8_t *out, size_t want) {
+    return (ssize_t)chain_copy(fs, head, 0, out, want, false);
 }
 
-static ssize_t io_write_chain(fs_t *fs, int32_t head, const uint8_t *in, size_t nbytes) {
-    size_t off=0; int safety=0; int32_t b=head;
-    while (b >= 0 && off < nbytes && safety < (int)fs->sb->total_blocks) {
-        size_t to_copy = (nbytes - off < BLOCK_SIZE) ? (nbytes - off) : BLOCK_SIZE;
-        memcpy(block_ptr(fs,(uint32_t)b), in + off, to_copy);
-        if (to_copy < BLOCK_SIZE) memset(block_ptr(fs,(uint32_t)b)+to_copy, 0, BLOCK_SIZE-to_copy);
-        off += to_copy;
-        int32_t next = fs->fat[b];
-        if (next == FAT_EOC) break; b = next; safety++;
+static ssize_t io_write_chain(fs_t *fs, int32_t head, size_t off, const uint8_t *in, size_t nbytes) {
+    return (ssize_t)chain_copy(fs, head, off, (uint8_t *)in, nbytes, true);
+}
+
+// Blocks in a chain and how many contiguous runs they form
+static uint32_t chain_runs(fs_t *fs, int32_t head, uint32_t *blocks) {
+    uint32_t nb = 0, runs = 0;
+    for (int32_t b = head, prev = -2; b >= 0 && nb < fs->sb->total_blocks; prev = b, b = fs->fat[b]) {
+        if (b != prev + 1) runs++;
+        nb++;
     }
-    return (ssize_t)off;
+    *blocks = nb; return runs;
 }
 
 static int ensure_capacity(fs_t *fs, dirent_t *de, size_t new_size) {
     uint32_t need_blocks = (uint32_t)((new_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
     uint32_t have_blocks = 0;
+    int32_t tail = -1;
     // count current blocks
     if (de->first_block >= 0) {
         int32_t b = de->first_block; int safety=0; have_blocks=1;
         while (fs->fat[b] != FAT_EOC && safety < (int)fs->sb->total_blocks) { b = fs->fat[b]; have_blocks++; safety++; }
+        tail = b;
     }
     if (need_blocks == have_blocks) return 0;
     if (need_blocks == 0) {
@@ -260,19 +635,16 @@ static int ensure_capacity(fs_t *fs, dirent_t *de, size_t new_size) {
         return 0;
     }
     if (have_blocks == 0) {
-        int32_t head = alloc_chain(fs, need_blocks);
-        if (head < 0) return -1; de->first_block = head; return 0;
+        int32_t head = alloc_chain(fs, need_blocks, -1);
+        if (head < 0) return -1;
+        de->first_block = head; return 0;
     }
     if (need_blocks > have_blocks) {
-        // extend chain by (need-have)
-        uint32_t add = need_blocks - have_blocks;
-        // find tail
-        int32_t tail = de->first_block; while (fs->fat[tail] != FAT_EOC) tail = fs->fat[tail];
-        // allocate additional blocks
-        int32_t head2 = alloc_chain(fs, add);
+        // extend chain by (need-have), preferably right after the tail
+        int32_t head2 = alloc_chain(fs, need_blocks - have_blocks, tail + 1);
         if (head2 < 0) return -1;
         // splice: replace EOC at tail with head2
-        fs->fat[tail] = head2;
+        fs->fat[tail] = head2; dirty_mark(fs, DIRTY_FAT, &fs->fat[tail], sizeof(int32_t));
         return 0;
     }
     // need < have: shrink
@@ -280,43 +652,355 @@ static int ensure_capacity(fs_t *fs, dirent_t *de, size_t new_size) {
     int32_t b = de->first_block; int32_t prev = -1;
     for (uint32_t i=0;i<keep;i++) { prev = b; b = fs->fat[b]; }
     // prev is last we keep; b is first to free (may be EOC)
-    if (prev >= 0) fs->fat[prev] = FAT_EOC;
+    if (prev >= 0) { fs->fat[prev] = FAT_EOC; dirty_mark(fs, DIRTY_FAT, &fs->fat[prev], sizeof(int32_t)); }
     if (b >= 0 && b != FAT_EOC) free_chain(fs, b);
     return 0;
 }
 
+// ---- Metadata journal ------------------------------------------------------
+// With a journal, commands edit a private copy of the FAT and directory and
+// log the blocks they touched into the running transaction. Commands finish
+// under the FS lock and then wait for their transaction. The first waiter
+// closes it and commits it: data pages are flushed, then one record holding
+// every touched metadata block is written and flushed. Commands that finish
+// during that flush join the next transaction (group commit). Committed
+// records are copied to their home blocks in the background (checkpoint) and
+// again at mount (replay), so W, A and D are all-or-nothing after a crash.
+
+static uint64_t jnl_sum(uint64_t seq, const uint8_t *p, size_t n) {
+    uint64_t h = 14695981039346656037ull ^ seq;   // FNV-1a
+    for (size_t i = 0; i < n; i++) { h ^= p[i]; h *= 1099511628211ull; }
+    return h;
+}
+
+static inline uint8_t *jnl_log(fs_t *fs, uint32_t pos) {
+    return block_ptr(fs, fs->sb->journal_start + 1 + pos);
+}
+
+// Flushes the pages holding bytes [p, p + len) of the mapping
+static void jnl_sync_span(fs_t *fs, const uint8_t *p, size_t len) {
+    size_t lo = (size_t)(p - fs->base) / fs->page * fs->page, hi = (size_t)(p - fs->base) + len;
+    msync(fs->base + lo, hi - lo, MS_SYNC);
+}
+
+// Flushes the data pages a closed transaction wrote (ranges taken from
+// fs->dirty[DIRTY_DATA] when it was closed). Every msync is a flush of its
+// own, so the ranges go in one call over the span they cover.
+static void jnl_sync_data(fs_t *fs, const prange_t *r, int n) {
+    if (n == 0) return;
+    size_t lo = r[0].lo, hi = r[0].hi;
+    for (int i = 1; i < n; i++) {
+        if (r[i].lo < lo) lo = r[i].lo;
+        if (r[i].hi > hi) hi = r[i].hi;
+    }
+    lo *= fs->page; hi *= fs->page;
+    if (hi > fs->bytes) hi = fs->bytes;
+    msync(fs->base + lo, hi - lo, MS_SYNC);
+}
+
+// Copies the record at *pos to its home blocks if it is intact and carries
+// *seq, and steps past it (a wrap marker just moves *pos to 0)
+static bool jnl_apply(fs_t *fs, uint32_t *pos, uint64_t *seq) {
+    super_t *sb = fs->sb; uint32_t L = sb->journal_blocks - 1;
+    if (*pos >= L) *pos = 0;
+    const jrec_t *r = (const jrec_t *)jnl_log(fs, *pos);
+    if (r->magic != JTX_MAGIC || r->seq != *seq) return false;
+    if (r->nblocks == 0) { if (*pos == 0) return false; *pos = 0; return true; }
+    uint32_t n = r->nblocks, ntag = (n + JNL_TAGS - 1) / JNL_TAGS;
+    if (n > sb->fat_blocks + sb->dir_blocks || (size_t)*pos + 1 + ntag + n > L) return false;
+    const uint8_t *body = (const uint8_t *)r + BLOCK_SIZE;
+    if (jnl_sum(*seq, body, (size_t)(ntag + n) * BLOCK_SIZE) != r->sum) return false;
+    const uint32_t *tag = (const uint32_t *)body;
+    for (uint32_t i = 0; i < n; i++) if (tag[i] < sb->fat_start || tag[i] >= sb->journal_start) return false;
+    for (uint32_t i = 0; i < n; i++) memcpy(block_ptr(fs, tag[i]), body + (size_t)(ntag + i) * BLOCK_SIZE, BLOCK_SIZE);
+    *pos += 1 + ntag + n; (*seq)++;
+    return true;
+}
+
+// Puts committed records in their home blocks, syncs those, then moves the
+// tail past them. Only records up to j_head, which are all on disk, are
+// applied. Caller holds j_io.
+static void jnl_checkpoint(fs_t *fs) {
+    pthread_mutex_lock(&fs->ck_lock);
+    pthread_mutex_lock(&fs->j_lock);
+    uint32_t pos = fs->j_tail, end = fs->j_head, L = fs->j_size; uint64_t seq = fs->j_tail_seq;
+    pthread_mutex_unlock(&fs->j_lock);
+    if (pos == end) { pthread_mutex_unlock(&fs->ck_lock); return; }
+    while (pos != end && !(pos == L && end == 0))
+        if (!jnl_apply(fs, &pos, &seq)) { fprintf(stderr, "journal: bad record at %u during checkpoint\n", pos); break; }
+    msync(fs->base, (size_t)fs->sb->journal_start * BLOCK_SIZE, MS_SYNC);
+
+    pthread_mutex_lock(&fs->j_lock);
+    fs->j_used -= pos >= fs->j_tail ? pos - fs->j_tail : L - fs->j_tail + pos;
+    if (fs->j_used == 0) pos = fs->j_head = 0;      // empty: the next record starts at the front
+    fs->j_tail = pos; fs->j_tail_seq = seq; fs->st_ckpts++;
+    jhdr_t *jh = (jhdr_t *)block_ptr(fs, fs->sb->journal_start);
+    jh->tail = pos; jh->tail_seq = seq;
+    pthread_mutex_unlock(&fs->j_lock);
+    size_t lo = (size_t)fs->sb->journal_start * BLOCK_SIZE / fs->page * fs->page;
+    msync(fs->base + lo, (size_t)(fs->sb->journal_start + 1) * BLOCK_SIZE - lo, MS_SYNC);
+    pthread_mutex_unlock(&fs->ck_lock);
+}
+
+// Closes the running transaction and puts it on disk; returns its seq
+static uint64_t jnl_commit(fs_t *fs) {
+    pthread_mutex_lock(&fs->lock);
+    uint64_t txn = fs->txn_seq++, gen = fs->fmt_gen;
+    uint32_t n = fs->txn_n, ntag = (n + JNL_TAGS - 1) / JNL_TAGS, len = 1 + ntag + n;
+    prange_t data[DIRTY_MAX]; int ndata = 0;
+    if (fs->meta && fs->txn_data) {
+        ndata = fs->ndirty[DIRTY_DATA];
+        memcpy(data, fs->dirty[DIRTY_DATA], (size_t)ndata * sizeof(prange_t));
+        fs->ndirty[DIRTY_DATA] = 0; fs->txn_data = false;
+    }
+    if (!fs->meta || n == 0) {                     // nothing to log (data alone still gets flushed)
+        pthread_mutex_unlock(&fs->lock);
+        jnl_sync_data(fs, data, ndata);
+        return txn;
+    }
+    uint8_t *rec = fs->j_rec;                      // only the committer uses it, and F waits for j_io
+    memset(rec, 0, (size_t)(1 + ntag) * BLOCK_SIZE);
+    uint32_t *tag = (uint32_t *)(rec + BLOCK_SIZE);
+    for (uint32_t i = 0; i < n; i++) {
+        tag[i] = fs->sb->fat_start + fs->txn_blocks[i];
+        memcpy(rec + (size_t)(1 + ntag + i) * BLOCK_SIZE, fs->meta + (size_t)fs->txn_blocks[i] * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    uint32_t *freed = fs->txn_free, nfreed = fs->txn_nfree;
+    fs->txn_free = fs->txn_free_spare; fs->txn_free_spare = NULL; fs->txn_nfree = 0; fs->txn_n = 0;
+    pthread_rwlock_rdlock(&fs->j_io);
+    pthread_mutex_unlock(&fs->lock);
+
+    // Reserve log space (a record never wraps; the end of the log is skipped)
+    uint32_t L = fs->j_size, pos;
+    uint64_t seq;
+    pthread_mutex_lock(&fs->j_lock);
+    for (;;) {
+        pos = fs->j_head;
+        uint32_t need = len + (pos + len > L ? L - pos : 0);
+        if (fs->j_used + need < L) { fs->j_used += need; seq = fs->j_seq++; break; }
+        pthread_mutex_unlock(&fs->j_lock);
+        jnl_checkpoint(fs);
+        pthread_mutex_lock(&fs->j_lock);
+    }
+    pthread_mutex_unlock(&fs->j_lock);
+    jrec_t *r = (jrec_t *)rec;
+    r->magic = JTX_MAGIC; r->nblocks = n; r->seq = seq;
+    r->sum = jnl_sum(seq, rec + BLOCK_SIZE, (size_t)(len - 1) * BLOCK_SIZE);
+
+    // Data the record points at goes first; only then can the record reach
+    // disk (writeback may flush the mapping at any time)
+    jnl_sync_data(fs, data, ndata);
+    if (pos + len > L) {
+        if (pos < L) {
+            jrec_t w = { .magic = JTX_MAGIC, .nblocks = 0, .seq = seq };
+            memcpy(jnl_log(fs, pos), &w, sizeof(w));
+            jnl_sync_span(fs, jnl_log(fs, pos), sizeof(w));
+        }
+        pos = 0;
+    }
+    memcpy(jnl_log(fs, pos), rec, (size_t)len * BLOCK_SIZE);
+    jnl_sync_span(fs, jnl_log(fs, pos), (size_t)len * BLOCK_SIZE);   // the commit
+
+    pthread_mutex_lock(&fs->j_lock);
+    fs->j_head = pos + len; fs->st_commits++;
+    if (fs->j_used * 2 > L) pthread_cond_signal(&fs->ck_cv);
+    pthread_mutex_unlock(&fs->j_lock);
+    pthread_rwlock_unlock(&fs->j_io);
+
+    // What the batch freed can be handed out again, and its list is the
+    // spare for the next commit (after an F, jnl_open made new ones)
+    pthread_mutex_lock(&fs->lock);
+    if (gen == fs->fmt_gen) {
+        for (uint32_t i = 0; i < nfreed; i++) fm_mark_free(fs, freed[i]);
+        fs->txn_free_spare = freed;
+    } else free(freed);
+    pthread_mutex_unlock(&fs->lock);
+    return txn;
+}
+
+// Returns once transaction seq is on disk. The first waiter commits; the
+// others sleep, and whoever is left when a commit ends commits the next batch.
+static void jnl_wait(fs_t *fs, uint64_t seq) {
+    if (seq == 0) return;
+    pthread_mutex_lock(&fs->j_lock);
+    fs->st_ops++;
+    while (fs->j_done < seq) {
+        if (fs->j_committing) { pthread_cond_wait(&fs->j_cv, &fs->j_lock); continue; }
+        fs->j_committing = true;
+        pthread_mutex_unlock(&fs->j_lock);
+        uint64_t done = jnl_commit(fs);
+        pthread_mutex_lock(&fs->j_lock);
+        fs->j_committing = false;
+        if (done > fs->j_done) fs->j_done = done;
+        pthread_cond_broadcast(&fs->j_cv);
+    }
+    pthread_mutex_unlock(&fs->j_lock);
+}
+
+static void *jnl_checkpointer(void *arg) {
+    fs_t *fs = arg;
+    for (;;) {
+        pthread_mutex_lock(&fs->j_lock);
+        struct timespec dl; clock_gettime(CLOCK_REALTIME, &dl);
+        long long ns = dl.tv_nsec + (long long)JNL_CKPT_MS * 1000000LL;
+        dl.tv_sec += (time_t)(ns / 1000000000LL); dl.tv_nsec = (long)(ns % 1000000000LL);
+        while (!fs->j_closed && fs->j_used * 2 <= fs->j_size)
+            if (pthread_cond_timedwait(&fs->ck_cv, &fs->j_lock, &dl) == ETIMEDOUT) break;
+        bool last = fs->j_closed;
+        pthread_mutex_unlock(&fs->j_lock);
+        if (last) break;
+        pthread_rwlock_rdlock(&fs->j_io);
+        if (fs->meta) jnl_checkpoint(fs);
+        pthread_rwlock_unlock(&fs->j_io);
+    }
+    return NULL;
+}
+
+// Mount: applies every intact record from the tail on, straight to the home
+// blocks, and leaves the log empty with the next seq at the point it stopped
+static void jnl_replay(fs_t *fs) {
+    super_t *sb = fs->sb;
+    if (sb->journal_blocks == 0) return;
+    jhdr_t *jh = (jhdr_t *)block_ptr(fs, sb->journal_start);
+    if (jh->magic != JNL_MAGIC) { fprintf(stderr, "journal: bad header, not replayed\n"); return; }
+    uint32_t pos = jh->tail; uint64_t seq = jh->tail_seq, first = seq;
+    while (jnl_apply(fs, &pos, &seq)) {}
+    if (seq == first) return;
+    msync(fs->base, (size_t)sb->journal_start * BLOCK_SIZE, MS_SYNC);
+    jh->tail = pos; jh->tail_seq = seq;
+    msync(fs->base, (size_t)(sb->journal_start + 1) * BLOCK_SIZE, MS_SYNC);
+    fprintf(stderr, "journal: replayed %llu transactions\n", (unsigned long long)(seq - first));
+}
+
+// Releases the private copy and the running transaction; fat/dir must be
+// rebound to the home blocks afterwards
+static void jnl_free(fs_t *fs) {
+    free(fs->meta); free(fs->txn_stamp); free(fs->txn_blocks); free(fs->txn_free); free(fs->txn_free_spare); free(fs->j_rec);
+    fs->meta = NULL; fs->txn_stamp = NULL; fs->txn_blocks = NULL; fs->txn_free = fs->txn_free_spare = NULL; fs->j_rec = NULL;
+    fs->txn_n = fs->txn_nfree = 0; fs->txn_data = false; fs->ndirty[DIRTY_DATA] = 0;
+}
+
+// Switches fat/dir to a private copy of the (replayed) home blocks
+static int jnl_open(fs_t *fs) {
+    super_t *sb = fs->sb;
+    if (sb->journal_blocks == 0) return 0;
+    jhdr_t *jh = (jhdr_t *)block_ptr(fs, sb->journal_start);
+    if (jh->magic != JNL_MAGIC) { fprintf(stderr, "journal: bad header\n"); return -1; }
+    fs->meta_blocks = sb->fat_blocks + sb->dir_blocks;
+    fs->meta = malloc((size_t)fs->meta_blocks * BLOCK_SIZE);
+    fs->txn_stamp = calloc(fs->meta_blocks, sizeof(uint64_t));
+    fs->txn_blocks = malloc(fs->meta_blocks * sizeof(uint32_t));
+    // Everything a commit needs is allocated here, so a commit cannot fail
+    // for memory: the largest record, and two free lists (the running
+    // transaction's and the one the previous commit is still handing back)
+    uint32_t ntag = (fs->meta_blocks + JNL_TAGS - 1) / JNL_TAGS, ndata = sb->total_blocks - sb->data_start;
+    fs->j_rec = malloc((size_t)(1 + ntag + fs->meta_blocks) * BLOCK_SIZE);
+    fs->txn_free = malloc((size_t)ndata * sizeof(uint32_t));
+    fs->txn_free_spare = malloc((size_t)ndata * sizeof(uint32_t));
+    if (!fs->meta || !fs->txn_stamp || !fs->txn_blocks || !fs->j_rec || !fs->txn_free || !fs->txn_free_spare) {
+        perror("malloc"); jnl_free(fs); return -1;
+    }
+    memcpy(fs->meta, block_ptr(fs, sb->fat_start), (size_t)fs->meta_blocks * BLOCK_SIZE);
+    fs->fat = (int32_t *)fs->meta;
+    fs->dir = (dirent_t *)(fs->meta + (size_t)sb->fat_blocks * BLOCK_SIZE);
+    if (jh->tail != 0) {       // the log is empty after replay: start it at the front
+        jh->tail = 0;
+        msync(fs->base, (size_t)(sb->journal_start + 1) * BLOCK_SIZE, MS_SYNC);
+    }
+    pthread_mutex_lock(&fs->j_lock);
+    fs->j_size = sb->journal_blocks - 1;
+    fs->j_head = fs->j_tail = 0;
+    fs->j_seq = fs->j_tail_seq = jh->tail_seq;
+    fs->j_used = 0;
+    pthread_mutex_unlock(&fs->j_lock);
+    return 0;
+}
+
+// F: drops the private copy and the running transaction (caller holds lock
+// and j_io exclusively, so no commit or checkpoint is in flight)
+static void jnl_drop(fs_t *fs) {
+    jnl_free(fs);
+    fs->fmt_gen++;
+    fs_bind_views(fs);
+}
+
+// Exit: stops the checkpointer, commits what is left and checkpoints it, so
+// the image needs no replay
+static void jnl_stop(fs_t *fs) {
+    pthread_mutex_lock(&fs->j_lock);
+    fs->j_closed = true; pthread_cond_signal(&fs->ck_cv);
+    pthread_mutex_unlock(&fs->j_lock);
+    pthread_join(fs->j_thread, NULL);
+    pthread_mutex_lock(&fs->lock); uint64_t seq = fs->txn_seq; pthread_mutex_unlock(&fs->lock);
+    jnl_wait(fs, seq);
+    pthread_rwlock_rdlock(&fs->j_io);
+    if (fs->meta) jnl_checkpoint(fs);
+    pthread_rwlock_unlock(&fs->j_io);
+    if (fs->st_commits)
+        fprintf(stderr, "journal: ops=%llu commits=%llu (%.2f ops/commit) checkpoints=%llu\n",
+                (unsigned long long)fs->st_ops, (unsigned long long)fs->st_commits,
+                (double)fs->st_ops / (double)fs->st_commits, (unsigned long long)fs->st_ckpts);
+}
+
 // ---- Command handlers ----------------------
 
+// A layout that does not fit (say --max-files too large) fails before
+// anything is dropped. Once the volume is formatted the free map and
+// directory index are rebuilt whatever happens to the journal.
 static int cmd_format(fs_t *fs) {
-    return fs_format(fs, fs->sb->cylinders, fs->sb->sectors);
+    super_t sb;
+    if (fs_layout(fs, fs->sb->cylinders, fs->sb->sectors, &sb) < 0) return -1;
+    pthread_rwlock_wrlock(&fs->j_io);
+    jnl_drop(fs);
+    fs_format(fs, fs->sb->cylinders, fs->sb->sectors);
+    if (jnl_open(fs) < 0) fprintf(stderr, "journal: not opened after F, running without it until restart\n");
+    pthread_rwlock_unlock(&fs->j_io);
+    if (fm_build(fs) < 0) return -1;
+    return dir_index_build(fs);
 }
 
 static int cmd_create(fs_t *fs, const char *name) {
     if (strlen(name) == 0) return 2;
     if (dir_find(fs, name) >= 0) return 1;
-    int idx = dir_find_free(fs); if (idx < 0) return 2;
+    int idx = dir_take_free(fs); if (idx < 0) return 2;
     dirent_t *de = &fs->dir[idx]; memset(de, 0, sizeof(*de));
     de->used = 1; de->first_block = -1; de->size_bytes = 0; strncpy(de->name, name, NAME_MAXLEN-1); de->name[NAME_MAXLEN-1]='\0';
-    msync((void*)de, sizeof(*de), MS_SYNC);
+    dir_index_add(fs, idx);
+    dirty_mark(fs, DIRTY_DIR, de, sizeof(*de)); dirty_sync(fs);
     return 0;
 }
 
 static int cmd_delete(fs_t *fs, const char *name) {
     int idx = dir_find(fs, name); if (idx < 0) return 1;
-    dirent_t *de = &fs->dir[idx];
-    if (de->first_block >= 0) free_chain(fs, de->first_block);
-    memset(de, 0, sizeof(*de)); msync((void*)de, sizeof(*de), MS_SYNC);
+    dirent_t *de = &fs->dir[idx]; int32_t first = de->first_block;
+    dir_index_remove(fs, idx);
+    // the dirent is synced before its blocks are freed, the reverse of a write
+    memset(de, 0, sizeof(*de)); dirty_mark(fs, DIRTY_DIR, de, sizeof(*de)); dirty_sync(fs);
+    if (first >= 0) { free_chain(fs, first); dirty_sync(fs); }
+    dir_put_free(fs, idx);
     return 0;
 }
 
 static int cmd_write(fs_t *fs, const char *name, const uint8_t *data, size_t len) {
     int idx = dir_find(fs, name); if (idx < 0) return 1;
-    dirent_t *de = &fs->dir[idx];
+    dirent_t *de = &fs->dir[idx], old = *de;
+    if (fs->meta) {
+        // journaled: new blocks, so a crash before the commit leaves the old contents
+        uint32_t blocks = (uint32_t)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        int32_t head = blocks ? alloc_chain(fs, blocks, -1) : -1;
+        if (blocks && head < 0) return 2;
+        if (head >= 0) io_write_chain(fs, head, 0, data, len);
+        if (de->first_block >= 0) free_chain(fs, de->first_block);
+        de->first_block = head; de->size_bytes = (uint32_t)len;
+        dirty_mark(fs, DIRTY_DIR, de, sizeof(*de)); dirty_sync(fs);
+        return 0;
+    }
     if (ensure_capacity(fs, de, len) < 0) return 2;
-    if (len > 0 && de->first_block >= 0) io_write_chain(fs, de->first_block, data, len);
+    if (len > 0 && de->first_block >= 0) io_write_chain(fs, de->first_block, 0, data, len);
     if (len == 0) { if (de->first_block >= 0) { free_chain(fs, de->first_block); de->first_block = -1; } }
     de->size_bytes = (uint32_t)len;
-    msync(fs->base, fs->bytes, MS_SYNC);
+    if (memcmp(&old, de, sizeof(old))) dirty_mark(fs, DIRTY_DIR, de, sizeof(*de));   // same-size overwrite: data only
+    dirty_sync(fs);
     return 0;
 }
 
@@ -325,18 +1009,9 @@ static int cmd_append(fs_t *fs, const char *name, const uint8_t *data, size_t le
     dirent_t *de = &fs->dir[idx]; size_t new_len = (size_t)de->size_bytes + len;
     if (ensure_capacity(fs, de, new_len) < 0) return 2;
     // write at offset = old size
-    size_t off = de->size_bytes; size_t left = len; const uint8_t *p = data;
-    if (de->first_block >= 0) {
-        // walk to block containing old tail
-        size_t skip = off; int32_t b = de->first_block; while (skip >= BLOCK_SIZE) { b = fs->fat[b]; skip -= BLOCK_SIZE; }
-        // write partial first block
-        size_t space = BLOCK_SIZE - skip; size_t to_copy = (left < space) ? left : space;
-        if (to_copy > 0) { memcpy(block_ptr(fs,(uint32_t)b)+skip, p, to_copy); p += to_copy; left -= to_copy; }
-        while (left > 0) {
-            b = fs->fat[b]; size_t n = (left < BLOCK_SIZE) ? left : BLOCK_SIZE; memcpy(block_ptr(fs,(uint32_t)b), p, n); if (n < BLOCK_SIZE) memset(block_ptr(fs,(uint32_t)b)+n, 0, BLOCK_SIZE-n); p += n; left -= n;
-        }
-    }
-    de->size_bytes = (uint32_t)new_len; msync(fs->base, fs->bytes, MS_SYNC);
+    if (len > 0 && de->first_block >= 0) io_write_chain(fs, de->first_block, de->size_bytes, data, len);
+    de->size_bytes = (uint32_t)new_len;
+    dirty_mark(fs, DIRTY_DIR, de, sizeof(*de)); dirty_sync(fs);
     return 0;
 }
 
@@ -362,34 +1037,47 @@ static void respond_code(int cfd, int code) {
 
 static void *client_thread(void *arg) {
     int cfd = *(int*)arg; free(arg);
+    conn_t *cn = malloc(sizeof(*cn)); if (!cn) { close(cfd); return NULL; }
+    cn->fd = cfd; cn->rpos = cn->rend = 0;
     char tok[64];
     for (;;) {
-        int rt = read_token(cfd, tok, sizeof(tok)); if (rt == 0) break; if (rt < 0) { perror("read_token"); break; }
+        int rt = conn_read_token(cn, tok, sizeof(tok)); if (rt == 0) break; if (rt < 0) { perror("read_token"); break; }
         if (!strcmp(tok, "F")) {
             pthread_mutex_lock(&g_fs.lock);
             int rc = cmd_format(&g_fs);
             pthread_mutex_unlock(&g_fs.lock);
             respond_code(cfd, rc == 0 ? 0 : 2);
         } else if (!strcmp(tok, "C")) {
-            char name[NAME_MAXLEN]; if (read_token(cfd, name, sizeof(name)) <= 0) break;
+            char name[NAME_MAXLEN]; if (conn_read_token(cn, name, sizeof(name)) <= 0) break;
             pthread_mutex_lock(&g_fs.lock);
             int rc = cmd_create(&g_fs, name);
+            uint64_t seq = g_fs.op_seq; g_fs.op_seq = 0;
             pthread_mutex_unlock(&g_fs.lock);
+            jnl_wait(&g_fs, seq);
             respond_code(cfd, rc);
         } else if (!strcmp(tok, "D")) {
-            char name[NAME_MAXLEN]; if (read_token(cfd, name, sizeof(name)) <= 0) break;
+            char name[NAME_MAXLEN]; if (conn_read_token(cn, name, sizeof(name)) <= 0) break;
             pthread_mutex_lock(&g_fs.lock);
             int rc = cmd_delete(&g_fs, name);
+            uint64_t seq = g_fs.op_seq; g_fs.op_seq = 0;
             pthread_mutex_unlock(&g_fs.lock);
+            jnl_wait(&g_fs, seq);
             respond_code(cfd, rc);
         } else if (!strcmp(tok, "L")) {
-            char flag[8]; if (read_token(cfd, flag, sizeof(flag)) <= 0) break;
-            int verbose = (flag[0] == '1');
+            char flag[8]; if (conn_read_token(cn, flag, sizeof(flag)) <= 0) break;
+            int verbose = (flag[0] == '1'), frag = (flag[0] == '2');
             pthread_mutex_lock(&g_fs.lock);
+            uint32_t files = 0, all_blocks = 0, all_runs = 0;
             for (uint32_t i=0;i<g_fs.sb->max_files;i++) {
                 dirent_t *de = &g_fs.dir[i];
                 if (!de->used) continue;
-                if (verbose) {
+                if (frag) {
+                    // fragmentation report: blocks, contiguous runs, average run length
+                    uint32_t nb, runs = chain_runs(&g_fs, de->first_block, &nb);
+                    files++; all_blocks += nb; all_runs += runs;
+                    char line[256]; int n = snprintf(line, sizeof(line), "%s %u %u %u %.1f\n", de->name, de->size_bytes, nb, runs, runs ? (double)nb / runs : 0.0);
+                    write_full(cfd, line, (size_t)n);
+                } else if (verbose) {
                     char line[256]; int n = snprintf(line, sizeof(line), "%s %u\n", de->name, de->size_bytes);
                     write_full(cfd, line, (size_t)n);
                 } else {
@@ -397,10 +1085,21 @@ static void *client_thread(void *arg) {
                     write_full(cfd, line, (size_t)n);
                 }
             }
+            if (frag) {
+                uint32_t free_runs = 0, largest = 0;
+                for (int32_t b = fm_next_free(&g_fs, g_fs.sb->data_start); b >= 0; ) {
+                    uint32_t n = fm_run_len(&g_fs, (uint32_t)b, UINT32_MAX);
+                    free_runs++; if (n > largest) largest = n;
+                    b = fm_next_free(&g_fs, (uint32_t)b + n);
+                }
+                char line[256]; int n = snprintf(line, sizeof(line), "# files=%u blocks=%u runs=%u avg_run=%.1f free=%u free_runs=%u largest_free=%u\n",
+                                                 files, all_blocks, all_runs, all_runs ? (double)all_blocks / all_runs : 0.0, g_fs.free_blocks, free_runs, largest);
+                write_full(cfd, line, (size_t)n);
+            }
             pthread_mutex_unlock(&g_fs.lock);
             write_full(cfd, "\n", 1); // terminator line
         } else if (!strcmp(tok, "R")) {
-            char name[NAME_MAXLEN]; if (read_token(cfd, name, sizeof(name)) <= 0) break;
+            char name[NAME_MAXLEN]; if (conn_read_token(cn, name, sizeof(name)) <= 0) break;
             pthread_mutex_lock(&g_fs.lock);
             uint8_t *buf=NULL; size_t len=0; int rc = cmd_read(&g_fs, name, &buf, &len);
             pthread_mutex_unlock(&g_fs.lock);
@@ -411,29 +1110,38 @@ static void *client_thread(void *arg) {
         } else if (!strcmp(tok, "W") || !strcmp(tok, "A")) {
             int is_append = (tok[0] == 'A');
             char name[NAME_MAXLEN], ltok[32];
-            if (read_token(cfd, name, sizeof(name)) <= 0 || read_token(cfd, ltok, sizeof(ltok)) <= 0) break;
+            if (conn_read_token(cn, name, sizeof(name)) <= 0 || conn_read_token(cn, ltok, sizeof(ltok)) <= 0) break;
             long l = strtol(ltok, NULL, 10); if (l < 0) { respond_code(cfd, 2); continue; }
-            uint8_t *buf = NULL; if (l > 0) { buf = malloc((size_t)l); if (!buf) { respond_code(cfd, 2); continue; } if (read_full(cfd, buf, (size_t)l) != (ssize_t)l) { free(buf); break; } }
+            uint8_t *buf = NULL; if (l > 0) { buf = malloc((size_t)l); if (!buf) { respond_code(cfd, 2); continue; } if (conn_read_full(cn, buf, (size_t)l) != (ssize_t)l) { free(buf); break; } }
             pthread_mutex_lock(&g_fs.lock);
             int rc = is_append ? cmd_append(&g_fs, name, buf, (size_t)l)
                                : cmd_write(&g_fs,  name, buf, (size_t)l);
+            uint64_t seq = g_fs.op_seq; g_fs.op_seq = 0;
             pthread_mutex_unlock(&g_fs.lock);
             free(buf);
+            jnl_wait(&g_fs, seq);   // reply once the command's transaction is on disk
             respond_code(cfd, rc);
         } else {
             // unknown command — ignore line
         }
     }
-    close(cfd); return NULL;
+    close(cfd); free(cn); return NULL;
 }
 
 static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s <port> <cylinders> <sectors_per_cyl> <backing_file>\n", prog);
+    fprintf(stderr, "Usage: %s <port> <cylinders> <sectors_per_cyl> <backing_file> [--max-files=N] [--journal-blocks=N]\n", prog);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 5) { usage(argv[0]); return 1; }
+    if (argc < 5 || argc > 7) { usage(argv[0]); return 1; }
     const char *port = argv[1]; uint32_t cyl = (uint32_t)atoi(argv[2]); uint32_t sec = (uint32_t)atoi(argv[3]); const char *file = argv[4];
+    long max_files = BLOCK_SIZE / sizeof(dirent_t) * DIR_DEFAULT_BLOCKS;
+    long journal_blocks = -1;
+    for (int i = 5; i < argc; i++) {
+        if (!strncmp(argv[i], "--max-files=", 12) && (max_files = atol(argv[i] + 12)) > 0) continue;
+        if (!strncmp(argv[i], "--journal-blocks=", 17) && (journal_blocks = atol(argv[i] + 17)) >= 0) continue;
+        usage(argv[0]); return 1;
+    }
     if (cyl == 0 || sec == 0) { usage(argv[0]); return 1; }
 
     signal(SIGINT, on_sigint);
@@ -448,16 +1156,25 @@ int main(int argc, char **argv) {
 
     // Bind global FS
     memset(&g_fs, 0, sizeof(g_fs)); g_fs.fd = fd; g_fs.base = base; g_fs.bytes = map_bytes; pthread_mutex_init(&g_fs.lock, NULL);
+    g_fs.page = (size_t)sysconf(_SC_PAGESIZE);
+    g_fs.fmt_journal_blocks = journal_blocks; g_fs.txn_seq = 1;
+    pthread_rwlock_init(&g_fs.j_io, NULL); pthread_mutex_init(&g_fs.ck_lock, NULL); pthread_mutex_init(&g_fs.j_lock, NULL);
+    pthread_cond_init(&g_fs.j_cv, NULL); pthread_cond_init(&g_fs.ck_cv, NULL);
+    g_fs.fmt_dir_blocks = (uint32_t)((max_files * (long)sizeof(dirent_t) + BLOCK_SIZE - 1) / BLOCK_SIZE);
 
     // If superblock looks valid, bind; otherwise, initialize a tentative sb and expect F
     super_t *sb = (super_t *)block_ptr(&g_fs, 0);
     if (sb->magic == 0x46534C31u && sb->cylinders == cyl && sb->sectors == sec && sb->block_size == BLOCK_SIZE) {
         g_fs.sb = sb; g_fs.fat = (int32_t *)block_ptr(&g_fs, sb->fat_start); g_fs.dir = (dirent_t *)block_ptr(&g_fs, sb->dir_start);
+        jnl_replay(&g_fs);
+        if (jnl_open(&g_fs) < 0) return 1;
     } else {
         // writes a minimal header so format knows geometry
         memset(sb, 0, sizeof(*sb)); sb->magic = 0x46534C31u; sb->cylinders = cyl; sb->sectors = sec; sb->block_size = BLOCK_SIZE; sb->total_blocks = (uint32_t)total_blocks;
         fs_bind_views(&g_fs);
     }
+    if (fm_build(&g_fs) < 0 || dir_index_build(&g_fs) < 0) return 1;
+    pthread_create(&g_fs.j_thread, NULL, jnl_checkpointer, &g_fs);
 
     int lfd = mk_listen_socket(port); if (lfd < 0) { fprintf(stderr, "listen failed on %s\n", port); return 1; }
     fprintf(stderr, "fs_server listening on %s (cyl=%u sec=%u)\n", port, cyl, sec);
@@ -470,6 +1187,6 @@ int main(int argc, char **argv) {
         *hp = cfd; pthread_t th; pthread_create(&th, NULL, client_thread, hp); pthread_detach(th);
     }
 
-    close(lfd); msync(g_fs.base, g_fs.bytes, MS_SYNC); munmap(g_fs.base, g_fs.bytes); close(g_fs.fd);
+    close(lfd); jnl_stop(&g_fs); msync(g_fs.base, g_fs.bytes, MS_SYNC); munmap(g_fs.base, g_fs.bytes); close(g_fs.fd);
     return 0;
 }
@@ -0,0 +1,55 @@
+// Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
+// Description: Allocator microbenchmark for bench_alloc.sh. Builds the FS server in (its main renamed),
+//              formats an in-memory volume without a journal, fills 90% of it with 64-block files
+//              and times alloc_chain()/free_chain(). "holes" then frees 10% of the files and refills
+//              each with half as much, so the free space is scattered instead of all at the tail.
+// Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread -DSRC='"file_system_server.c"' alloc_bench.c -o alloc_bench
+// Run:           ./alloc_bench <cylinders> [holes]        (256 sectors per cylinder)
+
+#define main fs_main
+#include SRC
+#undef main
+
+#define ROUNDS 2000             // rounds of 64 single-block allocations
+#define FILE_BLOCKS 64
+
+static double now(void) { struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return t.tv_sec + t.tv_nsec * 1e-9; }
+
+// Stands in for the end of a command: the benchmark never syncs, so just drop the ranges
+static void end_op(fs_t *fs) { memset(fs->ndirty, 0, sizeof fs->ndirty); }
+
+int main(int argc, char **argv) {
+    if (argc < 2) { fprintf(stderr, "Usage: %s <cylinders> [holes]\n", argv[0]); return 1; }
+    uint32_t cyl = (uint32_t)atoi(argv[1]), sec = 256; bool holes = argc > 2;
+    fs_t *fs = &g_fs;
+    fs->bytes = (size_t)cyl * sec * BLOCK_SIZE; fs->base = calloc(1, fs->bytes); fs->fd = -1;
+    fs->page = (size_t)sysconf(_SC_PAGESIZE); fs->fmt_dir_blocks = 8; fs->fmt_journal_blocks = 0;
+    if (!fs->base || fs_format(fs, cyl, sec) < 0 || fm_build(fs) < 0) { fprintf(stderr, "format failed\n"); return 1; }
+
+    uint32_t data = fs->sb->total_blocks - fs->sb->data_start, nf = data / 10 * 9 / FILE_BLOCKS;
+    int32_t *files = malloc(nf * sizeof(int32_t));
+    if (!files) { perror("malloc"); return 1; }
+    for (uint32_t i = 0; i < nf; i++) { files[i] = alloc_chain(fs, FILE_BLOCKS, -1); end_op(fs); }
+    if (holes) {
+        srand(1);
+        for (uint32_t i = 0; i < nf / 10; i++) {
+            uint32_t k = (uint32_t)rand() % nf;
+            if (files[k] < 0) continue;
+            free_chain(fs, files[k]); files[k] = alloc_chain(fs, FILE_BLOCKS / 2, -1); end_op(fs);
+        }
+    }
+
+    int32_t h[64]; double t0 = now();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < 64; i++) { h[i] = alloc_chain(fs, 1, -1); end_op(fs); }
+        for (int i = 0; i < 64; i++) { free_chain(fs, h[i]); end_op(fs); }
+    }
+    double t1 = now();
+    for (int r = 0; r < ROUNDS / 10; r++) { int32_t c = alloc_chain(fs, 4096, -1); free_chain(fs, c); end_op(fs); }
+    double t2 = now();
+
+    printf("blocks=%u %-5s: 1-block alloc+free %.3f us, 4096-block chain alloc+free %.1f us\n",
+           fs->sb->total_blocks, holes ? "holes" : "tail",
+           (t1 - t0) / (ROUNDS * 64.0) * 1e6, (t2 - t1) / (ROUNDS / 10) * 1e6);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#!/bin/bash
+set -euo pipefail
+export LC_ALL=C
+
+# Block allocator on a 90%-full volume, called in-process (no sockets, no msync).
+# Volumes of 400 and 4000 cylinders x 256 sectors: 102400 and 1024000 blocks.
+echo "Compiling allocator benchmarks…"
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread -DSRC='"file_system_server.c"'           "alloc_bench.c" -o alloc_bench
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread -DSRC='"file_system_server+directory.c"' "alloc_bench.c" -o alloc_bench_dirs
+echo
+
+for bin in alloc_bench alloc_bench_dirs; do
+  echo "=== $bin ==="
+  for cyl in 400 4000; do
+    ./$bin "$cyl"
+    ./$bin "$cyl" holes
+  done
+  echo
+done
+echo "Allocator benchmark complete"
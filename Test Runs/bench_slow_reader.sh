@@ -0,0 +1,44 @@
+#!/bin/bash
+set -euo pipefail
+export LC_ALL=C
+
+# Head-of-line blocking: 8 binary connections run for a few seconds, first
+# alone and then next to a client that pipelines RR requests and barely reads
+# the replies. A server that sends while holding the media stalls the others.
+echo "Compiling disk_server, random_client and slow_reader…"
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "disk_server.c"   -o disk_server
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "random_client.c" -o disk_client_rand -lm
+gcc -O2 -std=c17 -Wall -Wextra -pedantic          "slow_reader.c"   -o slow_reader
+echo
+
+logdir="test_logs"; mkdir -p "$logdir"
+
+wait_for_port() { local p="$1"; for _ in {1..50}; do (echo >"/dev/tcp/127.0.0.1/$p") >/dev/null 2>&1 && return 0; sleep 0.1; done; echo "Port $p not ready" >&2; return 1; }
+start_server()   { local cmd="$1" log="$2"; echo "[server] $cmd" >&2; bash -lc "exec $cmd" >"$log" 2>&1 & echo $!; }
+
+SECS=3; PORT=9192
+load() { # out
+  ./disk_client_rand 127.0.0.1 "$PORT" 0 42 --bin --conns=8 --duration="$SECS" >"$1" 2>&1
+  grep -q "errors=0" "$1" || { echo "ERROR: random_client saw errors ($1)" >&2; exit 1; }
+  local ops p99; ops=$(sed -n 's/.*throughput=\([0-9.]*\).*/\1/p' "$1"); p99=$(sed -n 's/.* p99=\([0-9.]*\).*/\1/p' "$1")
+  echo "$ops ops/s, p99 $p99 us"
+}
+
+for track in 10 0; do
+  echo "=== disk_server 200x32, track_us=$track ==="
+  rm -f ./bench_slow.img
+  PID=$(start_server "./disk_server $PORT 200 32 $track ./bench_slow.img" "$logdir/bench_slow_server_$track.log")
+  trap 'kill -TERM $PID >/dev/null 2>&1 || true' EXIT
+  wait_for_port "$PORT"
+
+  echo "baseline:         $(load "$logdir/bench_slow_base_$track.txt")"
+  ./slow_reader "$PORT" $((SECS + 2)) >"$logdir/bench_slow_reader_$track.txt" & SR=$!
+  sleep 0.5                                         # let its replies back up first
+  echo "with slow reader: $(load "$logdir/bench_slow_load_$track.txt")"
+  kill "$SR" 2>/dev/null || true; wait "$SR" 2>/dev/null || true
+
+  kill -TERM "$PID" || true
+  trap - EXIT
+  echo
+done
+echo "Slow-reader benchmark complete; logs in $logdir/"
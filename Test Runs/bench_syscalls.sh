@@ -0,0 +1,57 @@
+#!/bin/bash
+set -euo pipefail
+export LC_ALL=C
+
+# Input syscalls per request. Each server runs under syscall_count.so, which
+# prints its read()/recv() totals on exit; one closed-loop connection drives it.
+echo "Compiling servers and the syscall counter…"
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "disk_server.c"        -o disk_server
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "random_client.c"      -o disk_client_rand -lm
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "file_system_server.c" -o fs_server
+gcc -O2 -Wall -Wextra -shared -fPIC "syscall_count.c" -o syscall_count.so -ldl
+echo
+
+logdir="test_logs"; mkdir -p "$logdir"
+
+wait_for_port() { local p="$1"; for _ in {1..50}; do (echo >"/dev/tcp/127.0.0.1/$p") >/dev/null 2>&1 && return 0; sleep 0.1; done; echo "Port $p not ready" >&2; return 1; }
+start_server()   { local cmd="$1" log="$2"; echo "[server] $cmd" >&2; bash -lc "exec env LD_PRELOAD=$PWD/syscall_count.so $cmd" >"$log" 2>&1 & echo $!; }
+stop_server()    { local pid="$1" sig="$2"; kill "-$sig" "$pid"; for _ in {1..100}; do kill -0 "$pid" 2>/dev/null || return 0; sleep 0.1; done; echo "server $pid did not exit" >&2; return 1; }
+per_op()         { # log ops -> "N.NN"
+  local r; r=$(sed -n 's/^syscalls: read=\([0-9]*\) recv=\([0-9]*\)$/\1 \2/p' "$1" | tail -n 1)
+  [[ -n "$r" ]] || { echo "ERROR: no syscall totals in $1" >&2; exit 1; }
+  set -- $r "$2"; awk -v a="$1" -v b="$2" -v n="$3" 'BEGIN { printf "%.2f", (a + b) / n }'
+}
+now_ms() { echo $(( $(date +%s%N) / 1000000 )); }
+
+echo "=== disk_server: random R/W, one connection, track_us=0 ==="
+OPS=20000; PORT=9190
+rm -f ./bench_disk.img
+PID=$(start_server "./disk_server $PORT 200 32 0 ./bench_disk.img" "$logdir/bench_syscalls_disk.log")
+trap 'kill -TERM $PID >/dev/null 2>&1 || true' EXIT
+wait_for_port "$PORT"
+./disk_client_rand 127.0.0.1 "$PORT" "$OPS" 1 | tee "$logdir/bench_syscalls_rand.txt"
+stop_server "$PID" TERM; trap - EXIT
+tput=$(sed -n 's/.*throughput=\([0-9.]*\).*/\1/p' "$logdir/bench_syscalls_rand.txt")
+echo "disk_server: $OPS ops, $(per_op "$logdir/bench_syscalls_disk.log" "$OPS") input syscalls/op, $tput ops/s"
+echo
+
+echo "=== file_system_server: W a 128, one connection ==="
+OPS=5000; PORT=9191
+rm -f ./bench_fs.img
+PID=$(start_server "./fs_server $PORT 256 256 ./bench_fs.img" "$logdir/bench_syscalls_fs.log")
+trap 'kill -INT $PID >/dev/null 2>&1 || true' EXIT
+wait_for_port "$PORT"
+exec 3<>"/dev/tcp/127.0.0.1/$PORT"
+printf 'F ' >&3; read -r rc <&3; printf 'C a ' >&3; read -r rc <&3
+blk=$(head -c 128 /dev/zero | tr '\0' w)
+t0=$(now_ms)
+for _ in $(seq 1 "$OPS"); do
+  printf 'W a 128 %s' "$blk" >&3; read -r rc <&3
+  [[ "$rc" == 0 ]] || { echo "ERROR: W returned $rc" >&2; exit 1; }
+done
+ms=$(( $(now_ms) - t0 )); (( ms > 0 )) || ms=1
+exec 3>&-
+stop_server "$PID" INT; trap - EXIT
+echo "file_system_server: $OPS ops, $(per_op "$logdir/bench_syscalls_fs.log" $((OPS + 2))) input syscalls/op, $(( OPS * 1000 / ms )) ops/s"
+echo
+echo "Syscall benchmark complete; logs in $logdir/"
@@ -0,0 +1,55 @@
+// Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
+// Description: Slow reader for bench_slow_reader.sh. Pipelines 1024 text "RR 0 0 256" requests on one
+//              connection with a small receive buffer, then drains the replies at ~2 KB/s, so the
+//              server's sends to it block for the whole run.
+// Compile Build: gcc -O2 -std=c17 -Wall -Wextra -pedantic slow_reader.c -o slow_reader
+// Run:           ./slow_reader <port> <seconds>
+
+// Libraries used
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NREQ   1024
+#define CHUNK  200              // bytes drained per tick
+#define TICK_MS 100
+
+int main(int argc, char **argv) {
+    if (argc != 3) { fprintf(stderr, "Usage: %s <port> <seconds>\n", argv[0]); return 1; }
+    int port = atoi(argv[1]); double secs = atof(argv[2]);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int rcv = 4096;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcv, sizeof rcv);   // before connect, so the window stays small
+    struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons((unsigned short)port) };
+    inet_pton(AF_INET, "127.0.0.1", &sa.sin_addr);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof sa) < 0) { perror("connect"); return 1; }
+
+    static const char req[] = "RR 0 0 256 ";
+    static char out[NREQ * (sizeof req - 1)];
+    for (int i = 0; i < NREQ; i++) memcpy(out + i * (sizeof req - 1), req, sizeof req - 1);
+    for (size_t off = 0; off < sizeof out; ) {
+        ssize_t w = send(fd, out + off, sizeof out - off, 0);
+        if (w <= 0) { perror("send"); return 1; }
+        off += (size_t)w;
+    }
+
+    char buf[CHUNK];
+    struct timespec tick = { 0, TICK_MS * 1000000L };
+    long drained = 0;
+    for (long n = (long)(secs * 1000 / TICK_MS); n > 0; n--) {
+        ssize_t r = recv(fd, buf, sizeof buf, 0);
+        if (r <= 0) break;
+        drained += r;
+        nanosleep(&tick, NULL);
+    }
+    printf("slow_reader: drained %ld bytes\n", drained);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,33 @@
+// Names: Ifunanya Okafor and Andy Lim || Course: CS 4440-03
+// Description: LD_PRELOAD shim for bench_syscalls.sh. Counts the read() and recv() calls a server
+//              makes (all threads) and prints the totals to stderr when the process exits.
+// Compile Build: gcc -O2 -Wall -Wextra -shared -fPIC syscall_count.c -o syscall_count.so -ldl
+// Run:           LD_PRELOAD=./syscall_count.so ./disk_server 9190 200 32 0 disk.img
+
+// Libraries used
+#define _GNU_SOURCE             // RTLD_NEXT
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static atomic_long n_read, n_recv;
+
+ssize_t read(int fd, void *buf, size_t n) {
+    static ssize_t (*real)(int, void *, size_t);
+    if (!real) real = (ssize_t (*)(int, void *, size_t))dlsym(RTLD_NEXT, "read");
+    n_read++;
+    return real(fd, buf, n);
+}
+
+ssize_t recv(int fd, void *buf, size_t n, int flags) {
+    static ssize_t (*real)(int, void *, size_t, int);
+    if (!real) real = (ssize_t (*)(int, void *, size_t, int))dlsym(RTLD_NEXT, "recv");
+    n_recv++;
+    return real(fd, buf, n, flags);
+}
+
+__attribute__((destructor)) static void report(void) {
+    fprintf(stderr, "syscalls: read=%ld recv=%ld\n", (long)n_read, (long)n_recv);
+}
@@ -3,8 +3,9 @@ set -euo pipefail
 
 echo "Compiling Q3 sources…"
 gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "disk_server.c" -o disk_server
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "disk_proxy.c"  -o disk_proxy
 gcc -O2 -std=c17 -Wall -Wextra -pedantic          "command_client.c" -o disk_client_cli
-gcc -O2 -std=c17 -Wall -Wextra -pedantic          "random_client.c"  -o disk_client_rand
+gcc -O2 -std=c17 -Wall -Wextra -pedantic -pthread "random_client.c"  -o disk_client_rand -lm
 echo
 
 logdir="test_logs"; mkdir -p "$logdir"
@@ -20,18 +21,19 @@ wait_for_port() { # the ip adress + TCP port
 
 start_server() { # cmd log
   local cmd="$1" log="$2"
-  echo "[server] $cmd"
-  bash -lc "$cmd" >"$log" 2>&1 & echo $!
+  echo "[server] $cmd" >&2
+  bash -lc "exec $cmd" >"$log" 2>&1 & echo $!
 }
 
 echo "=== Q3: disk_server + clients (correct + error runs) ==="
 PORT=9090
 IMG="./disk.img"
+rm -f "$IMG"                        # fresh image so the proxy run below can be diffed
 PID=$(start_server "./disk_server $PORT 4 8 100 $IMG --sync=after" "$logdir/q3_server.log")
 trap 'kill -TERM $PID >/dev/null 2>&1 || true' EXIT
 wait_for_port "$PORT"
 
-{
+cli_script() {
   echo "I"
   echo "R 0 0"
   echo "W 0 0 5"; echo "hello"      # valid write
@@ -40,7 +42,8 @@ wait_for_port "$PORT"
   echo "W 0 9 3"; echo "abc"        # invalid sector
   echo "W 0 0 129"                  # invalid length
   echo "exit"
-} | ./disk_client_cli 127.0.0.1 "$PORT" | tee "$logdir/q3_cli.txt"
+}
+cli_script | ./disk_client_cli 127.0.0.1 "$PORT" | tee "$logdir/q3_cli.txt"
 
 ./disk_client_rand 127.0.0.1 "$PORT" 50 42 | tee "$logdir/q3_rand.txt"
 
@@ -49,4 +52,70 @@ wait
 
 kill -TERM "$PID" || true
 trap - EXIT
+
+echo
+echo "=== Q3: disk_proxy over two backends (same transcript) ==="
+# Two 2-cylinder backends behind the proxy look like the single 4x8 disk above
+PPORT=9093; B1=9091; B2=9092
+rm -f ./disk_a.img ./disk_b.img
+P1=$(start_server "./disk_server $B1 2 8 100 ./disk_a.img --sync=after" "$logdir/q3_backend1.log")
+P2=$(start_server "./disk_server $B2 2 8 100 ./disk_b.img --sync=after" "$logdir/q3_backend2.log")
+trap 'kill -TERM $P1 $P2 >/dev/null 2>&1 || true' EXIT
+wait_for_port "$B1"; wait_for_port "$B2"
+PP=$(start_server "./disk_proxy $PPORT 127.0.0.1:$B1,127.0.0.1:$B2" "$logdir/q3_proxy.log")
+trap 'kill -TERM $PP $P1 $P2 >/dev/null 2>&1 || true' EXIT
+wait_for_port "$PPORT"
+
+cli_script | ./disk_client_cli 127.0.0.1 "$PPORT" | tee "$logdir/q3_proxy_cli.txt"
+diff "$logdir/q3_cli.txt" "$logdir/q3_proxy_cli.txt" && echo "proxy CLI transcript matches the direct run"
+
+./disk_client_rand 127.0.0.1 "$PPORT" 50 42 | tee "$logdir/q3_proxy_rand.txt"
+for i in $(seq 1 5); do ./disk_client_rand 127.0.0.1 "$PPORT" 20 "$i" >"$logdir/q3_proxy_rand_$i.txt" & done
+wait
+cat "$logdir"/q3_proxy_rand_*.txt
+for f in "$logdir"/q3_proxy_rand*.txt; do
+  grep -q "errors=0" "$f" || { echo "ERROR: random_client saw errors through the proxy ($f)" >&2; exit 1; }
+done
+
+kill -TERM "$PP" "$P1" "$P2" || true
+trap - EXIT
+
+echo
+echo "=== Q3: disk_proxy --pool=1 under pipelined RR/WR ==="
+# Every client shares one connection per backend. Replies pile up while
+# frames are still being written, so the proxy must read while it sends.
+QPORT=9094; B3=9095; B4=9096; QCLIENTS=8; QPAIRS=250
+rm -f ./disk_c.img ./disk_d.img
+P3=$(start_server "./disk_server $B3 4 256 100 ./disk_c.img" "$logdir/q3_pool_backend1.log")
+P4=$(start_server "./disk_server $B4 4 256 100 ./disk_d.img" "$logdir/q3_pool_backend2.log")
+trap 'kill -TERM $P3 $P4 >/dev/null 2>&1 || true' EXIT
+wait_for_port "$B3"; wait_for_port "$B4"
+PQ=$(start_server "./disk_proxy $QPORT 127.0.0.1:$B3,127.0.0.1:$B4 --pool=1 --depth=256" "$logdir/q3_pool_proxy.log")
+trap 'kill -TERM $PQ $P3 $P4 >/dev/null 2>&1 || true' EXIT
+wait_for_port "$QPORT"
+
+# Each pair writes 256 sectors of 'A' and reads them back: "1", then "1" + data
+blk=$(head -c $((256 * 128)) /dev/zero | tr '\0' A)
+for k in $(seq 1 "$QPAIRS"); do printf 'WR %d 0 256\n%sRR %d 0 256\n' $((k % 8)) "$blk" $((k % 8)); done >"$logdir/q3_pool_in.txt"
+for k in $(seq 1 "$QPAIRS"); do printf '11%s' "$blk"; done >"$logdir/q3_pool_expect.txt"
+pipe_client() { # out
+  exec 3<>"/dev/tcp/127.0.0.1/$QPORT"
+  cat "$logdir/q3_pool_in.txt" >&3 & local w=$!
+  local rc=0
+  timeout 60 head -c "$(wc -c <"$logdir/q3_pool_expect.txt")" <&3 >"$1" || rc=1
+  kill "$w" 2>/dev/null || true; wait "$w" 2>/dev/null || true
+  exec 3>&-
+  return $rc
+}
+cpids=()
+for i in $(seq 1 "$QCLIENTS"); do pipe_client "$logdir/q3_pool_out_$i.txt" & cpids+=($!); done
+for p in "${cpids[@]}"; do wait "$p" || { echo "ERROR: pipelined client timed out through --pool=1 proxy" >&2; exit 1; }; done
+for i in $(seq 1 "$QCLIENTS"); do
+  cmp -s "$logdir/q3_pool_expect.txt" "$logdir/q3_pool_out_$i.txt" ||
+    { echo "ERROR: wrong replies through --pool=1 proxy (client $i)" >&2; exit 1; }
+done
+echo "$QCLIENTS clients x $((2 * QPAIRS)) pipelined RR/WR through --pool=1: all replies correct"
+
+kill -TERM "$PQ" "$P3" "$P4" || true
+trap - EXIT
 echo "Q3 tests complete; transcripts in $logdir/"